@@ -52,22 +52,42 @@
 #include <freeradius-devel/dlist.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <stddef.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #ifdef HAVE_PTHREAD_H
 #   include <pthread.h>
 #endif // HAVE_PTHREAD_H
 
+#ifdef __linux__
+#   include <sys/inotify.h>
+#endif // __linux__
+
+#if ( (defined(__x86_64__) || defined(__i386__)) && ((defined(__GNUC__)) || (defined(__clang__))) )
+#   include <immintrin.h>
+#endif
+
 #ifdef HAVE_OPENSSL_EVP_H
 #   include <openssl/hmac.h>
 #   include <openssl/evp.h>
 #   include <freeradius-devel/openssl3.h>
 #endif // HAVE_OPENSSL_EVP_H
 
+#include "totp_code_store.h"
+
 
 //////////////
 //          //
@@ -81,6 +101,11 @@
 #  define pthread_mutex_unlock(_x)  rad_assert(_x == NULL)
 #endif // !HAVE_PTHREAD_H
 
+#define totp_stats_add(_cache, _field, _n) \
+   __atomic_fetch_add(&(_cache)->stats._field, (_n), __ATOMIC_RELAXED)
+#define totp_stats_max(_cache, _field, _n) \
+   totp_stats_update_max(&(_cache)->stats._field, (_n))
+
 
 ///////////////////
 //               //
@@ -91,6 +116,15 @@
 
 #define RLM_TOTP_CODE_EBASE32       -1
 #define RLM_TOTP_CODE_EBUFSIZ       -2
+#define RLM_TOTP_CODE_EHEX          -3
+#define RLM_TOTP_CODE_EBASE64       -4
+#define RLM_TOTP_CODE_EDECRYPT      -5
+
+#define RLM_TOTP_ENCODING_AUTO      0
+#define RLM_TOTP_ENCODING_BASE32    32
+#define RLM_TOTP_ENCODING_BASE64    64
+#define RLM_TOTP_ENCODING_HEX       16
+#define RLM_TOTP_ENCODING_ENCRYPTED 1         // AES-256-GCM, kept apart from encoded secrets in key cache
 
 #define RLM_TOTP_HMAC_SHA1          1
 #define RLM_TOTP_HMAC_SHA224        224
@@ -101,13 +135,84 @@
 #define TOTP_SCOPE_CONTROL          0
 #define TOTP_SCOPE_REPLY            1
 #define TOTP_SCOPE_REQUEST          2
+#define TOTP_SCOPES                 3
+
+// attributes collected from request lists by totp_request_vp_gather()
+#define RLM_TOTP_VP_PASS            0
+#define RLM_TOTP_VP_SECRET          1
+#define RLM_TOTP_VP_KEY             2
+#define RLM_TOTP_VP_ENCRYPTED_KEY   3
+#define RLM_TOTP_VP_CACHE_ID        4
+#define RLM_TOTP_VP_GATE_KEY        5
+#define RLM_TOTP_VP_TIME_OFFSET     6
+#define RLM_TOTP_VP_START_TIME      7
+#define RLM_TOTP_VP_TIME_STEP       8
+#define RLM_TOTP_VP_OTP_LENGTH      9
+#define RLM_TOTP_VP_ALGORITHM       10
+#define RLM_TOTP_VP_CLEARTEXT       11
+#define RLM_TOTP_VP_USER_NAME       12
+#define RLM_TOTP_VP_MSCHAP_USER     13
+#define RLM_TOTP_VP_MSCHAP_CHAL     14
+#define RLM_TOTP_VP_MSCHAP2_RESP    15
+#define RLM_TOTP_VP_CHAP_PASSWORD   16
+#define RLM_TOTP_VP_CHAP_CHALLENGE  17
+#define RLM_TOTP_VP_USER_PASSWORD   18
+#define RLM_TOTP_VP_MAX             19
+
+// password compared with candidate codes by totp_authenticate()
+#define RLM_TOTP_AUTH_PASS          0
+#define RLM_TOTP_AUTH_MSCHAP        1
+#define RLM_TOTP_AUTH_CHAP          2
 
 #define RLM_TOTP_CACHE_EXPIRED      0
 #define RLM_TOTP_CACHE_FAILED       1
 
+#define RLM_TOTP_REQUEST_REPLAYED   1         // request data set when result was answered from result cache
+
 #define RLM_TOTP_EUNKNOWN           -1
 #define RLM_TOTP_EEXPIRED           -2
 
+#define RLM_TOTP_TRY_MAX            16
+#define RLM_TOTP_FILTER_PROBES      4
+#define RLM_TOTP_GATE_WAYS          4         // must be a power of two
+#define RLM_TOTP_GATE_KEY_MAX       64
+#define RLM_TOTP_CANDIDATES_MAX     (((RLM_TOTP_TRY_MAX * 2) + 1) * 3)
+#define RLM_TOTP_CACHE_LINE         64
+#define RLM_TOTP_RESULT_KEY_MAX     253       // longest value of a RADIUS attribute
+#define RLM_TOTP_KEY_MAX            256       // at least the largest HMAC block size
+#define RLM_TOTP_AES_KEY_LEN        32
+#define RLM_TOTP_AES_IV_LEN         12
+#define RLM_TOTP_AES_TAG_LEN        16
+#define RLM_TOTP_SECRET_MAX         (RLM_TOTP_KEY_MAX * 2)    // hex is the longest encoding of a key
+
+#define RLM_TOTP_LOCK_CONSUME       0
+#define RLM_TOTP_LOCK_QUERY         1
+#define RLM_TOTP_LOCK_UPDATE        2
+#define RLM_TOTP_LOCK_ADMIN         3
+#define RLM_TOTP_LOCK_SITES         4
+#define RLM_TOTP_LOCK_BUCKETS       32
+
+#define RLM_TOTP_XLAT_ATTRS         16        // must be a power of two
+#define RLM_TOTP_XLAT_FMT_MAX       128
+#define RLM_TOTP_XLAT_EMPTY         0
+#define RLM_TOTP_XLAT_BUSY          1
+#define RLM_TOTP_XLAT_READY         2
+
+#define RLM_TOTP_MSCHAP_PASS_MAX    256       // characters of password hashed by MS-CHAPv2
+#define RLM_TOTP_MSCHAP_MAGIC1      "Magic server to client signing constant"
+#define RLM_TOTP_MSCHAP_MAGIC2      "Pad to make it do more than one iteration"
+#define RLM_TOTP_MPPE_MASTER        "This is the MPPE Master Key"
+#define RLM_TOTP_MPPE_SEND          "On the client side, this is the receive key; on the server side, it is the send key."
+#define RLM_TOTP_MPPE_RECV          "On the client side, this is the send key; on the server side, it is the receive key."
+
+#define RLM_TOTP_STORE_POLL_MSEC    1000
+#define RLM_TOTP_STORE_WAIT_USEC    1000
+
+// vector secret decoders are selected at runtime on x86
+#if ( (defined(__x86_64__) || defined(__i386__)) && ((defined(__GNUC__)) || (defined(__clang__))) )
+#   define RLM_TOTP_X86_SIMD 1
+#endif
+
 #ifdef EVP_MAX_MD_SIZE
 #   define RLM_TOTP_DIGEST_LENGTH   EVP_MAX_MD_SIZE
 #else
@@ -125,8 +230,40 @@
 
 typedef struct rlm_totp_code_t      rlm_totp_code_t;
 typedef struct _totp_algorithm      totp_algo_t;
+typedef struct _totp_cache          totp_cache_t;
+typedef struct _totp_chap           totp_chap_t;
 typedef struct _totp_cache_entry    totp_cache_entry_t;
+typedef struct _totp_cache_stats    totp_cache_stats_t;
+typedef struct _totp_gate_bucket    totp_gate_bucket_t;
+typedef struct _totp_key            totp_key_t;
+typedef struct _totp_lock_stats     totp_lock_stats_t;
+typedef struct _totp_match          totp_match_t;
+typedef struct _totp_mschap         totp_mschap_t;
+typedef struct _totp_result         totp_result_t;
+typedef struct _totp_secure         totp_secure_t;
 typedef struct _totp_params         totp_params_t;
+typedef struct _totp_stat           totp_stat_t;
+typedef struct _totp_store          totp_store_t;
+typedef struct _totp_xlat_attr      totp_xlat_attr_t;
+
+
+// value-pairs of an attribute are stored in totp_params_t.vps[scope][idx]
+struct _totp_match
+{  unsigned                attr;             //!< attribute number of dictionary entry
+   unsigned                vendor;           //!< vendor of dictionary entry
+   unsigned                idx;              //!< RLM_TOTP_VP_* index of value-pair
+};
+
+
+// written once by the first expansion of fmt, then read without locks
+struct _totp_xlat_attr
+{  uint32_t                state;            //!< RLM_TOTP_XLAT_EMPTY, RLM_TOTP_XLAT_BUSY, or RLM_TOTP_XLAT_READY
+   uint32_t                hash;             //!< hash of fmt
+   uint32_t                fmt_len;          //!< length of fmt
+   int                     scope;            //!< list searched for referenced attribute
+   const DICT_ATTR *       da;               //!< dictionary entry of referenced attribute
+   char                    fmt[RLM_TOTP_XLAT_FMT_MAX]; //!< arguments passed to xlat
+};
 
 
 // modules's structure for the configuration variables
@@ -134,23 +271,42 @@ struct rlm_totp_code_t
 {  char const *            name;                   //!< name of this instance */
    const char *            totp_algo_str;          //!< name of HMAC cryptographic algorithm
    const char *            vsa_cache_id_name;      //!< name of VSA to use as the cache key
-   const char *            vsa_secret_name;        //!< name of VSA to use as the base32 encoded TOTP key
+   const char *            vsa_secret_name;        //!< name of VSA to use as the encoded TOTP key
+   const char *            secret_encoding_str;    //!< encoding of vsa_secret (base32, hex, base64, or auto)
    const char *            vsa_key_name;           //!< name of VSA to use as the binary TOTP key
+   const char *            vsa_encrypted_key_name; //!< name of VSA to use as the encrypted TOTP key
+   const char *            encrypted_key_file;     //!< path of file with key used to decrypt vsa_encrypted_key
    const char *            vsa_pass_name;          //!< name of VSA to use as the TOTP password
    const char *            vsa_time_offset_name;   //!< name of VSA which overrides totp_time_offset
    const char *            vsa_start_time_name;    //!< name of VSA which overrides totp_t0
    const char *            vsa_time_step_name;     //!< name of VSA which overrides totp_x
    const char *            vsa_otp_length_name;    //!< name of VSA which overrides otp_length
    const char *            vsa_algorithm_name;     //!< name of VSA which overrides totp_algo
+   const char *            gate_key_name;          //!< name of VSA used to rate limit authentication attempts
+   const char *            cache_name;             //!< name of cache shared between module instances
+   const char *            store_file;             //!< path of local secret store
    const DICT_ATTR *       vsa_cache_id;           //!< dictionary entry for VSA to use as the cache key
-   const DICT_ATTR *       vsa_secret;             //!< dictionary entry for VSA to use as the base32 encoded TOTP key
+   const DICT_ATTR *       vsa_secret;             //!< dictionary entry for VSA to use as the encoded TOTP key
    const DICT_ATTR *       vsa_key;                //!< dictionary entry for VSA to use as the binary TOTP key
+   const DICT_ATTR *       vsa_encrypted_key;      //!< dictionary entry for VSA to use as the encrypted TOTP key
    const DICT_ATTR *       vsa_pass;               //!< dictionary entry for VSA to use as the TOTP password
    const DICT_ATTR *       vsa_time_offset;        //!< dictionary entry for VSA which overrides totp_time_offset
    const DICT_ATTR *       vsa_unix_time;          //!< dictionary entry for VSA which overrides totp_t0
    const DICT_ATTR *       vsa_time_step;          //!< dictionary entry for VSA which overrides totp_x
    const DICT_ATTR *       vsa_otp_length;         //!< dictionary entry for VSA which overrides otp_length
    const DICT_ATTR *       vsa_algorithm;          //!< dictionary entry for VSA which overrides totp_algo
+   const DICT_ATTR *       gate_key;               //!< dictionary entry for VSA used to rate limit authentication attempts
+   const DICT_ATTR *       cleartext_password;     //!< dictionary entry for static password preceding TOTP code
+   const DICT_ATTR *       user_name;              //!< dictionary entry for User-Name
+   const DICT_ATTR *       mschap_user_name;       //!< dictionary entry for MS-CHAP-User-Name
+   const DICT_ATTR *       mschap_challenge;       //!< dictionary entry for MS-CHAP-Challenge
+   const DICT_ATTR *       mschap2_response;       //!< dictionary entry for MS-CHAP2-Response
+   const DICT_ATTR *       chap_password;          //!< dictionary entry for CHAP-Password
+   const DICT_ATTR *       chap_challenge;         //!< dictionary entry for CHAP-Challenge
+   const DICT_ATTR *       user_password;          //!< dictionary entry for User-Password
+   totp_match_t            matches[TOTP_SCOPES][RLM_TOTP_VP_MAX]; //!< attributes collected from each request list
+   uint32_t                matches_len[TOTP_SCOPES];              //!< number of attributes collected from each request list
+   totp_xlat_attr_t        xlat_attrs[RLM_TOTP_XLAT_ATTRS];       //!< attribute references parsed from xlat arguments
    uint32_t                totp_t0;                //!< Unix time to start counting time steps (default: 0)
    uint32_t                totp_x;                 //!< time step in seconds (default: 30 seconds)
    int32_t                 totp_time_offset;       //!< adjust current time by seconds
@@ -159,14 +315,59 @@ struct rlm_totp_code_t
    uint32_t                try_prev;               //!< number of steps to look back to authenticate code
    uint32_t                try_next;               //!< number of steps to look forward to authenticate code
    uint32_t                max_attempts;           //!< maximum allowed attempts per time period
+   uint32_t                cache_filter_size;      //!< number of counters in cache filter (0 disables filter)
+   uint32_t                sketch_width;           //!< counters per row of failure sketch (0 disables sketch)
+   uint32_t                sketch_depth;           //!< number of rows in failure sketch
+   uint32_t                sketch_threshold;       //!< failed attempts before an identity is added to cache
+   uint32_t                gate_size;              //!< number of rate limiting buckets
+   uint32_t                gate_rate;              //!< authentication attempts allowed per minute by each bucket
+   uint32_t                gate_burst;             //!< maximum authentication attempts held by each bucket
+   uint32_t                result_size;            //!< number of results kept for retransmitted requests
+   uint32_t                result_ttl;             //!< seconds to keep results for retransmitted requests (0 disables)
+   uint32_t                key_size;               //!< number of decoded keys kept (0 disables)
+   uint32_t                arena_size;             //!< number of slots of key material in arena
+   bool                    allow_chap;             //!< verify CHAP responses against every candidate code
+   bool                    allow_mschap;           //!< verify MS-CHAPv2 responses against every candidate code
    bool                    allow_override;         //!< allow TOTP parameters to be overriden by RADIUS attributes
    bool                    allow_reuse;            //!< allow TOTP codes to be re-used
    bool                    devel_debug;            //!< enable extra debug messages for developer
+   bool                    lock_stats;             //!< record wait and hold times of cache lock
+   bool                    split_password;         //!< split TOTP code from end of User-Password
+   bool                    store_watch;            //!< reload store_file when it is replaced
    int                     totp_algo;              //!< HMAC cryptographic algorithm
-   rbtree_t *              cache_tree;
-   totp_cache_entry_t *    cache_list;
+   int                     secret_encoding;        //!< encoding of vsa_secret
+   totp_cache_t *          cache;                  //!< cache of used codes and failed attempts
+   rlm_totp_code_t *       cache_next;             //!< next module instance using cache
+   time_t                  cache_retain;           //!< seconds entries are retained for window of instance
+   totp_gate_bucket_t *    gate;                   //!< rate limiting buckets indexed by hash of gate_key
+   uint32_t                gate_mask;              //!< mask applied to hash of gate_key to select a set
+   totp_result_t *         results;                //!< results of recent requests indexed by hash of request
+   uint32_t                results_mask;           //!< mask applied to hash of request
+   totp_key_t *            keys;                   //!< decoded keys indexed by hash of encoded secret
+   uint32_t                keys_mask;              //!< mask applied to hash of encoded secret
+   totp_secure_t *         encryption;             //!< arena slot holding AES-256 key loaded from encrypted_key_file
+   uint8_t *               arena;                  //!< locked memory holding keys, excluded from core dumps
+   size_t                  arena_len;              //!< length of arena in bytes
+   totp_secure_t *         arena_slots;            //!< fixed size slots of key material used by requests
+   uint64_t *              arena_map;              //!< bitmap of allocated arena_slots
+   uint32_t                arena_words;            //!< number of words in arena_map
+   uint32_t                arena_hint;             //!< selects word of arena_map where search starts
+   uint64_t                arena_used;             //!< number of allocated arena_slots
+   uint64_t                arena_exhausted;        //!< number of requests which used the stack instead of arena
+   bool                    arena_locked;           //!< arena is locked into memory
+   totp_store_t *          store;                  //!< local secret store mapped from store_file, replaced atomically
+   uint32_t                store_epoch;            //!< selects reader count used by new readers of store
+   uint32_t                store_readers[2];       //!< readers of store counted by parity of store_epoch
+   uint64_t                store_generation;       //!< generation of current store
+   uint64_t                store_users;            //!< number of users in current store
+   uint64_t                store_reloads;          //!< number of times store was replaced
+   uint64_t                store_errors;           //!< number of replacement stores which failed to load
 #ifdef HAVE_PTHREAD_H
-   pthread_mutex_t *       mutex;
+   pthread_mutex_t *       gate_mutex;
+   pthread_mutex_t *       results_mutex;
+   pthread_mutex_t *       keys_mutex;
+   pthread_t               store_thread;           //!< thread which reloads store_file
+   int                     store_pipe[2];          //!< wakes store thread when instance is detached
 #endif // HAVE_PTHREAD_H
 };
 
@@ -177,17 +378,158 @@ struct _totp_algorithm
 };
 
 
+// counters are updated with relaxed atomics and may be read without the lock
+struct _totp_cache_stats
+{  uint64_t                lookups;          //!< searches of cache tree
+   uint64_t                hits;             //!< searches which found an entry
+   uint64_t                misses;           //!< searches which did not find an entry
+   uint64_t                filtered;         //!< misses answered by cache filter without the lock
+   uint64_t                inserts;          //!< entries added to cache
+   uint64_t                expiries;         //!< entries removed after expiring
+   uint64_t                evictions;        //!< entries removed before expiring
+   uint64_t                lockouts;         //!< identities locked out by max_attempts
+   uint64_t                cleanups;         //!< cleanup batches which removed entries
+   uint64_t                cleanup_max;      //!< largest number of entries removed by one batch
+   uint64_t                cleanup_usec;     //!< microseconds spent removing entries
+   uint64_t                cleanup_usec_max; //!< longest batch in microseconds
+};
+
+
+// bucket N of each histogram counts times from 2^N to 2^(N+1)-1 nanoseconds
+struct _totp_lock_stats
+{  uint64_t                acquired;         //!< number of times lock was acquired
+   uint64_t                contended;        //!< number of times lock was held by another thread
+   uint64_t                wait_nsec;        //!< nanoseconds spent waiting for lock
+   uint64_t                hold_nsec;        //!< nanoseconds lock was held
+   uint64_t                wait_hist[RLM_TOTP_LOCK_BUCKETS];
+   uint64_t                hold_hist[RLM_TOTP_LOCK_BUCKETS];
+};
+
+
+struct _totp_cache
+{  char *                  name;             //!< name used to share cache between module instances
+   unsigned                refs;             //!< number of module instances using cache
+   rlm_totp_code_t *       instances;        //!< module instances using cache
+   rbtree_t *              tree;             //!< cache entries indexed by key
+   totp_cache_entry_t *    list;             //!< sentinel of cache entries ordered by last update
+   time_t                  retain;           //!< seconds entries are retained after expiring
+   uint32_t                filter_size;      //!< configured number of counters in filter
+   uint8_t *               filter;           //!< counting bloom filter of keys in tree
+   uint32_t                filter_mask;      //!< mask applied to filter probes
+   bool                    filter_rebuild;   //!< filter has saturated counters
+   uint64_t                filter_step;      //!< time step of most recent filter rebuild
+   uint16_t *              sketch;           //!< count-min sketch of failed attempts for uncached identities
+   uint32_t                sketch_width;     //!< counters per row of sketch
+   uint32_t                sketch_depth;     //!< number of rows in sketch
+   uint64_t                sketch_x;         //!< time step used to rotate sketch
+   uint64_t                sketch_step;      //!< time step counted by sketch
+   totp_cache_t *          next;             //!< next cache in list of caches
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_t *       mutex;
+#endif // HAVE_PTHREAD_H
+   uint8_t                 pad0[RLM_TOTP_CACHE_LINE];
+   totp_cache_stats_t      stats;            //!< statistics, padded from fields written under lock
+   totp_lock_stats_t       locks[RLM_TOTP_LOCK_SITES]; //!< lock statistics by lock site
+   uint64_t                locked_nsec;      //!< time lock was acquired, written under lock
+   uint8_t                 pad1[RLM_TOTP_CACHE_LINE];
+};
+
+
 struct _totp_cache_entry
 {  uint8_t *               key;              //!< value of User-Name attribute
    size_t                  keylen;           //!< length of User-Name attribute
-   time_t                  invalid_until;    //!< epoch time when last used code will expire
+   uint32_t                hash;             //!< hash of key used by cache filter
+   time_t                  invalid_until;    //!< epoch time when lockout due to failed attempts expires
    time_t                  failed_expires;   //!< epoch time when failed attempt count expires
    size_t                  failed_count;     //!< failed attempt count
+   time_t                  used_expires;     //!< epoch time when most recently used code will expire
+   uint64_t                used_step;        //!< time step counter of most recently used code
+   uint64_t                used_map;         //!< bit N is set if code for (used_step - N) was used
+   uint64_t                used_t0;          //!< start time of time steps counted by used_step
+   uint64_t                used_x;           //!< time step in seconds counted by used_step
    totp_cache_entry_t *    prev;
    totp_cache_entry_t *    next;
 };
 
 
+struct _totp_gate_bucket
+{  uint32_t                hash;             //!< hash of gate_key value which owns bucket
+   uint32_t                tokens;           //!< available attempts in thousandths
+   uint64_t                updated;          //!< time in milliseconds when tokens were last refilled
+   uint32_t                key_len;          //!< length of gate_key value which owns bucket
+   uint8_t                 key[RLM_TOTP_GATE_KEY_MAX]; //!< leading bytes of gate_key value
+};
+
+
+struct _totp_key
+{  uint32_t                hash;             //!< hash of encoded secret
+   uint32_t                encoding;         //!< encoding or encryption of secret
+   uint16_t                secret_len;       //!< length of encoded secret (0 if slot is empty)
+   uint16_t                key_len;          //!< length of decoded key
+   char                    secret[RLM_TOTP_SECRET_MAX]; //!< encoded secret
+   uint8_t                 key[RLM_TOTP_KEY_MAX];       //!< decoded key
+};
+
+
+// CHAP response compared with each candidate code
+struct _totp_chap
+{  const uint8_t *         response;          //!< response of CHAP-Password, without identifier
+   const uint8_t *         challenge;         //!< CHAP-Challenge, or request authenticator
+   size_t                  challenge_len;     //!< length of challenge
+   FR_MD5_CTX              prefix;            //!< MD5 state after hashing identifier and static password
+};
+
+
+// MS-CHAPv2 response compared with each candidate code
+struct _totp_mschap
+{  uint8_t                 ident;             //!< identifier of MS-CHAPv2 exchange
+   uint8_t                 challenge_hash[8]; //!< ChallengeHash() of peer and authenticator challenges
+   const uint8_t *         nt_response;       //!< NT-Response sent by peer
+   FR_MD4_CTX              nt_prefix;         //!< MD4 state after hashing static password as UTF-16LE
+};
+
+
+// one slot of the key arena, which is locked into memory
+struct _totp_secure
+{  uint8_t                 key[RLM_TOTP_KEY_MAX];         //!< key decoded or decrypted from attributes
+   uint8_t                 store_key[TOTP_STORE_KEY_MAX]; //!< key copied from local secret store
+   totp_chap_t             chap;                          //!< state derived from static password
+   totp_mschap_t           mschap;                        //!< state derived from static password
+};
+
+
+struct _totp_result
+{  uint32_t                key_hash;         //!< hash of cache key
+   uint32_t                key_len;          //!< length of cache key
+   int                     id;               //!< RADIUS packet identifier
+   time_t                  expires;          //!< epoch time when result expires
+   rlm_rcode_t             rcode;            //!< result returned for the request
+   uint8_t                 vector[16];       //!< RADIUS request authenticator
+   char                    otp[16];          //!< submitted TOTP password
+   uint8_t                 key[RLM_TOTP_RESULT_KEY_MAX]; //!< value of cache key
+};
+
+
+struct _totp_stat
+{  const char *            name;
+   size_t                  offset;
+};
+
+
+// pointers reference the read-only mapping of the store file
+struct _totp_store
+{  uint8_t *               map;              //!< mapping of store file
+   size_t                  map_len;          //!< length of mapping
+   const totp_store_header_t * header;       //!< header of store
+   const uint32_t *        seeds;            //!< displacement seed of each bucket
+   const totp_store_record_t * records;      //!< records indexed by perfect hash
+   const uint8_t *         ids;              //!< identities referenced by records
+   dev_t                   dev;              //!< device of mapped file
+   ino_t                   ino;              //!< inode of mapped file
+   time_t                  mtime;            //!< modification time of mapped file
+};
+
+
 // The TOTP algorithm can be represented as:
 //    T                 = (CurrentUnixTime - T0) / X
 //    TOTP              = Truncate(HMAC_Algorithm(K, T)) % 10^Digit
@@ -207,10 +549,16 @@ struct _totp_params
    uint64_t                totp_t_drift;     //!< number of time steps to adjust .totp_t (used at runtime)
    uint64_t                totp_algo;        //!< HMAC algorithm
    uint64_t                otp_length;       //!< requested length of One-Time-Password [Digit]
-   uint64_t                invalid_until;    //!< epoch time when last used code will expire
+   uint64_t                invalid_until;    //!< epoch time when lockout due to failed attempts expires
+   uint64_t                used_step;        //!< time step counter of most recently used code
+   uint64_t                used_map;         //!< bitmap of used codes relative to .used_step
    size_t                  key_len;          //!< length of HMAC key [K]
    const uint8_t *         key;              //!< HAMC key
    char                    otp[16];
+   const uint8_t *         pass;             //!< TOTP password submitted by user
+   size_t                  pass_len;         //!< length of submitted TOTP password
+   char                    pass_split[16];   //!< TOTP password split from end of User-Password
+   VALUE_PAIR *            vps[TOTP_SCOPES][RLM_TOTP_VP_MAX]; //!< first value-pair of each attribute in each request list
 };
 
 
@@ -232,12 +580,6 @@ mod_authenticate(
          REQUEST *                     request);
 
 
-static int
-mod_bootstrap(
-         CONF_SECTION *			         conf,
-         void *                        instance );
-
-
 static int
 mod_detach(
          UNUSED void *                 instance );
@@ -245,7 +587,7 @@ mod_detach(
 
 static int
 mod_instantiate(
-         UNUSED CONF_SECTION *         conf,
+         CONF_SECTION *                conf,
          void *                        instance );
 
 
@@ -255,24 +597,166 @@ mod_post_auth(
          REQUEST *                     request);
 
 
+static rlm_rcode_t
+totp_authenticate(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_secure_t *               secure );
+
+
+//-------------------//
+// result prototypes //
+//-------------------//
+// MARK: result prototypes
+
+static int
+totp_result_query(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         rlm_rcode_t *                 rcodep );
+
+
+static totp_result_t *
+totp_result_slot(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_result_t *               result );
+
+
+static rlm_rcode_t
+totp_result_store(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         rlm_rcode_t                   rcode );
+
+
+//------------------//
+// arena prototypes //
+//------------------//
+// MARK: arena prototypes
+
+static totp_secure_t *
+totp_arena_alloc(
+         void *                        instance,
+         totp_secure_t *               fallback );
+
+
+static void
+totp_arena_close(
+         void *                        instance );
+
+
+static void
+totp_arena_free(
+         void *                        instance,
+         totp_secure_t *               secure );
+
+
+static int
+totp_arena_open(
+         void *                        instance );
+
+
 //-------------------//
 // base32 prototypes //
 //-------------------//
 // MARK: base32 prototypes
 
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_base32_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
+
+
+static ssize_t
+totp_base32_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+
+
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_base32_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
+
+
+//-------------------//
+// base64 prototypes //
+//-------------------//
+// MARK: base64 prototypes
+
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_base64_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
+
+
 static ssize_t
-totp_base32_decode(
-         const void *                  ctx,
-         uint8_t **                    dstp,
-         size_t *                      dstlenp,
+totp_base64_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+
+
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_base64_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
+
+
+//----------------//
+// hex prototypes //
+//----------------//
+// MARK: hex prototypes
+
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_hex_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
          const char *                  src,
          size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
 
 
 static ssize_t
-totp_base32_verify(
+totp_hex_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen );
+
+
+#ifdef RLM_TOTP_X86_SIMD
+static size_t
+totp_hex_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
          const char *                  src,
          size_t                        srclen );
+#endif // RLM_TOTP_X86_SIMD
 
 
 //------------------//
@@ -280,12 +764,37 @@ totp_base32_verify(
 //------------------//
 // MARK: cache prototypes
 
+static totp_cache_t *
+totp_cache_alloc(
+         void *                        instance,
+         const char *                  name );
+
+
+static int
+totp_cache_attach(
+         void *                        instance );
+
+
 static void
 totp_cache_cleanup(
          void *                        instance,
          totp_params_t *               params );
 
 
+static int
+totp_cache_consume(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         const uint64_t *              counters,
+         size_t                        counters_len );
+
+
+static void
+totp_cache_detach(
+         void *                        instance );
+
+
 static totp_cache_entry_t *
 totp_cache_entry_alloc(
          void *                        ctx,
@@ -300,6 +809,12 @@ totp_cache_entry_cmp(
          const void *                  ptr_b );
 
 
+static totp_cache_entry_t *
+totp_cache_entry_find(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          cache_key );
+
+
 static void
 totp_cache_entry_free(
          void *                        ptr );
@@ -309,9 +824,30 @@ static int
 totp_cache_entry_key(
          void *                        instance,
          REQUEST *                     request,
-         totp_cache_entry_t *          cache_key,
-         void *                        key_buff,
-         size_t                        key_buff_len );
+         totp_params_t *               params,
+         totp_cache_entry_t *          cache_key );
+
+
+static void
+totp_cache_entry_rebucket(
+         totp_cache_entry_t *          entry,
+         totp_params_t *               params );
+
+
+static void
+totp_cache_entry_record(
+         void *                        instance,
+         totp_cache_entry_t *          entry,
+         totp_params_t *               params,
+         int                           action,
+         uint64_t                      counter );
+
+
+static totp_cache_entry_t *
+totp_cache_entry_touch(
+         void *                        instance,
+         totp_cache_entry_t *          entry,
+         totp_cache_entry_t *          cache_key );
 
 
 static void
@@ -319,6 +855,47 @@ totp_cache_entry_unlink(
          totp_cache_entry_t *          entry );
 
 
+static int
+totp_cache_entry_used(
+         uint64_t                      used_step,
+         uint64_t                      used_map,
+         uint64_t                      counter );
+
+
+static void
+totp_cache_filter_add(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          entry );
+
+
+static void
+totp_cache_filter_del(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          entry );
+
+
+static void
+totp_cache_filter_rebuild(
+         totp_cache_t *                cache );
+
+
+static int
+totp_cache_filter_test(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          cache_key );
+
+
+static void
+totp_cache_free(
+         totp_cache_t *                cache );
+
+
+static void
+totp_cache_lock(
+         void *                        instance,
+         int                           site );
+
+
 static int
 totp_cache_query(
          void *                        instance,
@@ -327,6 +904,25 @@ totp_cache_query(
          totp_cache_entry_t *          res );
 
 
+static uint32_t
+totp_cache_sketch_add(
+         totp_cache_t *                cache,
+         totp_params_t *               params,
+         totp_cache_entry_t *          cache_key );
+
+
+static uint32_t
+totp_cache_sketch_seed(
+         void *                        instance,
+         uint32_t                      sketch_count );
+
+
+static void
+totp_cache_unlock(
+         void *                        instance,
+         int                           site );
+
+
 static int
 totp_cache_update(
          void *                        instance,
@@ -335,6 +931,25 @@ totp_cache_update(
          int                           action );
 
 
+//-----------------//
+// chap prototypes //
+//-----------------//
+// MARK: chap prototypes
+
+static int
+totp_chap_init(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_chap_t *                 chap );
+
+
+static int
+totp_chap_verify(
+         totp_chap_t *                 chap,
+         const char *                  otp );
+
+
 //----------------------//
 // algorithm prototypes //
 //----------------------//
@@ -355,6 +970,11 @@ totp_algo_calculate(
          totp_params_t *               params );
 
 
+static uint64_t
+totp_algo_counter(
+         totp_params_t *               params );
+
+
 static void
 totp_algo_debug(
          void *                        instance,
@@ -373,18 +993,30 @@ totp_algo_hmac(
          size_t                        key_len );
 
 
+static void
+totp_algo_hmac_batch(
+         int                           totp_algo,
+         uint8_t                       (*digests)[RLM_TOTP_DIGEST_LENGTH],
+         unsigned *                    digest_lenp,
+         const uint64_t *              counters,
+         size_t                        counters_len,
+         const uint8_t *               key,
+         size_t                        key_len );
+
+
 static int
 totp_algo_params(
          void *                        instance,
          REQUEST *                     request,
-         totp_params_t *               params );
+         totp_params_t *               params,
+         uint8_t *                     store_key );
 
 
 int
 totp_algo_params_integer(
          void *                        instance,
          REQUEST *                     request,
-         const DICT_ATTR *             da,
+         VALUE_PAIR *                  vp,
          uint64_t *                    uintp );
 
 
@@ -392,44 +1024,385 @@ int
 totp_algo_params_signed(
          void *                        instance,
          REQUEST *                     request,
-         const DICT_ATTR *             da,
+         VALUE_PAIR *                  vp,
          int64_t *                     intp );
 
 
-//--------------------------//
-// miscellaneous prototypes //
-//--------------------------//
-// MARK: miscellaneous prototypes
-
-static VALUE_PAIR *
-totp_request_vp_by_dict(
-         UNUSED void *                 instance,
-         REQUEST *                     request,
-         const DICT_ATTR *             da,
-         int                           scope );
+static unsigned
+totp_algo_truncate(
+         const uint8_t *               digest,
+         unsigned                      digest_len,
+         uint64_t                      otp_length );
 
 
-static VALUE_PAIR *
-totp_request_vp_by_name(
-         UNUSED void *                 instance,
-         REQUEST *                     request,
-         const char *                  attrstr,
-         size_t                        attrstr_len,
-         int                           default_scope );
+static ssize_t
+totp_algo_window(
+         void *                        instance,
+         totp_params_t *               params,
+         uint64_t *                    counters,
+         uint32_t *                    otps );
 
 
 //-----------------//
-// xlat prototypes //
+// gate prototypes //
 //-----------------//
-// MARK: xlat prototypes
+// MARK: gate prototypes
 
-static ssize_t
-totp_xlat_code(
-         UNUSED void *                 instance,
+static int
+totp_gate_check(
+         void *                        instance,
          REQUEST *                     request,
-         char const *                  fmt,
-         char *                        out,
-         size_t                        outlen );
+         totp_params_t *               params );
+
+
+//----------------//
+// key prototypes //
+//----------------//
+// MARK: key prototypes
+
+static ssize_t
+totp_key_cache_query(
+         void *                        instance,
+         int                           encoding,
+         const void *                  secret,
+         size_t                        secret_len,
+         uint8_t *                     buff,
+         size_t                        buff_len );
+
+
+static void
+totp_key_cache_update(
+         void *                        instance,
+         int                           encoding,
+         const void *                  secret,
+         size_t                        secret_len,
+         const uint8_t *               key,
+         size_t                        key_len );
+
+
+static ssize_t
+totp_key_decode(
+         void *                        instance,
+         REQUEST *                     request,
+         const char *                  secret,
+         size_t                        secret_len,
+         uint8_t *                     buff,
+         size_t                        buff_len );
+
+
+static ssize_t
+totp_key_decrypt(
+         void *                        instance,
+         REQUEST *                     request,
+         const uint8_t *               data,
+         size_t                        data_len,
+         uint8_t *                     buff,
+         size_t                        buff_len );
+
+
+static int
+totp_key_encoding(
+         const char *                  secret,
+         size_t                        secret_len );
+
+
+static int
+totp_key_encoding_id(
+         const char *                  encoding_name );
+
+
+static int
+totp_key_load(
+         void *                        instance );
+
+
+static void
+totp_key_zeroize(
+         void *                        ptr,
+         size_t                        len );
+
+
+//-------------------//
+// mschap prototypes //
+//-------------------//
+// MARK: mschap prototypes
+
+static void
+totp_mschap_des(
+         const uint8_t *               key,
+         const uint8_t *               data,
+         uint8_t *                     out );
+
+
+static uint64_t
+totp_mschap_des_permute(
+         uint64_t                      in,
+         unsigned                      in_bits,
+         const uint8_t *               table,
+         size_t                        table_len );
+
+
+static void
+totp_mschap_error(
+         REQUEST *                     request,
+         totp_mschap_t *               mschap );
+
+
+static int
+totp_mschap_init(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_mschap_t *               mschap );
+
+
+static void
+totp_mschap_nt_hash(
+         totp_mschap_t *               mschap,
+         const char *                  otp,
+         uint8_t *                     nt_hash );
+
+
+static void
+totp_mschap_reply(
+         REQUEST *                     request,
+         totp_mschap_t *               mschap,
+         const char *                  otp );
+
+
+static ssize_t
+totp_mschap_ucs2(
+         uint8_t *                     dst,
+         size_t                        dst_size,
+         const uint8_t *               src,
+         size_t                        src_len );
+
+
+static int
+totp_mschap_verify(
+         totp_mschap_t *               mschap,
+         const char *                  otp );
+
+
+//------------------//
+// store prototypes //
+//------------------//
+// MARK: store prototypes
+
+static unsigned
+totp_store_acquire(
+         void *                        instance,
+         totp_store_t **               storep );
+
+
+static const totp_store_record_t *
+totp_store_find(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_store_t *                store );
+
+
+static void
+totp_store_free(
+         totp_store_t *                store );
+
+
+static totp_store_t *
+totp_store_map(
+         const char *                  filename );
+
+
+static int
+totp_store_open(
+         void *                        instance );
+
+
+static void
+totp_store_release(
+         void *                        instance,
+         unsigned                      idx );
+
+
+static int
+totp_store_reload(
+         void *                        instance );
+
+
+static void
+totp_store_synchronize(
+         void *                        instance );
+
+
+static const char *
+totp_store_verify(
+         totp_store_t *                store );
+
+
+#ifdef HAVE_PTHREAD_H
+static void *
+totp_store_watch(
+         void *                        instance );
+#endif // HAVE_PTHREAD_H
+
+
+//--------------------------//
+// miscellaneous prototypes //
+//--------------------------//
+// MARK: miscellaneous prototypes
+
+static const DICT_ATTR *
+totp_request_da_by_name(
+         const char *                  attr_str,
+         size_t                        attr_str_len,
+         int *                         scopep );
+
+
+static int
+totp_request_pass_split(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params );
+
+
+static VALUE_PAIR *
+totp_request_vp_by_dict(
+         UNUSED void *                 instance,
+         REQUEST *                     request,
+         const DICT_ATTR *             da,
+         int                           scope );
+
+
+static VALUE_PAIR *
+totp_request_vp_by_idx(
+         totp_params_t *               params,
+         unsigned                      idx );
+
+
+static const uint8_t *
+totp_request_vp_data(
+         VALUE_PAIR *                  vp,
+         size_t *                      lenp );
+
+
+static void
+totp_request_vp_gather(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params );
+
+
+static void
+totp_request_vp_match(
+         void *                        instance,
+         const DICT_ATTR *             da,
+         unsigned                      idx,
+         int                           scope );
+
+
+static unsigned
+totp_stats_bucket(
+         uint64_t                      nsec );
+
+
+static uint64_t
+totp_stats_nsec( void );
+
+
+static void
+totp_stats_update_max(
+         uint64_t *                    valp,
+         uint64_t                      val );
+
+
+//-----------------//
+// xlat prototypes //
+//-----------------//
+// MARK: xlat prototypes
+
+static const totp_xlat_attr_t *
+totp_xlat_attr_query(
+         void *                        instance,
+         const char *                  fmt );
+
+
+static void
+totp_xlat_attr_update(
+         void *                        instance,
+         const char *                  fmt,
+         const DICT_ATTR *             da,
+         int                           scope );
+
+
+static ssize_t
+totp_xlat_cache(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen );
+
+
+static ssize_t
+totp_xlat_code(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen );
+
+
+static ssize_t
+totp_xlat_code_generate(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen,
+         totp_secure_t *               secure );
+
+
+static int
+totp_xlat_params(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         totp_params_t *               params,
+         totp_secure_t *               secure );
+
+
+static int
+totp_xlat_register(
+         void *                        instance,
+         CONF_SECTION *                conf );
+
+
+static ssize_t
+totp_xlat_stats(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen );
+
+
+static ssize_t
+totp_xlat_window(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen );
+
+
+static ssize_t
+totp_xlat_window_generate(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen,
+         totp_secure_t *               secure );
 
 
 /////////////////
@@ -441,27 +1414,49 @@ totp_xlat_code(
 
 // Map configuration file names to internal variables
 static const CONF_PARSER module_config[] =
-{  {  "start_time",        FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, totp_t0),                "0" },
-   {  "time_step",         FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, totp_x),                 "30" },
-   {  "time_offset",       FR_CONF_OFFSET(PW_TYPE_SIGNED,   rlm_totp_code_t, totp_time_offset),       "0" },
-   {  "time_drift",        FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, totp_time_drift),        "0" },
-   {  "try_previous",      FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, try_prev),               "0" },
-   {  "try_next",          FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, try_next),               "0" },
-   {  "max_attempts",      FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, max_attempts),           "0" },
-   {  "otp_length",        FR_CONF_OFFSET(PW_TYPE_INTEGER,  rlm_totp_code_t, otp_length),             "6" },
-   {  "allow_reuse",       FR_CONF_OFFSET(PW_TYPE_BOOLEAN,  rlm_totp_code_t, allow_reuse),            "no" },
-   {  "allow_override",    FR_CONF_OFFSET(PW_TYPE_BOOLEAN,  rlm_totp_code_t, allow_override),         "no" },
-   {  "devel_debug",       FR_CONF_OFFSET(PW_TYPE_BOOLEAN,  rlm_totp_code_t, devel_debug),            "no" },
-   {  "algorithm",         FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, totp_algo_str),          "sha1" },
-   {  "vsa_cache_id",      FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_cache_id_name),      "User-Name" },
-   {  "vsa_secret",        FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_secret_name),        "TOTP-Secret" },
-   {  "vsa_key",           FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_key_name),           "TOTP-Key" },
-   {  "vsa_pass",          FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_pass_name),          "TOTP-Password" },
-   {  "vsa_time_offset",   FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_time_offset_name),   "TOTP-Time-Offset" },
-   {  "vsa_start_time",    FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_start_time_name),    NULL },
-   {  "vsa_time_step",     FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_time_step_name),     NULL },
-   {  "vsa_otp_length",    FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_otp_length_name),    NULL },
-   {  "vsa_algorithm",     FR_CONF_OFFSET(PW_TYPE_STRING,   rlm_totp_code_t, vsa_algorithm_name),     NULL },
+{  {  "start_time",               FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, totp_t0),                "0" },
+   {  "time_step",                FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, totp_x),                 "30" },
+   {  "time_offset",              FR_CONF_OFFSET(PW_TYPE_SIGNED,      rlm_totp_code_t, totp_time_offset),       "0" },
+   {  "time_drift",               FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, totp_time_drift),        "0" },
+   {  "try_previous",             FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, try_prev),               "0" },
+   {  "try_next",                 FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, try_next),               "0" },
+   {  "max_attempts",             FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, max_attempts),           "0" },
+   {  "cache_filter_size",        FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, cache_filter_size),      "65536" },
+   {  "failure_sketch_width",     FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, sketch_width),           "0" },
+   {  "failure_sketch_depth",     FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, sketch_depth),           "4" },
+   {  "failure_sketch_threshold", FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, sketch_threshold),       "2" },
+   {  "otp_length",               FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, otp_length),             "6" },
+   {  "allow_reuse",              FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, allow_reuse),            "no" },
+   {  "allow_override",           FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, allow_override),         "no" },
+   {  "allow_mschap",             FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, allow_mschap),           "no" },
+   {  "allow_chap",               FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, allow_chap),             "no" },
+   {  "split_password",           FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, split_password),         "no" },
+   {  "devel_debug",              FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, devel_debug),            "no" },
+   {  "lock_stats",               FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, lock_stats),             "no" },
+   {  "algorithm",                FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, totp_algo_str),          "sha1" },
+   {  "vsa_cache_id",             FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_cache_id_name),      "User-Name" },
+   {  "vsa_secret",               FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_secret_name),        "TOTP-Secret" },
+   {  "secret_encoding",          FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, secret_encoding_str),    "base32" },
+   {  "vsa_key",                  FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_key_name),           "TOTP-Key" },
+   {  "vsa_encrypted_key",        FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_encrypted_key_name), "TOTP-Encrypted-Key" },
+   {  "encrypted_key_file",       FR_CONF_OFFSET(PW_TYPE_FILE_INPUT,  rlm_totp_code_t, encrypted_key_file),     NULL },
+   {  "vsa_pass",                 FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_pass_name),          "TOTP-Password" },
+   {  "vsa_time_offset",          FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_time_offset_name),   "TOTP-Time-Offset" },
+   {  "vsa_start_time",           FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_start_time_name),    NULL },
+   {  "vsa_time_step",            FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_time_step_name),     NULL },
+   {  "vsa_otp_length",           FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_otp_length_name),    NULL },
+   {  "gate_key",                 FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, gate_key_name),          NULL },
+   {  "gate_size",                FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, gate_size),              "4096" },
+   {  "gate_rate",                FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, gate_rate),              "10" },
+   {  "gate_burst",               FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, gate_burst),             "5" },
+   {  "result_cache_size",        FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, result_size),            "1024" },
+   {  "result_cache_ttl",         FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, result_ttl),             "0" },
+   {  "key_cache_size",           FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, key_size),               "1024" },
+   {  "key_arena_size",           FR_CONF_OFFSET(PW_TYPE_INTEGER,     rlm_totp_code_t, arena_size),             "256" },
+   {  "cache_name",               FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, cache_name),             NULL },
+   {  "store_file",               FR_CONF_OFFSET(PW_TYPE_FILE_INPUT,  rlm_totp_code_t, store_file),             NULL },
+   {  "store_watch",              FR_CONF_OFFSET(PW_TYPE_BOOLEAN,     rlm_totp_code_t, store_watch),            "yes" },
+   {  "vsa_algorithm",            FR_CONF_OFFSET(PW_TYPE_STRING,      rlm_totp_code_t, vsa_algorithm_name),     NULL },
    CONF_PARSER_TERMINATOR
 };
 
@@ -492,21 +1487,166 @@ static const int8_t base32_map[256] =
 };
 
 
-extern module_t rlm_totp_code;
-module_t rlm_totp_code =
+static const int8_t base64_map[256] =
 {
-   .magic                  = RLM_MODULE_INIT,
-   .name                   = "totp_code",
-   .type                   = RLM_TYPE_THREAD_SAFE,
-   .inst_size              = sizeof(rlm_totp_code_t),
-   .config                 = module_config,
-   .instantiate            = mod_instantiate,
-   .bootstrap              = mod_bootstrap,
-   .detach                 = mod_detach,
-   .methods =
-   {  [MOD_AUTHENTICATE]   = mod_authenticate,
-      [MOD_POST_AUTH]      = mod_post_auth
-   },
+//    This map accepts both the standard and the URL safe alphabets:
+//       - plus sign and hyphen are both 62
+//       - slash and underscore are both 63
+// 00  01  02  03  04  05  06  07  08  09  0A  0B  0C  0D  0E  0F
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x00
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x10
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, 62, -1, 63, // 0x20
+   52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1, // 0x30
+   -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 0x40
+   15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, 63, // 0x50
+   -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, // 0x60
+   41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1, // 0x70
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x80
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x90
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xA0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xB0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xC0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xD0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xE0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xF0
+};
+
+
+static const int8_t hex_map[256] =
+{
+// 00  01  02  03  04  05  06  07  08  09  0A  0B  0C  0D  0E  0F
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x00
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x10
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x20
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1, // 0x30
+   -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x40
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x50
+   -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x60
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x70
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x80
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x90
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xA0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xB0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xC0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xD0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xE0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xF0
+};
+
+
+//-------------------//
+// mschap DES tables //
+//-------------------//
+// MARK: mschap DES tables
+
+// DES tables (FIPS 46-3), bits are numbered from 1 at the most significant bit
+static const uint8_t mschap_des_ip[64] =
+{  58, 50, 42, 34, 26, 18, 10,  2,  60, 52, 44, 36, 28, 20, 12,  4,
+   62, 54, 46, 38, 30, 22, 14,  6,  64, 56, 48, 40, 32, 24, 16,  8,
+   57, 49, 41, 33, 25, 17,  9,  1,  59, 51, 43, 35, 27, 19, 11,  3,
+   61, 53, 45, 37, 29, 21, 13,  5,  63, 55, 47, 39, 31, 23, 15,  7,
+};
+
+
+static const uint8_t mschap_des_fp[64] =
+{  40,  8, 48, 16, 56, 24, 64, 32,  39,  7, 47, 15, 55, 23, 63, 31,
+   38,  6, 46, 14, 54, 22, 62, 30,  37,  5, 45, 13, 53, 21, 61, 29,
+   36,  4, 44, 12, 52, 20, 60, 28,  35,  3, 43, 11, 51, 19, 59, 27,
+   34,  2, 42, 10, 50, 18, 58, 26,  33,  1, 41,  9, 49, 17, 57, 25,
+};
+
+
+static const uint8_t mschap_des_e[48] =
+{  32,  1,  2,  3,  4,  5,   4,  5,  6,  7,  8,  9,
+    8,  9, 10, 11, 12, 13,  12, 13, 14, 15, 16, 17,
+   16, 17, 18, 19, 20, 21,  20, 21, 22, 23, 24, 25,
+   24, 25, 26, 27, 28, 29,  28, 29, 30, 31, 32,  1,
+};
+
+
+static const uint8_t mschap_des_p[32] =
+{  16,  7, 20, 21, 29, 12, 28, 17,   1, 15, 23, 26,  5, 18, 31, 10,
+    2,  8, 24, 14, 32, 27,  3,  9,  19, 13, 30,  6, 22, 11,  4, 25,
+};
+
+
+static const uint8_t mschap_des_pc1[56] =
+{  57, 49, 41, 33, 25, 17,  9,   1, 58, 50, 42, 34, 26, 18,
+   10,  2, 59, 51, 43, 35, 27,  19, 11,  3, 60, 52, 44, 36,
+   63, 55, 47, 39, 31, 23, 15,   7, 62, 54, 46, 38, 30, 22,
+   14,  6, 61, 53, 45, 37, 29,  21, 13,  5, 28, 20, 12,  4,
+};
+
+
+static const uint8_t mschap_des_pc2[48] =
+{  14, 17, 11, 24,  1,  5,   3, 28, 15,  6, 21, 10,
+   23, 19, 12,  4, 26,  8,  16,  7, 27, 20, 13,  2,
+   41, 52, 31, 37, 47, 55,  30, 40, 51, 45, 33, 48,
+   44, 49, 39, 56, 34, 53,  46, 42, 50, 36, 29, 32,
+};
+
+
+static const uint8_t mschap_des_shifts[16] =
+{  1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1 };
+
+
+static const uint8_t mschap_des_sbox[8][64] =
+{  {  14,  4, 13,  1,  2, 15, 11,  8,  3, 10,  6, 12,  5,  9,  0,  7,
+       0, 15,  7,  4, 14,  2, 13,  1, 10,  6, 12, 11,  9,  5,  3,  8,
+       4,  1, 14,  8, 13,  6,  2, 11, 15, 12,  9,  7,  3, 10,  5,  0,
+      15, 12,  8,  2,  4,  9,  1,  7,  5, 11,  3, 14, 10,  0,  6, 13 },
+   {  15,  1,  8, 14,  6, 11,  3,  4,  9,  7,  2, 13, 12,  0,  5, 10,
+       3, 13,  4,  7, 15,  2,  8, 14, 12,  0,  1, 10,  6,  9, 11,  5,
+       0, 14,  7, 11, 10,  4, 13,  1,  5,  8, 12,  6,  9,  3,  2, 15,
+      13,  8, 10,  1,  3, 15,  4,  2, 11,  6,  7, 12,  0,  5, 14,  9 },
+   {  10,  0,  9, 14,  6,  3, 15,  5,  1, 13, 12,  7, 11,  4,  2,  8,
+      13,  7,  0,  9,  3,  4,  6, 10,  2,  8,  5, 14, 12, 11, 15,  1,
+      13,  6,  4,  9,  8, 15,  3,  0, 11,  1,  2, 12,  5, 10, 14,  7,
+       1, 10, 13,  0,  6,  9,  8,  7,  4, 15, 14,  3, 11,  5,  2, 12 },
+   {   7, 13, 14,  3,  0,  6,  9, 10,  1,  2,  8,  5, 11, 12,  4, 15,
+      13,  8, 11,  5,  6, 15,  0,  3,  4,  7,  2, 12,  1, 10, 14,  9,
+      10,  6,  9,  0, 12, 11,  7, 13, 15,  1,  3, 14,  5,  2,  8,  4,
+       3, 15,  0,  6, 10,  1, 13,  8,  9,  4,  5, 11, 12,  7,  2, 14 },
+   {   2, 12,  4,  1,  7, 10, 11,  6,  8,  5,  3, 15, 13,  0, 14,  9,
+      14, 11,  2, 12,  4,  7, 13,  1,  5,  0, 15, 10,  3,  9,  8,  6,
+       4,  2,  1, 11, 10, 13,  7,  8, 15,  9, 12,  5,  6,  3,  0, 14,
+      11,  8, 12,  7,  1, 14,  2, 13,  6, 15,  0,  9, 10,  4,  5,  3 },
+   {  12,  1, 10, 15,  9,  2,  6,  8,  0, 13,  3,  4, 14,  7,  5, 11,
+      10, 15,  4,  2,  7, 12,  9,  5,  6,  1, 13, 14,  0, 11,  3,  8,
+       9, 14, 15,  5,  2,  8, 12,  3,  7,  0,  4, 10,  1, 13, 11,  6,
+       4,  3,  2, 12,  9,  5, 15, 10, 11, 14,  1,  7,  6,  0,  8, 13 },
+   {   4, 11,  2, 14, 15,  0,  8, 13,  3, 12,  9,  7,  5, 10,  6,  1,
+      13,  0, 11,  7,  4,  9,  1, 10, 14,  3,  5, 12,  2, 15,  8,  6,
+       1,  4, 11, 13, 12,  3,  7, 14, 10, 15,  6,  8,  0,  5,  9,  2,
+       6, 11, 13,  8,  1,  4, 10,  7,  9,  5,  0, 15, 14,  2,  3, 12 },
+   {  13,  2,  8,  4,  6, 15, 11,  1, 10,  9,  3, 14,  5,  0, 12,  7,
+       1, 15, 13,  8, 10,  3,  7,  4, 12,  5,  6, 11,  0, 14,  9,  2,
+       7, 11,  4,  1,  9, 12, 14,  2,  0,  6, 10, 13, 15,  3,  5,  8,
+       2,  1, 14,  7,  4, 10,  8, 13, 15, 12,  9,  0,  3,  5,  6, 11 },
+};
+
+
+// caches shared between module instances
+static totp_cache_t *      totp_caches = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t     totp_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif // HAVE_PTHREAD_H
+
+
+extern module_t rlm_totp_code;
+module_t rlm_totp_code =
+{
+   .magic                  = RLM_MODULE_INIT,
+   .name                   = "totp_code",
+   .type                   = RLM_TYPE_THREAD_SAFE | RLM_TYPE_HUP_SAFE,
+   .inst_size              = sizeof(rlm_totp_code_t),
+   .config                 = module_config,
+   .instantiate            = mod_instantiate,
+   .detach                 = mod_detach,
+   .methods =
+   {  [MOD_AUTHENTICATE]   = mod_authenticate,
+      [MOD_POST_AUTH]      = mod_post_auth
+   },
 };
 
 
@@ -522,6 +1662,33 @@ static totp_algo_t totp_algorithm_map[] =
 };
 
 
+#define TOTP_STAT(_name) {  .name = #_name, .offset = offsetof(totp_cache_stats_t, _name) }
+static totp_stat_t totp_stats_map[] =
+{  TOTP_STAT(lookups),
+   TOTP_STAT(hits),
+   TOTP_STAT(misses),
+   TOTP_STAT(filtered),
+   TOTP_STAT(inserts),
+   TOTP_STAT(expiries),
+   TOTP_STAT(evictions),
+   TOTP_STAT(lockouts),
+   TOTP_STAT(cleanups),
+   TOTP_STAT(cleanup_max),
+   TOTP_STAT(cleanup_usec),
+   TOTP_STAT(cleanup_usec_max),
+   {  .name = NULL,     .offset = 0 }
+};
+#undef TOTP_STAT
+
+
+static const char * totp_lock_sites[RLM_TOTP_LOCK_SITES] =
+{  [RLM_TOTP_LOCK_CONSUME] = "consume",
+   [RLM_TOTP_LOCK_QUERY]   = "query",
+   [RLM_TOTP_LOCK_UPDATE]  = "update",
+   [RLM_TOTP_LOCK_ADMIN]   = "admin",
+};
+
+
 /////////////////
 //             //
 //  Functions  //
@@ -529,763 +1696,4484 @@ static totp_algo_t totp_algorithm_map[] =
 /////////////////
 // MARK: - Functions
 
-//------------------//
-// module functions //
-//------------------//
-// MARK: module functions
+//------------------//
+// module functions //
+//------------------//
+// MARK: module functions
+
+rlm_rcode_t
+mod_authenticate(
+         void *                        instance,
+         REQUEST *                     request)
+{
+   rlm_rcode_t             rcode;
+   totp_secure_t *         secure;
+   totp_secure_t           secure_buff;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+
+   // key material is kept in the arena, or on the stack if it is exhausted
+   secure = totp_arena_alloc(instance, &secure_buff);
+   rcode  = totp_authenticate(instance, request, secure);
+   totp_arena_free(instance, secure);
+
+   return(rcode);
+}
+
+
+int
+mod_detach(
+         void *                        instance )
+{
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   // destroy and free mutex lock
+#ifdef HAVE_PTHREAD_H
+   if ((inst->gate_mutex))
+   {  pthread_mutex_destroy(inst->gate_mutex);
+      inst->gate_mutex = NULL;
+   };
+   if ((inst->results_mutex))
+   {  pthread_mutex_destroy(inst->results_mutex);
+      inst->results_mutex = NULL;
+   };
+   if ((inst->keys_mutex))
+   {  pthread_mutex_destroy(inst->keys_mutex);
+      inst->keys_mutex = NULL;
+   };
+#endif // HAVE_PTHREAD_H
+
+   // decoded keys are not left in freed memory
+   totp_arena_close(instance);
+
+   // stop store thread before unmapping local secret store
+#ifdef HAVE_PTHREAD_H
+   if (inst->store_pipe[1] != -1)
+   {  if (write(inst->store_pipe[1], "", 1) == 1)
+         pthread_join(inst->store_thread, NULL);
+      close(inst->store_pipe[0]);
+      close(inst->store_pipe[1]);
+      inst->store_pipe[0] = -1;
+      inst->store_pipe[1] = -1;
+   };
+#endif // HAVE_PTHREAD_H
+   totp_store_free(inst->store);
+   inst->store = NULL;
+
+   // release shared cache
+   totp_cache_detach(instance);
+
+   return(0);
+}
+
+
+int
+mod_instantiate(
+         CONF_SECTION *                conf,
+         void *                        instance )
+{
+   rlm_totp_code_t *       inst;
+   PW_TYPE                 type;
+   const char *            vsa_name;
+
+   rad_assert(instance != NULL);
+
+   inst                 = instance;
+   inst->cache          = NULL;
+   inst->gate           = NULL;
+   inst->results        = NULL;
+   inst->keys           = NULL;
+   inst->arena          = NULL;
+   inst->store          = NULL;
+
+   // initialize mutex lock
+   inst->gate_mutex     = NULL;
+   inst->results_mutex  = NULL;
+   inst->keys_mutex     = NULL;
+#ifdef HAVE_PTHREAD_H
+   inst->store_pipe[0]  = -1;
+   inst->store_pipe[1]  = -1;
+   if ((inst->gate_mutex = talloc_zero(instance, pthread_mutex_t)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for mutex lock");
+      return(-1);
+   };
+   pthread_mutex_init(inst->gate_mutex, NULL);
+   if ((inst->results_mutex = talloc_zero(instance, pthread_mutex_t)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for mutex lock");
+      return(-1);
+   };
+   pthread_mutex_init(inst->results_mutex, NULL);
+   if ((inst->keys_mutex = talloc_zero(instance, pthread_mutex_t)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for mutex lock");
+      return(-1);
+   };
+   pthread_mutex_init(inst->keys_mutex, NULL);
+#endif // HAVE_PTHREAD_H
+
+   // registered during instantiation so a HUP points xlats at the new instance
+   if (totp_xlat_register(instance, conf) != 0)
+      return(-1);
+
+   FR_INTEGER_BOUND_CHECK("time_step",    inst->totp_x,           >=, 1);
+   FR_INTEGER_BOUND_CHECK("otp_length",   inst->otp_length,       >=, 1);
+   FR_INTEGER_BOUND_CHECK("otp_length",   inst->otp_length,       <=, 9);
+   FR_INTEGER_BOUND_CHECK("time_drift",   inst->totp_time_drift,  <, inst->totp_x);
+   FR_INTEGER_BOUND_CHECK("try_previous", inst->try_prev,         <=, RLM_TOTP_TRY_MAX);
+   FR_INTEGER_BOUND_CHECK("try_next",     inst->try_next,         <=, RLM_TOTP_TRY_MAX);
+   FR_INTEGER_BOUND_CHECK("cache_filter_size", inst->cache_filter_size, <=, (1 << 24));
+   FR_INTEGER_BOUND_CHECK("failure_sketch_width", inst->sketch_width, <=, (1 << 20));
+   FR_INTEGER_BOUND_CHECK("failure_sketch_depth", inst->sketch_depth, >=, 1);
+   FR_INTEGER_BOUND_CHECK("failure_sketch_depth", inst->sketch_depth, <=, 8);
+   FR_INTEGER_BOUND_CHECK("failure_sketch_threshold", inst->sketch_threshold, >=, 1);
+   FR_INTEGER_BOUND_CHECK("gate_size",    inst->gate_size,        >=, 1);
+   FR_INTEGER_BOUND_CHECK("gate_size",    inst->gate_size,        <=, (1 << 24));
+   FR_INTEGER_BOUND_CHECK("gate_rate",    inst->gate_rate,        >=, 1);
+   FR_INTEGER_BOUND_CHECK("gate_burst",   inst->gate_burst,       >=, 1);
+   FR_INTEGER_BOUND_CHECK("gate_burst",   inst->gate_burst,       <=, 1000000);
+   FR_INTEGER_BOUND_CHECK("result_cache_size", inst->result_size, >=, 1);
+   FR_INTEGER_BOUND_CHECK("result_cache_size", inst->result_size, <=, (1 << 20));
+   FR_INTEGER_BOUND_CHECK("result_cache_ttl",  inst->result_ttl,  <=, 60);
+   FR_INTEGER_BOUND_CHECK("key_cache_size",    inst->key_size,    <=, (1 << 20));
+   FR_INTEGER_BOUND_CHECK("key_arena_size",    inst->arena_size,  >=, 1);
+   FR_INTEGER_BOUND_CHECK("key_arena_size",    inst->arena_size,  <=, (1 << 16));
+
+   if ((inst->totp_algo = totp_algo_algorithm_id(inst->totp_algo_str)) == -1)
+   {  WARN("Ignoring \"algorithm = %s\", forcing to \"algorithm = SHA1\"", inst->totp_algo_str);
+      inst->totp_algo = RLM_TOTP_HMAC_SHA1;
+   };
+
+   if ((inst->secret_encoding = totp_key_encoding_id(inst->secret_encoding_str)) == -1)
+   {  WARN("Ignoring \"secret_encoding = %s\", forcing to \"secret_encoding = base32\"", inst->secret_encoding_str);
+      inst->secret_encoding = RLM_TOTP_ENCODING_BASE32;
+   };
+
+   // lookup and verify VSA specified by config option vsa_cache_key
+   if ((vsa_name = inst->vsa_cache_id_name) != NULL)
+   {  if ((inst->vsa_cache_id = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_secret
+   if ((vsa_name = inst->vsa_secret_name) != NULL)
+   {  if ((inst->vsa_secret = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_key
+   if ((vsa_name = inst->vsa_key_name) != NULL)
+   {  if ((inst->vsa_key = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_pass
+   if ((vsa_name = inst->vsa_pass_name) != NULL)
+   {  if ((inst->vsa_pass = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_time_offset
+   if ((vsa_name = inst->vsa_time_offset_name) != NULL)
+   {  if ((inst->vsa_time_offset = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+      type = inst->vsa_time_offset->type;
+      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
+      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_unix_time
+   if ((vsa_name = inst->vsa_start_time_name) != NULL)
+   {  if ((inst->vsa_unix_time = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+      type = inst->vsa_unix_time->type;
+      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
+      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_time_step
+   if ((vsa_name = inst->vsa_time_step_name) != NULL)
+   {  if ((inst->vsa_time_step = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+      type = inst->vsa_time_step->type;
+      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
+      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_otp_length
+   if ((vsa_name = inst->vsa_otp_length_name) != NULL)
+   {  if ((inst->vsa_otp_length = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+      type = inst->vsa_otp_length->type;
+      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
+      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup and verify VSA specified by config option vsa_algorithm
+   if ((vsa_name = inst->vsa_algorithm_name) != NULL)
+   {  if ((inst->vsa_algorithm = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+      type = inst->vsa_algorithm->type;
+      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
+      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup VSA specified by config option gate_key
+   if ((vsa_name = inst->gate_key_name) != NULL)
+   {  if ((inst->gate_key = dict_attrbyname(vsa_name)) == NULL)
+      {  ERROR("'%s' not found in dictionary", vsa_name);
+         return(-1);
+      };
+   };
+
+   // lookup static password of CHAP and MS-CHAPv2 requests verified by module
+   if ( ((inst->allow_chap)) || ((inst->allow_mschap)) )
+   {  if ((inst->cleartext_password = dict_attrbyname("Cleartext-Password")) == NULL)
+      {  ERROR("'%s' not found in dictionary", "Cleartext-Password");
+         return(-1);
+      };
+   };
+
+   // lookup attributes of CHAP requests verified by module
+   if ((inst->allow_chap))
+   {  inst->chap_password        = dict_attrbyname("CHAP-Password");
+      inst->chap_challenge       = dict_attrbyname("CHAP-Challenge");
+      if ( (!(inst->chap_password)) || (!(inst->chap_challenge)) )
+      {  ERROR("totp_code: CHAP attributes not found in dictionary");
+         return(-1);
+      };
+   };
+
+   // lookup password containing TOTP code when code is split by module
+   if ((inst->split_password))
+   {  if ((inst->user_password = dict_attrbyname("User-Password")) == NULL)
+      {  ERROR("'%s' not found in dictionary", "User-Password");
+         return(-1);
+      };
+   };
+
+   // lookup attributes of MS-CHAPv2 requests verified by module
+   if ((inst->allow_mschap))
+   {  inst->user_name            = dict_attrbyname("User-Name");
+      inst->mschap_user_name     = dict_attrbyname("MS-CHAP-User-Name");
+      inst->mschap_challenge     = dict_attrbyname("MS-CHAP-Challenge");
+      inst->mschap2_response     = dict_attrbyname("MS-CHAP2-Response");
+      if ( (!(inst->user_name)) || (!(inst->mschap_user_name)) || (!(inst->mschap_challenge)) || (!(inst->mschap2_response)) )
+      {  ERROR("totp_code: MS-CHAPv2 attributes not found in dictionary");
+         return(-1);
+      };
+   };
+
+   // initialize rate limiting buckets with a power of two number of buckets
+   if (inst->gate_key != NULL)
+   {  inst->gate_mask = RLM_TOTP_GATE_WAYS;
+      while (inst->gate_mask < inst->gate_size)
+         inst->gate_mask <<= 1;
+      if ((inst->gate = talloc_zero_array(instance, totp_gate_bucket_t, inst->gate_mask)) == NULL)
+      {  ERROR("totp_code: failed to allocate memory for rate limiting buckets");
+         return(-1);
+      };
+      inst->gate_size  = inst->gate_mask;
+      inst->gate_mask  = (inst->gate_size / RLM_TOTP_GATE_WAYS) - 1;
+   };
+
+   // initialize results of recent requests with a power of two number of slots
+   if ((inst->result_ttl))
+   {  inst->results_mask = 1;
+      while (inst->results_mask < inst->result_size)
+         inst->results_mask <<= 1;
+      if ((inst->results = talloc_zero_array(instance, totp_result_t, inst->results_mask)) == NULL)
+      {  ERROR("totp_code: failed to allocate memory for request results");
+         return(-1);
+      };
+      inst->result_size   = inst->results_mask;
+      inst->results_mask -= 1;
+   };
+
+   // initialize decoded keys with a power of two number of slots
+   if ((inst->key_size))
+   {  inst->keys_mask = 1;
+      while (inst->keys_mask < inst->key_size)
+         inst->keys_mask <<= 1;
+      inst->key_size   = inst->keys_mask;
+      inst->keys_mask -= 1;
+   };
+
+   // map arena holding decoded keys and key material of requests
+   if (totp_arena_open(instance) != 0)
+      return(-1);
+
+   // load key used to decrypt VSA specified by config option vsa_encrypted_key
+   if (totp_key_load(instance) != 0)
+      return(-1);
+
+   // attributes collected with one walk of each list by totp_request_vp_gather()
+   totp_request_vp_match(instance, inst->vsa_pass,          RLM_TOTP_VP_PASS,          TOTP_SCOPE_REQUEST);
+   totp_request_vp_match(instance, inst->vsa_cache_id,      RLM_TOTP_VP_CACHE_ID,      TOTP_SCOPE_REQUEST);
+   totp_request_vp_match(instance, inst->vsa_cache_id,      RLM_TOTP_VP_CACHE_ID,      TOTP_SCOPE_CONTROL);
+   totp_request_vp_match(instance, inst->vsa_cache_id,      RLM_TOTP_VP_CACHE_ID,      TOTP_SCOPE_REPLY);
+   totp_request_vp_match(instance, inst->gate_key,          RLM_TOTP_VP_GATE_KEY,      TOTP_SCOPE_REQUEST);
+   totp_request_vp_match(instance, inst->gate_key,          RLM_TOTP_VP_GATE_KEY,      TOTP_SCOPE_CONTROL);
+   totp_request_vp_match(instance, inst->vsa_encrypted_key, RLM_TOTP_VP_ENCRYPTED_KEY, TOTP_SCOPE_CONTROL);
+   totp_request_vp_match(instance, inst->vsa_secret,        RLM_TOTP_VP_SECRET,        TOTP_SCOPE_CONTROL);
+   totp_request_vp_match(instance, inst->vsa_key,           RLM_TOTP_VP_KEY,           TOTP_SCOPE_CONTROL);
+   if ((inst->allow_override))
+   {  totp_request_vp_match(instance, inst->vsa_time_offset, RLM_TOTP_VP_TIME_OFFSET,  TOTP_SCOPE_CONTROL);
+      totp_request_vp_match(instance, inst->vsa_unix_time,   RLM_TOTP_VP_START_TIME,   TOTP_SCOPE_CONTROL);
+      totp_request_vp_match(instance, inst->vsa_time_step,   RLM_TOTP_VP_TIME_STEP,    TOTP_SCOPE_CONTROL);
+      totp_request_vp_match(instance, inst->vsa_otp_length,  RLM_TOTP_VP_OTP_LENGTH,   TOTP_SCOPE_CONTROL);
+      totp_request_vp_match(instance, inst->vsa_algorithm,   RLM_TOTP_VP_ALGORITHM,    TOTP_SCOPE_CONTROL);
+   };
+   if ((inst->split_password))
+      totp_request_vp_match(instance, inst->user_password,      RLM_TOTP_VP_USER_PASSWORD,  TOTP_SCOPE_REQUEST);
+   if ( ((inst->allow_chap)) || ((inst->allow_mschap)) )
+      totp_request_vp_match(instance, inst->cleartext_password, RLM_TOTP_VP_CLEARTEXT,    TOTP_SCOPE_CONTROL);
+   if ((inst->allow_chap))
+   {  totp_request_vp_match(instance, inst->chap_password,      RLM_TOTP_VP_CHAP_PASSWORD,  TOTP_SCOPE_REQUEST);
+      totp_request_vp_match(instance, inst->chap_challenge,     RLM_TOTP_VP_CHAP_CHALLENGE, TOTP_SCOPE_REQUEST);
+   };
+   if ((inst->allow_mschap))
+   {  totp_request_vp_match(instance, inst->user_name,          RLM_TOTP_VP_USER_NAME,    TOTP_SCOPE_REQUEST);
+      totp_request_vp_match(instance, inst->mschap_user_name,   RLM_TOTP_VP_MSCHAP_USER,  TOTP_SCOPE_REQUEST);
+      totp_request_vp_match(instance, inst->mschap_challenge,   RLM_TOTP_VP_MSCHAP_CHAL,  TOTP_SCOPE_REQUEST);
+      totp_request_vp_match(instance, inst->mschap2_response,   RLM_TOTP_VP_MSCHAP2_RESP, TOTP_SCOPE_REQUEST);
+   };
+
+   if ( ((inst->max_attempts)) && (inst->sketch_threshold > inst->max_attempts) )
+      inst->sketch_threshold = inst->max_attempts;
+
+   // map local secret store
+   if (totp_store_open(instance) != 0)
+      return(-1);
+
+   // attach to cache shared by module instances
+   if (totp_cache_attach(instance) != 0)
+      return(-1);
+
+   return(0);
+}
+
+
+rlm_rcode_t
+mod_post_auth(
+         void *                        instance,
+         REQUEST *                     request)
+{
+   totp_params_t        params;
+   int                  action;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+
+   // original request already updated cache for retransmitted requests
+   if (request_data_reference(request, instance, RLM_TOTP_REQUEST_REPLAYED) != NULL)
+      return(RLM_MODULE_NOOP);
+
+   // determine TOTP parameters, key is not needed
+   if ( totp_algo_params(instance, request, &params, NULL) != 0)
+      return(RLM_MODULE_NOOP);
+
+   switch(request->reply->code)
+   {  case PW_CODE_ACCESS_ACCEPT: action = RLM_TOTP_CACHE_EXPIRED; break;
+      case PW_CODE_ACCESS_REJECT: action = RLM_TOTP_CACHE_FAILED; break;
+      default: return(RLM_MODULE_NOOP);
+   };
+
+   // update cache
+   totp_cache_update(instance, request, &params, action);
+
+   return(RLM_MODULE_NOOP);
+}
+
+
+rlm_rcode_t
+totp_authenticate(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_secure_t *               secure )
+{
+   int                     rc;
+   int                     mode;
+   ssize_t                 idx;
+   ssize_t                 len;
+   ssize_t                 candidates_len;
+   size_t                  key_len;
+   size_t                  counters_len;
+   uint64_t                counters[RLM_TOTP_CANDIDATES_MAX];
+   uint64_t                candidates[RLM_TOTP_CANDIDATES_MAX];
+   uint32_t                otps[RLM_TOTP_CANDIDATES_MAX];
+   uint32_t                codes[RLM_TOTP_CANDIDATES_MAX];
+   const uint8_t *         key;
+   VALUE_PAIR *            pass_vp;
+   VALUE_PAIR *            vp;
+	rlm_totp_code_t *       inst;
+   totp_params_t           params;
+   rlm_rcode_t             rcode;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(secure   != NULL);
+
+   inst = instance;
+
+   key            = NULL;
+   key_len        = 0;
+   counters_len   = 0;
+
+   // determine TOTP parameters
+   if ((rc = totp_algo_params(instance, request, &params, secure->store_key)) != 0)
+      return(RLM_MODULE_REJECT);
+
+   // retrieve TOTP password, split it from User-Password, or use MS-CHAPv2 or CHAP response
+   mode = RLM_TOTP_AUTH_PASS;
+   if ((pass_vp = params.vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_PASS]) != NULL)
+   {  params.pass       = pass_vp->data.octets;
+      params.pass_len   = pass_vp->length;
+   }
+   else if ((rc = totp_request_pass_split(instance, request, &params)) == 1)
+   {  mode = RLM_TOTP_AUTH_MSCHAP;
+      if ((rc = totp_mschap_init(instance, request, &params, &secure->mschap)) == 1)
+      {  mode = RLM_TOTP_AUTH_CHAP;
+         rc   = totp_chap_init(instance, request, &params, &secure->chap);
+      };
+   };
+   if (rc == -1)
+      return(RLM_MODULE_REJECT);
+   if (rc == 1)
+   {  if ((inst->devel_debug))
+         RDEBUG2("TOTP password is not set, skipping TOTP auth");
+      return(RLM_MODULE_NOOP);
+   };
+
+   // return original result of retransmitted requests
+   if (totp_result_query(instance, request, &params, &rcode) == 0)
+   {  RDEBUG2("returning result of previous attempt for retransmitted request");
+      request_data_add(request, instance, RLM_TOTP_REQUEST_REPLAYED, instance, false);
+      return(rcode);
+   };
+
+   // shed excessive attempts before decoding key or calculating HMACs
+   if (totp_gate_check(instance, request, &params) != 0)
+      return(RLM_MODULE_REJECT);
+
+   // key of user in local secret store is used before attributes
+   key      = params.key;
+   key_len  = params.key_len;
+   if ( ((key)) && ((inst->devel_debug)) )
+      RDEBUG2("using TOTP key from local secret store");
+
+   // attempt to obtain TOTP key from attributes
+   if (key == NULL)
+   {  vp = params.vps[TOTP_SCOPE_CONTROL][RLM_TOTP_VP_ENCRYPTED_KEY];
+      if (vp != NULL)
+      {  if ((len = totp_key_decrypt(instance, request, vp->data.octets, vp->length, secure->key, sizeof(secure->key))) >= 0)
+         {  key      = secure->key;
+            key_len  = (size_t)len;
+         };
+      };
+   };
+   if (key == NULL)
+   {  vp = params.vps[TOTP_SCOPE_CONTROL][RLM_TOTP_VP_SECRET];
+      if (vp != NULL)
+      {  if ((len = totp_key_decode(instance, request, vp->data.strvalue, vp->length, secure->key, sizeof(secure->key))) >= 0)
+         {  key      = secure->key;
+            key_len  = (size_t)len;
+         };
+      };
+   };
+   if (key == NULL)
+   {  vp = params.vps[TOTP_SCOPE_CONTROL][RLM_TOTP_VP_KEY];
+      if (vp != NULL)
+      {  key      = vp->data.octets;
+         key_len  = vp->length;
+      };
+   };
+   if (!(key))
+   {  RDEBUG2("TOTP secret is not set");
+      return(RLM_MODULE_REJECT);
+   };
+
+   params.key     = key;
+   params.key_len = key_len;
+
+   // calculate codes of every time step within the window
+   if ((candidates_len = totp_algo_window(instance, &params, candidates, otps)) < 0)
+   {  RDEBUG2("error generating TOTP code");
+      candidates_len = 0;
+   };
+
+   // collect time step counters of candidate codes which match password
+   for(idx = 0; (idx < candidates_len); idx++)
+   {  params.totp_t = candidates[idx];
+      snprintf(params.otp, sizeof(params.otp), "%0*u", (int)params.otp_length, (unsigned)otps[idx]);
+      totp_algo_debug(instance, request, &params);
+
+      // compare codes
+      switch(mode)
+      {  case RLM_TOTP_AUTH_MSCHAP:
+            rc = totp_mschap_verify(&secure->mschap, params.otp);
+            break;
+
+         case RLM_TOTP_AUTH_CHAP:
+            rc = totp_chap_verify(&secure->chap, params.otp);
+            break;
+
+         default:
+            rc = -1;
+            if (params.otp_length == params.pass_len)
+               rc = (!(memcmp(params.otp, params.pass, params.pass_len))) ? 0 : -1;
+            break;
+      };
+      if (rc == 0)
+      {  codes[counters_len]      = otps[idx];
+         counters[counters_len++] = params.totp_t;
+         continue;
+      };
+      if ((inst->devel_debug))
+         RDEBUG2("TOTP code does not match expected code");
+   };
+
+   // check matched codes against cache and consume first allowed code
+   if ((idx = totp_cache_consume(instance, request, &params, counters, counters_len)) >= 0)
+   {  if (mode == RLM_TOTP_AUTH_MSCHAP)
+      {  snprintf(params.otp, sizeof(params.otp), "%0*u", (int)params.otp_length, (unsigned)codes[idx]);
+         totp_mschap_reply(request, &secure->mschap, params.otp);
+      };
+      return(totp_result_store(instance, request, &params, RLM_MODULE_OK));
+   };
+
+   if (counters_len > 0)
+      RDEBUG2("TOTP is locked out due to reuse or too many attempts");
+   RDEBUG2("failed TOTP authentication");
+   if (mode == RLM_TOTP_AUTH_MSCHAP)
+      totp_mschap_error(request, &secure->mschap);
+
+   return(totp_result_store(instance, request, &params, RLM_MODULE_REJECT));
+}
+
+
+//------------------//
+// result functions //
+//------------------//
+// MARK: result functions
+
+int
+totp_result_query(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         rlm_rcode_t *                 rcodep )
+{
+   int                     rc;
+   rlm_totp_code_t *       inst;
+   totp_result_t           result;
+   totp_result_t *         slot;
+
+   rad_assert(instance  != NULL);
+   rad_assert(rcodep    != NULL);
+
+   inst = instance;
+
+   if ((slot = totp_result_slot(instance, request, params, &result)) == NULL)
+      return(-1);
+
+   pthread_mutex_lock(inst->results_mutex);
+   rc = -1;
+   if ( (slot->expires >= request->timestamp.tv_sec) &&
+        (slot->key_hash == result.key_hash) &&
+        (slot->key_len  == result.key_len) &&
+        (slot->id       == result.id) &&
+        (!(memcmp(slot->vector, result.vector, sizeof(result.vector)))) &&
+        (!(memcmp(slot->otp,    result.otp,    sizeof(result.otp)))) &&
+        (!(memcmp(slot->key,    result.key,    result.key_len))) )
+   {  *rcodep = slot->rcode;
+      rc      = 0;
+   };
+   pthread_mutex_unlock(inst->results_mutex);
+
+   return(rc);
+}
+
+
+totp_result_t *
+totp_result_slot(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_result_t *               result )
+{
+   uint32_t                hash;
+   rlm_totp_code_t *       inst;
+   totp_cache_entry_t      cache_key;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+   rad_assert(params    != NULL);
+   rad_assert(result    != NULL);
+
+   inst     = instance;
+
+   if (!(inst->results))
+      return(NULL);
+   if (params->pass == NULL)
+      return(NULL);
+   if (params->pass_len >= sizeof(result->otp))
+      return(NULL);
+   if (totp_cache_entry_key(instance, request, params, &cache_key) != 0)
+      return(NULL);
+   if (cache_key.keylen > sizeof(result->key))
+      return(NULL);
+
+   // retransmitted requests share identity, password, identifier, and authenticator
+   memset(result, 0, sizeof(totp_result_t));
+   result->key_hash  = cache_key.hash;
+   result->key_len   = (uint32_t)cache_key.keylen;
+   result->id        = request->packet->id;
+   memcpy(result->vector, request->packet->vector, sizeof(result->vector));
+   memcpy(result->otp,    params->pass,           params->pass_len);
+   memcpy(result->key,    cache_key.key,          cache_key.keylen);
+
+   // hash only selects the slot, queries compare the complete key
+   hash  = fr_hash_update(result->vector, sizeof(result->vector), result->key_hash);
+   hash  = fr_hash_update(result->otp,    params->pass_len,       hash);
+   hash ^= (uint32_t)result->id;
+
+   return(&inst->results[hash & inst->results_mask]);
+}
+
+
+rlm_rcode_t
+totp_result_store(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         rlm_rcode_t                   rcode )
+{
+   rlm_totp_code_t *       inst;
+   totp_result_t           result;
+   totp_result_t *         slot;
+
+   rad_assert(instance  != NULL);
+
+   inst = instance;
+
+   if ((slot = totp_result_slot(instance, request, params, &result)) == NULL)
+      return(rcode);
+
+   result.rcode   = rcode;
+   result.expires = request->timestamp.tv_sec + inst->result_ttl;
+
+   pthread_mutex_lock(inst->results_mutex);
+   memcpy(slot, &result, sizeof(totp_result_t));
+   pthread_mutex_unlock(inst->results_mutex);
+
+   return(rcode);
+}
+
+
+//-----------------//
+// arena functions //
+//-----------------//
+// MARK: arena functions
+
+// slots are found without locks, threads start searching at different words
+totp_secure_t *
+totp_arena_alloc(
+         void *                        instance,
+         totp_secure_t *               fallback )
+{
+   uint32_t                idx;
+   uint32_t                word;
+   uint32_t                start;
+   uint64_t                bits;
+   unsigned                bit;
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   if (inst->arena_words == 0)
+      return(fallback);
+
+   start = __atomic_fetch_add(&inst->arena_hint, 1, __ATOMIC_RELAXED);
+   for(idx = 0; (idx < inst->arena_words); idx++)
+   {  word = (start + idx) % inst->arena_words;
+      bits = __atomic_load_n(&inst->arena_map[word], __ATOMIC_RELAXED);
+      while (bits != UINT64_MAX)
+      {  bit = (unsigned)__builtin_ctzll(~bits);
+         if ((__atomic_compare_exchange_n(&inst->arena_map[word], &bits, (bits | (1ULL << bit)), true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+         {  __atomic_fetch_add(&inst->arena_used, 1, __ATOMIC_RELAXED);
+            return(&inst->arena_slots[(word * 64) + bit]);
+         };
+      };
+   };
+
+   __atomic_fetch_add(&inst->arena_exhausted, 1, __ATOMIC_RELAXED);
+
+   return(fallback);
+}
+
+
+void
+totp_arena_close(
+         void *                        instance )
+{
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   if (!(inst->arena))
+      return;
+
+   // decoded keys are not left in freed memory
+   totp_key_zeroize(inst->arena, inst->arena_len);
+   if ((inst->arena_locked))
+      munlock(inst->arena, inst->arena_len);
+   munmap(inst->arena, inst->arena_len);
+
+   inst->arena          = NULL;
+   inst->arena_len      = 0;
+   inst->arena_slots    = NULL;
+   inst->arena_words    = 0;
+   inst->arena_locked   = false;
+   inst->keys           = NULL;
+   inst->encryption     = NULL;
+
+   return;
+}
+
+
+void
+totp_arena_free(
+         void *                        instance,
+         totp_secure_t *               secure )
+{
+   size_t                  idx;
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   if (!(secure))
+      return;
+
+   totp_key_zeroize(secure, sizeof(totp_secure_t));
+
+   // buffers on the stack are only zeroized
+   if (!(inst->arena_slots))
+      return;
+   if ( (secure < inst->arena_slots) || (secure >= &inst->arena_slots[inst->arena_words * 64]) )
+      return;
+
+   idx = (size_t)(secure - inst->arena_slots);
+   __atomic_fetch_and(&inst->arena_map[idx / 64], ~(1ULL << (idx % 64)), __ATOMIC_RELEASE);
+   __atomic_fetch_sub(&inst->arena_used, 1, __ATOMIC_RELAXED);
+
+   return;
+}
+
+
+// decoded key cache is placed before the slots, both are locked into memory
+int
+totp_arena_open(
+         void *                        instance )
+{
+   size_t                  keys_len;
+   size_t                  page_len;
+   uint32_t                idx;
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst                    = instance;
+   inst->arena             = NULL;
+   inst->arena_slots       = NULL;
+   inst->arena_map         = NULL;
+   inst->arena_words       = (inst->arena_size + 63) / 64;
+   inst->arena_hint        = 0;
+   inst->arena_used        = 0;
+   inst->arena_exhausted   = 0;
+   inst->arena_locked      = false;
+   inst->keys              = NULL;
+   inst->encryption        = NULL;
+
+   keys_len          = sizeof(totp_key_t) * inst->key_size;
+   keys_len          = (keys_len + RLM_TOTP_CACHE_LINE - 1) & ~((size_t)RLM_TOTP_CACHE_LINE - 1);
+   page_len          = (size_t)sysconf(_SC_PAGESIZE);
+   inst->arena_len   = keys_len + (sizeof(totp_secure_t) * inst->arena_words * 64);
+   inst->arena_len   = (inst->arena_len + page_len - 1) & ~(page_len - 1);
+
+   if ((inst->arena = mmap(NULL, inst->arena_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+   {  ERROR("totp_code: failed to map key arena: %s", fr_syserror(errno));
+      inst->arena = NULL;
+      return(-1);
+   };
+
+   // keys are kept out of swap and core dumps where supported
+#ifdef MADV_DONTDUMP
+   madvise(inst->arena, inst->arena_len, MADV_DONTDUMP);
+#endif
+   if (mlock(inst->arena, inst->arena_len) == 0)
+      inst->arena_locked = true;
+   else
+      WARN("totp_code: unable to lock %zu bytes of key arena: %s", inst->arena_len, fr_syserror(errno));
+
+   // mark bits after the last slot as allocated
+   if ((inst->arena_map = talloc_zero_array(instance, uint64_t, inst->arena_words)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for key arena");
+      totp_arena_close(instance);
+      return(-1);
+   };
+   for(idx = inst->arena_size; (idx < (inst->arena_words * 64)); idx++)
+      inst->arena_map[idx / 64] |= (1ULL << (idx % 64));
+
+   inst->keys        = ((inst->key_size)) ? (totp_key_t *)inst->arena : NULL;
+   inst->arena_slots = (totp_secure_t *)&inst->arena[keys_len];
+
+   return(0);
+}
+
+
+//------------------//
+// base32 functions //
+//------------------//
+// MARK: base32 functions
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("avx2")))
+size_t
+totp_base32_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m256i     x;
+   __m256i     v;
+   __m256i     m;
+   __m256i     ok;
+   __m256i     lo;
+   uint8_t     out[32];
+
+   // each iteration decodes 32 characters into 20 bytes
+   for(pos = 0; ( ((pos + 32) <= srclen) && ((((pos + 32) * 5) / 8) <= dstlen) ); pos += 32)
+   {  x  = _mm256_loadu_si256((const __m256i *)&src[pos]);
+
+      // map characters to values using the same rules as base32_map
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+      ok = m;
+      v  = _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('A')));
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), x));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('a'))));
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('2' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('7' + 1), x));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('2' - 26))));
+      m  = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('0'));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(14)));
+      m  = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('1'));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(11)));
+      m  = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('8'));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(1)));
+      m  = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('{'));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(26)));
+
+      // padding and invalid characters are handled by the scalar decoder
+      if (_mm256_movemask_epi8(ok) != -1)
+         break;
+
+      // pack 5 bit values into 10, 20 and then 40 bit big-endian groups
+      v  = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0120));
+      v  = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00010400));
+      lo = _mm256_and_si256(v, _mm256_set1_epi64x(0xFFFFFFFF));
+      v  = _mm256_or_si256(_mm256_slli_epi64(lo, 20), _mm256_srli_epi64(v, 32));
+      v  = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+               4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1,
+               4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+      _mm256_storeu_si256((__m256i *)out, v);
+      memcpy(&dst[((pos * 5) / 8)],      &out[0],  10);
+      memcpy(&dst[((pos * 5) / 8) + 10], &out[16], 10);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+ssize_t
+totp_base32_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      datlen;
+   size_t      pos;
+   unsigned    bits;
+   uint32_t    acc;
+   int8_t      val;
+
+   rad_assert(dst != NULL);
+   rad_assert( (src != NULL) || (srclen == 0) );
+
+   // decode complete blocks with vector instructions if supported by CPU
+   pos = 0;
+#ifdef RLM_TOTP_X86_SIMD
+   if (srclen >= 16)
+   {  if (__builtin_cpu_supports("avx2"))
+         pos = totp_base32_decode_avx2(dst, dstlen, src, srclen);
+      if (__builtin_cpu_supports("ssse3"))
+         pos += totp_base32_decode_ssse3(&dst[((pos * 5) / 8)], (dstlen - ((pos * 5) / 8)), &src[pos], (srclen - pos));
+   };
+#endif // RLM_TOTP_X86_SIMD
+
+   // validate and decode remaining characters in a single pass
+   datlen = (pos * 5) / 8;
+   acc    = 0;
+   bits   = 0;
+   for(; (pos < srclen); pos++)
+   {  if (src[pos] == '=')
+         break;
+      if ((val = base32_map[(uint8_t)src[pos]]) == -1)
+         return(RLM_TOTP_CODE_EBASE32);
+      acc   = (acc << 5) | (uint32_t)val;
+      bits += 5;
+      if (bits < 8)
+         continue;
+      bits -= 8;
+      if (datlen >= dstlen)
+         return(RLM_TOTP_CODE_EBUFSIZ);
+      dst[datlen++] = (uint8_t)(acc >> bits);
+   };
+
+   // verify correct use of padding
+   if (pos < srclen)
+   {  if ((pos % 8) < 2)
+         return(RLM_TOTP_CODE_EBASE32);
+      if ((pos + (8 - (pos % 8))) != srclen)
+         return(RLM_TOTP_CODE_EBASE32);
+      for(bits = pos; (bits < srclen); bits++)
+         if (src[bits] != '=')
+            return(RLM_TOTP_CODE_EBASE32);
+   };
+
+   // verify length of data without padding
+   switch(pos % 8)
+   {  case 0:
+      case 2:
+      case 4:
+      case 5:
+      case 7:
+         break;
+
+      default:
+         return(RLM_TOTP_CODE_EBASE32);
+   };
+
+   return((ssize_t)datlen);
+}
+
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("ssse3")))
+size_t
+totp_base32_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m128i     x;
+   __m128i     v;
+   __m128i     m;
+   __m128i     ok;
+   __m128i     lo;
+   uint8_t     out[16];
+
+   // each iteration decodes 16 characters into 10 bytes
+   for(pos = 0; ( ((pos + 16) <= srclen) && ((((pos + 16) * 5) / 8) <= dstlen) ); pos += 16)
+   {  x  = _mm_loadu_si128((const __m128i *)&src[pos]);
+
+      // map characters to values using the same rules as base32_map
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+      ok = m;
+      v  = _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('A')));
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('z' + 1)));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('a'))));
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('2' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('7' + 1)));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('2' - 26))));
+      m  = _mm_cmpeq_epi8(x, _mm_set1_epi8('0'));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(14)));
+      m  = _mm_cmpeq_epi8(x, _mm_set1_epi8('1'));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(11)));
+      m  = _mm_cmpeq_epi8(x, _mm_set1_epi8('8'));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(1)));
+      m  = _mm_cmpeq_epi8(x, _mm_set1_epi8('{'));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(26)));
+
+      // padding and invalid characters are handled by the scalar decoder
+      if (_mm_movemask_epi8(ok) != 0xFFFF)
+         break;
+
+      // pack 5 bit values into 10, 20 and then 40 bit big-endian groups
+      v  = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0120));
+      v  = _mm_madd_epi16(v, _mm_set1_epi32(0x00010400));
+      lo = _mm_and_si128(v, _mm_set1_epi64x(0xFFFFFFFF));
+      v  = _mm_or_si128(_mm_slli_epi64(lo, 20), _mm_srli_epi64(v, 32));
+      v  = _mm_shuffle_epi8(v, _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -1, -1, -1, -1, -1, -1));
+      _mm_storeu_si128((__m128i *)out, v);
+      memcpy(&dst[((pos * 5) / 8)], out, 10);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+//------------------//
+// base64 functions //
+//------------------//
+// MARK: base64 functions
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("avx2")))
+size_t
+totp_base64_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m256i     x;
+   __m256i     v;
+   __m256i     m;
+   __m256i     ok;
+   uint8_t     out[32];
+
+   // each iteration decodes 32 characters into 24 bytes
+   for(pos = 0; ( ((pos + 32) <= srclen) && ((((pos + 32) / 4) * 3) <= dstlen) ); pos += 32)
+   {  x  = _mm256_loadu_si256((const __m256i *)&src[pos]);
+
+      // map characters to values using the same rules as base64_map
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+      ok = m;
+      v  = _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('A')));
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), x));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('a' - 26))));
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('0' - 52))));
+      m  = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('+')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(62)));
+      m  = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('/')), _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_set1_epi8(63)));
+
+      // padding and invalid characters are handled by the scalar decoder
+      if (_mm256_movemask_epi8(ok) != -1)
+         break;
+
+      // pack 6 bit values into 12 and then 24 bit big-endian groups
+      v  = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+      v  = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+      v  = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+               2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+               2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+      _mm256_storeu_si256((__m256i *)out, v);
+      memcpy(&dst[((pos / 4) * 3)],      &out[0],  12);
+      memcpy(&dst[((pos / 4) * 3) + 12], &out[16], 12);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+ssize_t
+totp_base64_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      datlen;
+   size_t      pos;
+   unsigned    bits;
+   uint32_t    acc;
+   int8_t      val;
+
+   rad_assert(dst != NULL);
+   rad_assert( (src != NULL) || (srclen == 0) );
+
+   // decode complete blocks with vector instructions if supported by CPU
+   pos = 0;
+#ifdef RLM_TOTP_X86_SIMD
+   if (srclen >= 16)
+   {  if (__builtin_cpu_supports("avx2"))
+         pos = totp_base64_decode_avx2(dst, dstlen, src, srclen);
+      if (__builtin_cpu_supports("ssse3"))
+         pos += totp_base64_decode_ssse3(&dst[((pos / 4) * 3)], (dstlen - ((pos / 4) * 3)), &src[pos], (srclen - pos));
+   };
+#endif // RLM_TOTP_X86_SIMD
+
+   // validate and decode remaining characters in a single pass
+   datlen = (pos / 4) * 3;
+   acc    = 0;
+   bits   = 0;
+   for(; (pos < srclen); pos++)
+   {  if (src[pos] == '=')
+         break;
+      if ((val = base64_map[(uint8_t)src[pos]]) == -1)
+         return(RLM_TOTP_CODE_EBASE64);
+      acc   = (acc << 6) | (uint32_t)val;
+      bits += 6;
+      if (bits < 8)
+         continue;
+      bits -= 8;
+      if (datlen >= dstlen)
+         return(RLM_TOTP_CODE_EBUFSIZ);
+      dst[datlen++] = (uint8_t)(acc >> bits);
+   };
+
+   // verify correct use of padding
+   if (pos < srclen)
+   {  if ((pos % 4) < 2)
+         return(RLM_TOTP_CODE_EBASE64);
+      if ((pos + (4 - (pos % 4))) != srclen)
+         return(RLM_TOTP_CODE_EBASE64);
+      for(bits = pos; (bits < srclen); bits++)
+         if (src[bits] != '=')
+            return(RLM_TOTP_CODE_EBASE64);
+   };
+
+   // verify length of data without padding
+   if ((pos % 4) == 1)
+      return(RLM_TOTP_CODE_EBASE64);
+
+   return((ssize_t)datlen);
+}
+
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("ssse3")))
+size_t
+totp_base64_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m128i     x;
+   __m128i     v;
+   __m128i     m;
+   __m128i     ok;
+   uint8_t     out[16];
+
+   // each iteration decodes 16 characters into 12 bytes
+   for(pos = 0; ( ((pos + 16) <= srclen) && ((((pos + 16) / 4) * 3) <= dstlen) ); pos += 16)
+   {  x  = _mm_loadu_si128((const __m128i *)&src[pos]);
+
+      // map characters to values using the same rules as base64_map
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+      ok = m;
+      v  = _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('A')));
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('z' + 1)));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('a' - 26))));
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('0' - 52))));
+      m  = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('+')), _mm_cmpeq_epi8(x, _mm_set1_epi8('-')));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(62)));
+      m  = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('/')), _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_set1_epi8(63)));
+
+      // padding and invalid characters are handled by the scalar decoder
+      if (_mm_movemask_epi8(ok) != 0xFFFF)
+         break;
+
+      // pack 6 bit values into 12 and then 24 bit big-endian groups
+      v  = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+      v  = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+      v  = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+      _mm_storeu_si128((__m128i *)out, v);
+      memcpy(&dst[((pos / 4) * 3)], out, 12);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+//---------------//
+// hex functions //
+//---------------//
+// MARK: hex functions
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("avx2")))
+size_t
+totp_hex_decode_avx2(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m256i     x;
+   __m256i     v;
+   __m256i     m;
+   __m256i     ok;
+   uint8_t     out[32];
+
+   // each iteration decodes 32 characters into 16 bytes
+   for(pos = 0; ( ((pos + 32) <= srclen) && (((pos + 32) / 2) <= dstlen) ); pos += 32)
+   {  x  = _mm256_loadu_si256((const __m256i *)&src[pos]);
+
+      // map characters to values using the same rules as hex_map
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x));
+      ok = m;
+      v  = _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('0')));
+      x  = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+      m  = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), x));
+      ok = _mm256_or_si256(ok, m);
+      v  = _mm256_or_si256(v, _mm256_and_si256(m, _mm256_sub_epi8(x, _mm256_set1_epi8('a' - 10))));
+
+      // invalid characters are handled by the scalar decoder
+      if (_mm256_movemask_epi8(ok) != -1)
+         break;
+
+      // pack pairs of 4 bit values into bytes
+      v  = _mm256_maddubs_epi16(v, _mm256_set1_epi16(0x0110));
+      v  = _mm256_packus_epi16(v, v);
+      _mm256_storeu_si256((__m256i *)out, v);
+      memcpy(&dst[(pos / 2)],     &out[0],  8);
+      memcpy(&dst[(pos / 2) + 8], &out[16], 8);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+ssize_t
+totp_hex_decode_buff(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      datlen;
+   size_t      pos;
+   int8_t      hi;
+   int8_t      lo;
+
+   rad_assert(dst != NULL);
+   rad_assert( (src != NULL) || (srclen == 0) );
+
+   // each byte is encoded as two characters
+   if ((srclen % 2) != 0)
+      return(RLM_TOTP_CODE_EHEX);
+
+   // decode complete blocks with vector instructions if supported by CPU
+   pos = 0;
+#ifdef RLM_TOTP_X86_SIMD
+   if (srclen >= 16)
+   {  if (__builtin_cpu_supports("avx2"))
+         pos = totp_hex_decode_avx2(dst, dstlen, src, srclen);
+      if (__builtin_cpu_supports("ssse3"))
+         pos += totp_hex_decode_ssse3(&dst[(pos / 2)], (dstlen - (pos / 2)), &src[pos], (srclen - pos));
+   };
+#endif // RLM_TOTP_X86_SIMD
+
+   // validate and decode remaining characters in a single pass
+   datlen = pos / 2;
+   for(; (pos < srclen); pos += 2)
+   {  if ( ((hi = hex_map[(uint8_t)src[pos]]) == -1) || ((lo = hex_map[(uint8_t)src[pos+1]]) == -1) )
+         return(RLM_TOTP_CODE_EHEX);
+      if (datlen >= dstlen)
+         return(RLM_TOTP_CODE_EBUFSIZ);
+      dst[datlen++] = (uint8_t)((hi << 4) | lo);
+   };
+
+   return((ssize_t)datlen);
+}
+
+
+#ifdef RLM_TOTP_X86_SIMD
+__attribute__((target("ssse3")))
+size_t
+totp_hex_decode_ssse3(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src,
+         size_t                        srclen )
+{
+   size_t      pos;
+   __m128i     x;
+   __m128i     v;
+   __m128i     m;
+   __m128i     ok;
+   uint8_t     out[16];
+
+   // each iteration decodes 16 characters into 8 bytes
+   for(pos = 0; ( ((pos + 16) <= srclen) && (((pos + 16) / 2) <= dstlen) ); pos += 16)
+   {  x  = _mm_loadu_si128((const __m128i *)&src[pos]);
+
+      // map characters to values using the same rules as hex_map
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('9' + 1)));
+      ok = m;
+      v  = _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('0')));
+      x  = _mm_or_si128(x, _mm_set1_epi8(0x20));
+      m  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('f' + 1)));
+      ok = _mm_or_si128(ok, m);
+      v  = _mm_or_si128(v, _mm_and_si128(m, _mm_sub_epi8(x, _mm_set1_epi8('a' - 10))));
+
+      // invalid characters are handled by the scalar decoder
+      if (_mm_movemask_epi8(ok) != 0xFFFF)
+         break;
+
+      // pack pairs of 4 bit values into bytes
+      v  = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0110));
+      v  = _mm_packus_epi16(v, v);
+      _mm_storeu_si128((__m128i *)out, v);
+      memcpy(&dst[(pos / 2)], out, 8);
+   };
+
+   return(pos);
+}
+#endif // RLM_TOTP_X86_SIMD
+
+
+//-----------------//
+// cache functions //
+//-----------------//
+// MARK: cache functions
+
+totp_cache_t *
+totp_cache_alloc(
+         void *                        instance,
+         const char *                  name )
+{
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+
+   rad_assert(instance  != NULL);
+   rad_assert(name      != NULL);
+
+   inst = instance;
+
+   if ((cache = talloc_zero(NULL, totp_cache_t)) == NULL)
+      return(NULL);
+   if ((cache->name = talloc_strdup(cache, name)) == NULL)
+   {  talloc_free(cache);
+      return(NULL);
+   };
+
+   // initialize cache and list
+   if ((cache->tree = rbtree_create(cache, totp_cache_entry_cmp, totp_cache_entry_free, 0)) == NULL)
+   {  talloc_free(cache);
+      return(NULL);
+   };
+   if ((cache->list = talloc_zero(cache, totp_cache_entry_t)) == NULL)
+   {  totp_cache_free(cache);
+      return(NULL);
+   };
+   cache->list->prev = cache->list;
+   cache->list->next = cache->list;
+
+   // initialize cache filter with a power of two number of counters
+   if ((inst->cache_filter_size))
+   {  cache->filter_mask = 1;
+      while (cache->filter_mask < inst->cache_filter_size)
+         cache->filter_mask <<= 1;
+      if ((cache->filter = talloc_zero_array(cache, uint8_t, cache->filter_mask)) == NULL)
+      {  totp_cache_free(cache);
+         return(NULL);
+      };
+      cache->filter_size  = cache->filter_mask;
+      cache->filter_mask -= 1;
+   };
+
+   // initialize failure sketch
+   if ((inst->sketch_width))
+   {  if ((cache->sketch = talloc_zero_array(cache, uint16_t, (inst->sketch_width * inst->sketch_depth))) == NULL)
+      {  totp_cache_free(cache);
+         return(NULL);
+      };
+      cache->sketch_width = inst->sketch_width;
+      cache->sketch_depth = inst->sketch_depth;
+      cache->sketch_x     = inst->totp_x;
+   };
+
+#ifdef HAVE_PTHREAD_H
+   if ((cache->mutex = talloc_zero(cache, pthread_mutex_t)) == NULL)
+   {  totp_cache_free(cache);
+      return(NULL);
+   };
+   pthread_mutex_init(cache->mutex, NULL);
+#endif // HAVE_PTHREAD_H
+
+   return(cache);
+}
+
+
+int
+totp_cache_attach(
+         void *                        instance )
+{
+   time_t                  retain;
+   uint32_t                filter_size;
+   const char *            name;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+   name = ((inst->cache_name)) ? inst->cache_name : inst->name;
+
+   // filter size is rounded up to a power of two when allocated
+   filter_size = ((inst->cache_filter_size)) ? 1 : 0;
+   while ( ((filter_size)) && (filter_size < inst->cache_filter_size) )
+      filter_size <<= 1;
+
+   // entries are retained until the widest window of any instance has passed
+   retain  = (time_t)inst->totp_time_drift;
+   retain += (time_t)(inst->try_prev * inst->totp_x);
+
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_lock(&totp_caches_mutex);
+#endif // HAVE_PTHREAD_H
+
+   // search for existing cache with same name
+   for(cache = totp_caches; ((cache)); cache = cache->next)
+      if (!(strcmp(cache->name, name)))
+         break;
+
+   // allocate new cache if one does not already exist
+   if (cache == NULL)
+   {  if ((cache = totp_cache_alloc(instance, name)) == NULL)
+      {
+#ifdef HAVE_PTHREAD_H
+         pthread_mutex_unlock(&totp_caches_mutex);
+#endif // HAVE_PTHREAD_H
+         ERROR("totp_code: failed to allocate memory for cache '%s'", name);
+         return(-1);
+      };
+      cache->next = totp_caches;
+      totp_caches = cache;
+   } else
+   {  if (cache->filter_size != filter_size)
+         WARN("totp_code: %s: cache '%s' is shared, ignoring cache_filter_size", inst->name, name);
+      if ( (cache->sketch_width != inst->sketch_width) || ( ((cache->sketch_width)) && (cache->sketch_depth != inst->sketch_depth) ) )
+         WARN("totp_code: %s: cache '%s' is shared, ignoring failure_sketch_width and failure_sketch_depth", inst->name, name);
+   };
+
+   pthread_mutex_lock(cache->mutex);
+   if (retain > cache->retain)
+      cache->retain = retain;
+   cache->refs++;
+   inst->cache_retain   = retain;
+   inst->cache_next     = cache->instances;
+   cache->instances     = inst;
+   pthread_mutex_unlock(cache->mutex);
+
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_unlock(&totp_caches_mutex);
+#endif // HAVE_PTHREAD_H
+
+   inst->cache = cache;
+
+   return(0);
+}
+
+
+void
+totp_cache_cleanup(
+         void *                        instance,
+         totp_params_t *               params )
+{
+   time_t                  time_cleanup;
+   uint64_t                count;
+   uint64_t                step;
+   int64_t                 usec;
+   struct timeval          start;
+   struct timeval          end;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_cache_entry_t *    root;
+   totp_cache_entry_t *    entry;
+
+   rad_assert(instance != NULL);
+
+   inst           = instance;
+   cache          = inst->cache;
+
+   if (!(cache))
+      return;
+   root           = cache->list;
+
+   // retain entries for the largest window of the instances sharing cache
+   time_cleanup   = (time_t)(params->totp_time + params->totp_time_offset);
+   time_cleanup  -= cache->retain;
+
+   // list is ordered by last update, stop at first entry which is still live
+   count = 0;
+   while ((entry = root->next) != root)
+   {  if (entry->invalid_until > time_cleanup)
+         break;
+      if (entry->failed_expires > time_cleanup)
+         break;
+      if (entry->used_expires > time_cleanup)
+         break;
+      if (!(count++))
+         gettimeofday(&start, NULL);
+      totp_cache_filter_del(cache, entry);
+      rbtree_deletebydata(cache->tree, entry);
+   };
+
+   // only batches which removed entries are timed
+   if ((count))
+   {  gettimeofday(&end, NULL);
+      usec  = ((int64_t)end.tv_sec * 1000000) + end.tv_usec;
+      usec -= ((int64_t)start.tv_sec * 1000000) + start.tv_usec;
+      usec  = (usec < 0) ? 0 : usec;
+      totp_stats_add(cache, cleanups,     1);
+      totp_stats_add(cache, expiries,     count);
+      totp_stats_add(cache, cleanup_usec, usec);
+      totp_stats_max(cache, cleanup_max,      count);
+      totp_stats_max(cache, cleanup_usec_max, usec);
+   };
+
+   // recount saturated cache filter from remaining entries at most once per
+   // time step, saturated counters only cost false hits until then
+   step = (params->totp_time + params->totp_time_offset) / inst->totp_x;
+   if ( ((count)) && ((cache->filter_rebuild)) && (cache->filter_step != step) )
+   {  cache->filter_step = step;
+      totp_cache_filter_rebuild(cache);
+   };
+
+   return;
+}
+
+
+int
+totp_cache_consume(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         const uint64_t *              counters,
+         size_t                        counters_len )
+{
+   int                     rc;
+   int                     match;
+   int                     action;
+   size_t                  idx;
+   uint32_t                sketch_count;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_cache_entry_t      cache_key;
+   totp_cache_entry_t *    entry;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(params   != NULL);
+   rad_assert( (counters != NULL) || (counters_len == 0) );
+
+   inst  = instance;
+   cache = inst->cache;
+   match = -1;
+
+   // without reuse or attempt tracking, first matching code is allowed
+   if ( ((inst->allow_reuse)) && (!(inst->max_attempts)) )
+      return( (counters_len > 0) ? 0 : -1 );
+
+   if (!(cache))
+      return(-1);
+
+   // configure cache key
+   rc = totp_cache_entry_key(instance, request, params, &cache_key);
+   if (rc == -1)
+      return(-1);
+
+   // definite misses which will not be cached do not require the lock
+   if (totp_cache_filter_test(cache, &cache_key) == 0)
+   {  totp_stats_add(cache, filtered, 1);
+      match = (counters_len > 0) ? 0 : -1;
+      if ( (match == 0) && ((inst->allow_reuse)) )
+         return(match);
+      if ( (match == -1) && (!(inst->max_attempts)) )
+         return(match);
+      match = -1;
+   };
+
+   totp_cache_lock(instance, RLM_TOTP_LOCK_CONSUME);
+
+   // clean up stale entries from cache
+   totp_cache_cleanup(instance, params);
+
+   // find first candidate which has not been used or locked out
+   if ((entry = totp_cache_entry_find(cache, &cache_key)) != NULL)
+      totp_cache_entry_rebucket(entry, params);
+   for(idx = 0; ( (idx < counters_len) && (match == -1) ); idx++)
+   {  if (entry == NULL)
+         match = (int)idx;
+      else if (counters[idx] < ((uint64_t)entry->invalid_until / params->totp_x))
+         continue;
+      else if (!(totp_cache_entry_used(entry->used_step, entry->used_map, counters[idx])))
+         match = (int)idx;
+   };
+
+   // exit if nothing will be cached
+   action = (match == -1) ? RLM_TOTP_CACHE_FAILED : RLM_TOTP_CACHE_EXPIRED;
+   if ( (action == RLM_TOTP_CACHE_EXPIRED) && ((inst->allow_reuse)) )
+   {  totp_cache_unlock(instance, RLM_TOTP_LOCK_CONSUME);
+      return(match);
+   };
+   if ( (action == RLM_TOTP_CACHE_FAILED) && (!(inst->max_attempts)) )
+   {  totp_cache_unlock(instance, RLM_TOTP_LOCK_CONSUME);
+      return(match);
+   };
+
+   // count failures of uncached identities in sketch until threshold is reached
+   sketch_count = 0;
+   if ( (entry == NULL) && (action == RLM_TOTP_CACHE_FAILED) && ((cache->sketch)) )
+   {  if ((sketch_count = totp_cache_sketch_add(cache, params, &cache_key)) < inst->sketch_threshold)
+      {  totp_cache_unlock(instance, RLM_TOTP_LOCK_CONSUME);
+         return(match);
+      };
+   };
+
+   // mark matched code as used or record failed attempt
+   if ((entry = totp_cache_entry_touch(instance, entry, &cache_key)) == NULL)
+   {  REDEBUG2("unable to allocate memory for totp_cache_entry_t");
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_CONSUME);
+      return(match);
+   };
+   totp_cache_entry_record(instance, entry, params, action, ((match == -1) ? 0 : counters[match]));
+   if ((sketch_count = totp_cache_sketch_seed(instance, sketch_count)) > entry->failed_count)
+      entry->failed_count = sketch_count;
+
+   totp_cache_unlock(instance, RLM_TOTP_LOCK_CONSUME);
+
+   return(match);
+}
+
+
+void
+totp_cache_detach(
+         void *                        instance )
+{
+   rlm_totp_code_t *       inst;
+   rlm_totp_code_t *       peer;
+   rlm_totp_code_t **      instp;
+   totp_cache_t *          cache;
+   totp_cache_t **         nextp;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   if ((cache = inst->cache) == NULL)
+      return;
+   inst->cache = NULL;
+
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_lock(&totp_caches_mutex);
+#endif // HAVE_PTHREAD_H
+
+   // retain entries for the largest window of the instances still using cache
+   pthread_mutex_lock(cache->mutex);
+   for(instp = &cache->instances; ((*instp)); instp = &(*instp)->cache_next)
+   {  if (*instp == inst)
+      {  *instp = inst->cache_next;
+         break;
+      };
+   };
+   inst->cache_next  = NULL;
+   cache->retain     = 0;
+   for(peer = cache->instances; ((peer)); peer = peer->cache_next)
+      if (peer->cache_retain > cache->retain)
+         cache->retain = peer->cache_retain;
+   pthread_mutex_unlock(cache->mutex);
+
+   // free cache once last instance has detached
+   if ((--cache->refs) == 0)
+   {  for(nextp = &totp_caches; ((*nextp)); nextp = &(*nextp)->next)
+      {  if (*nextp == cache)
+         {  *nextp = cache->next;
+            break;
+         };
+      };
+      totp_cache_free(cache);
+   };
+
+#ifdef HAVE_PTHREAD_H
+   pthread_mutex_unlock(&totp_caches_mutex);
+#endif // HAVE_PTHREAD_H
+
+   return;
+}
+
+
+totp_cache_entry_t *
+totp_cache_entry_alloc(
+         void *                        ctx,
+         const uint8_t *               key,
+         size_t                        key_len,
+         time_t                        expires )
+{
+   totp_cache_entry_t *    entry;
+
+   rad_assert(key != NULL);
+   rad_assert(key_len > 0);
+
+   if ((entry = talloc_size(ctx, sizeof(totp_cache_entry_t))) == NULL)
+      return(NULL);
+   memset(entry, 0, sizeof(totp_cache_entry_t));
+
+   if ((entry->key = talloc_size(entry, (key_len+1))) == NULL)
+   {  talloc_free(entry);
+      return(NULL);
+   };
+   memcpy(entry->key, key, key_len);
+
+   entry->key[key_len]  = '\0';
+   entry->keylen        = key_len;
+   entry->invalid_until = expires;
+
+   return(entry);
+}
+
+
+int
+totp_cache_entry_cmp(
+         const void *                  ptr_a,
+         const void *                  ptr_b )
+{
+   int                        rc;
+   size_t                     keylen;
+   const totp_cache_entry_t * entry_a;
+   const totp_cache_entry_t * entry_b;
+
+   entry_a  = (const totp_cache_entry_t *)ptr_a;
+   entry_b  = (const totp_cache_entry_t *)ptr_b;
+   keylen   = (entry_a->keylen < entry_b->keylen)
+            ?  entry_a->keylen
+            :  entry_b->keylen;
+
+   if ((rc = memcmp(entry_a->key, entry_b->key, keylen)) != 0)
+      return(rc);
+   if (entry_a->keylen == entry_b->keylen)
+      return(0);
+   return( (entry_a->keylen < entry_b->keylen) ? -1 : 1 );
+}
+
+
+totp_cache_entry_t *
+totp_cache_entry_find(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          cache_key )
+{
+   totp_cache_entry_t *    entry;
+
+   rad_assert(cache     != NULL);
+   rad_assert(cache_key != NULL);
+
+   entry = rbtree_finddata(cache->tree, cache_key);
+
+   totp_stats_add(cache, lookups, 1);
+   if (entry == NULL)
+      totp_stats_add(cache, misses, 1);
+   else
+      totp_stats_add(cache, hits, 1);
+
+   return(entry);
+}
+
+
+void
+totp_cache_entry_free(
+         void *                        ptr )
+{
+   totp_cache_entry_t *        entry;
+
+   if (!(ptr))
+      return;
+   entry = ptr;
+
+   // removes from linked list
+   totp_cache_entry_unlink(entry);
+
+   talloc_free(entry);
+
+   return;
+}
+
+
+int
+totp_cache_entry_key(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_cache_entry_t *          cache_key )
+{
+   rlm_totp_code_t *       inst;
+   VALUE_PAIR *            vp;
+
+   rad_assert(instance != NULL);
+   rad_assert(params   != NULL);
+
+   inst = instance;
+
+   if ((vp = totp_request_vp_by_idx(params, RLM_TOTP_VP_CACHE_ID)) == NULL)
+   {  REDEBUG("%s is not set, unable to determine TOTP cache key", inst->vsa_cache_id_name);
+      return(-1);
+   };
+
+   // check value-pair used as cache key
+   if (vp->length < 1)
+   {  REDEBUG("value of %s is empty, unable to determine TOTP cache key", inst->vsa_cache_id_name);
+      return(-1);
+   };
+
+   // configure cache key which references value-pair
+   memset(cache_key, 0, sizeof(totp_cache_entry_t));
+   cache_key->key    = (uint8_t *)vp->data.octets;
+   cache_key->keylen = vp->length;
+   cache_key->hash   = fr_hash(cache_key->key, cache_key->keylen);
+
+   return(0);
+}
+
+
+void
+totp_cache_entry_rebucket(
+         totp_cache_entry_t *          entry,
+         totp_params_t *               params )
+{
+   unsigned                bit;
+   uint64_t                step;
+   uint64_t                map;
+   uint64_t                first;
+   uint64_t                last;
+   uint64_t                start;
+   uint64_t                end;
+
+   rad_assert(entry  != NULL);
+   rad_assert(params != NULL);
+
+   if ( (entry->used_x == params->totp_x) && (entry->used_t0 == params->totp_t0) )
+      return;
+
+   // entries without used codes only need to adopt the new time step
+   if ( (!(entry->used_map)) || (!(entry->used_x)) )
+   {  entry->used_x     = params->totp_x;
+      entry->used_t0    = params->totp_t0;
+      entry->used_map   = 0;
+      return;
+   };
+
+   // most recently used code maps to the new step containing its last second
+   end  = entry->used_t0 + ((entry->used_step + 1) * entry->used_x) - 1;
+   step = (end < params->totp_t0) ? 0 : ((end - params->totp_t0) / params->totp_x);
+   map  = 0;
+
+   // mark every new step which overlaps a used old step as used
+   for(bit = 0; ( (bit < 64) && (bit <= entry->used_step) ); bit++)
+   {  if (!((entry->used_map >> bit) & 0x01))
+         continue;
+      start = entry->used_t0 + ((entry->used_step - bit) * entry->used_x);
+      end   = start + entry->used_x - 1;
+      if (end < params->totp_t0)
+         continue;
+      first = (start < params->totp_t0) ? 0 : ((start - params->totp_t0) / params->totp_x);
+      last  = (end - params->totp_t0) / params->totp_x;
+      if ((step - first) >= 64)
+         first = step - 63;
+      for(; (first <= last); first++)
+         map |= ((uint64_t)1) << (step - first);
+   };
+
+   entry->used_step  = step;
+   entry->used_map   = map;
+   entry->used_x     = params->totp_x;
+   entry->used_t0    = params->totp_t0;
+
+   return;
+}
+
+
+void
+totp_cache_entry_record(
+         void *                        instance,
+         totp_cache_entry_t *          entry,
+         totp_params_t *               params,
+         int                           action,
+         uint64_t                      counter )
+{
+   rlm_totp_code_t *       inst;
+   uint64_t                timestamp;
+   uint64_t                shift;
+
+   rad_assert(instance  != NULL);
+   rad_assert(entry     != NULL);
+   rad_assert(params    != NULL);
+
+   inst = instance;
+
+   switch(action)
+   {  case RLM_TOTP_CACHE_EXPIRED:
+         // convert bitmap if time step has changed since codes were recorded
+         totp_cache_entry_rebucket(entry, params);
+
+         // slide bitmap forward when code is newer than most recently used code
+         if (!(entry->used_map))
+         {  entry->used_step     = counter;
+            entry->used_map      = 0;
+         }
+         else if (counter > entry->used_step)
+         {  shift                 = counter - entry->used_step;
+            entry->used_step      = counter;
+            entry->used_map       = (shift < 64) ? (entry->used_map << shift) : 0;
+         };
+         if ((entry->used_step - counter) < 64)
+            entry->used_map |= ((uint64_t)1) << (entry->used_step - counter);
+         entry->used_expires      = (time_t)(((entry->used_step + 1) * params->totp_x) + params->totp_t0);
+         break;
+
+      case RLM_TOTP_CACHE_FAILED:
+         if (entry->failed_expires < (time_t)(params->totp_time + params->totp_time_offset))
+            entry->failed_count = 0;
+         timestamp                = params->totp_time;
+         timestamp               -= params->totp_t0;
+         timestamp               += params->totp_time_offset;
+         timestamp               += inst->totp_time_drift;
+         timestamp               += inst->try_next * params->totp_x;
+         entry->failed_expires    = timestamp;
+         entry->failed_expires   += params->totp_x;
+         entry->failed_expires   -= timestamp % params->totp_x;
+         entry->failed_expires   += params->totp_t0;
+         entry->failed_count++;
+         if ( (entry->failed_count >= inst->max_attempts) && (entry->invalid_until != entry->failed_expires) )
+         {  entry->invalid_until = entry->failed_expires;
+            totp_stats_add(inst->cache, lockouts, 1);
+         };
+         break;
+
+      default:
+         break;
+   };
+
+   return;
+}
+
+
+totp_cache_entry_t *
+totp_cache_entry_touch(
+         void *                        instance,
+         totp_cache_entry_t *          entry,
+         totp_cache_entry_t *          cache_key )
+{
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_cache_entry_t *    root;
+
+   rad_assert(instance  != NULL);
+   rad_assert(cache_key != NULL);
+
+   inst  = instance;
+   cache = inst->cache;
+   root  = cache->list;
+
+   // add new entry to cache if does not already exist
+   if (entry == NULL)
+   {  if ((entry = totp_cache_entry_alloc(cache, cache_key->key, cache_key->keylen, 0)) == NULL)
+         return(NULL);
+      entry->hash = cache_key->hash;
+      totp_cache_filter_add(cache, entry);
+      rbtree_insert(cache->tree, entry);
+      totp_stats_add(cache, inserts, 1);
+   };
+
+   // move entry to tail of linked list
+   totp_cache_entry_unlink(entry);
+   entry->prev       = root->prev;
+   entry->next       = root;
+   root->prev->next  = entry;
+   root->prev        = entry;
+
+   return(entry);
+}
+
+
+void
+totp_cache_entry_unlink(
+         totp_cache_entry_t *          entry )
+{
+   if (entry->prev != NULL)
+      entry->prev->next = entry->next;
+   if (entry->next != NULL)
+      entry->next->prev = entry->prev;
+   entry->prev = NULL;
+   entry->next = NULL;
+
+   return;
+}
+
+
+int
+totp_cache_entry_used(
+         uint64_t                      used_step,
+         uint64_t                      used_map,
+         uint64_t                      counter )
+{
+   if (!(used_map))
+      return(0);
+   if (counter > used_step)
+      return(0);
+
+   // codes older than the bitmap are treated as used
+   if ((used_step - counter) >= 64)
+      return(1);
+
+   return( ((used_map >> (used_step - counter)) & 0x01) ? 1 : 0 );
+}
+
+
+void
+totp_cache_filter_add(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          entry )
+{
+   unsigned                idx;
+   uint8_t                 count;
+   uint32_t                probe;
+   uint32_t                stride;
+
+   rad_assert(cache     != NULL);
+   rad_assert(entry     != NULL);
+
+   if (!(cache->filter))
+      return;
+
+   // writers hold the cache lock, readers only require atomic loads
+   probe  = entry->hash;
+   stride = ((entry->hash >> 16) | (entry->hash << 16)) | 1;
+   for(idx = 0; (idx < RLM_TOTP_FILTER_PROBES); idx++, probe += stride)
+   {  count = __atomic_load_n(&cache->filter[probe & cache->filter_mask], __ATOMIC_RELAXED);
+      if (count == UINT8_MAX)
+      {  cache->filter_rebuild = true;
+         continue;
+      };
+      __atomic_store_n(&cache->filter[probe & cache->filter_mask], (count + 1), __ATOMIC_RELEASE);
+   };
+
+   return;
+}
+
+
+void
+totp_cache_filter_del(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          entry )
+{
+   unsigned                idx;
+   uint8_t                 count;
+   uint32_t                probe;
+   uint32_t                stride;
+
+   rad_assert(cache     != NULL);
+   rad_assert(entry     != NULL);
+
+   if (!(cache->filter))
+      return;
+
+   // saturated counters are left alone until the filter is rebuilt
+   probe  = entry->hash;
+   stride = ((entry->hash >> 16) | (entry->hash << 16)) | 1;
+   for(idx = 0; (idx < RLM_TOTP_FILTER_PROBES); idx++, probe += stride)
+   {  count = __atomic_load_n(&cache->filter[probe & cache->filter_mask], __ATOMIC_RELAXED);
+      if ( (count == UINT8_MAX) || (count == 0) )
+         continue;
+      __atomic_store_n(&cache->filter[probe & cache->filter_mask], (count - 1), __ATOMIC_RELEASE);
+   };
+
+   return;
+}
+
+
+void
+totp_cache_filter_rebuild(
+         totp_cache_t *                cache )
+{
+   unsigned                idx;
+   uint32_t                pos;
+   uint32_t                probe;
+   uint32_t                stride;
+   uint8_t *               counts;
+   totp_cache_entry_t *    entry;
+
+   rad_assert(cache != NULL);
+
+   if (!(cache->filter))
+      return;
+   if ((counts = talloc_zero_array(cache, uint8_t, (cache->filter_mask + 1))) == NULL)
+      return;
+
+   // recount live entries, every entry in tree is also in list
+   for(entry = cache->list->next; (entry != cache->list); entry = entry->next)
+   {  probe  = entry->hash;
+      stride = ((entry->hash >> 16) | (entry->hash << 16)) | 1;
+      for(idx = 0; (idx < RLM_TOTP_FILTER_PROBES); idx++, probe += stride)
+         if (counts[probe & cache->filter_mask] < UINT8_MAX)
+            counts[probe & cache->filter_mask]++;
+   };
+
+   // counters only move down to exact values, readers never see false misses
+   cache->filter_rebuild = false;
+   for(pos = 0; (pos <= cache->filter_mask); pos++)
+   {  __atomic_store_n(&cache->filter[pos], counts[pos], __ATOMIC_RELEASE);
+      if (counts[pos] == UINT8_MAX)
+         cache->filter_rebuild = true;
+   };
+
+   talloc_free(counts);
+
+   return;
+}
+
+
+int
+totp_cache_filter_test(
+         totp_cache_t *                cache,
+         totp_cache_entry_t *          cache_key )
+{
+   unsigned                idx;
+   uint32_t                probe;
+   uint32_t                stride;
+
+   rad_assert(cache     != NULL);
+   rad_assert(cache_key != NULL);
+
+   if (!(cache->filter))
+      return(1);
+
+   // returns 0 if key is definitely not cached
+   probe  = cache_key->hash;
+   stride = ((cache_key->hash >> 16) | (cache_key->hash << 16)) | 1;
+   for(idx = 0; (idx < RLM_TOTP_FILTER_PROBES); idx++, probe += stride)
+      if (__atomic_load_n(&cache->filter[probe & cache->filter_mask], __ATOMIC_ACQUIRE) == 0)
+         return(0);
+
+   return(1);
+}
+
+
+void
+totp_cache_free(
+         totp_cache_t *                cache )
+{
+   rad_assert(cache != NULL);
+
+   if ((cache->tree))
+      rbtree_free(cache->tree);
+   cache->tree = NULL;
+
+#ifdef HAVE_PTHREAD_H
+   if ((cache->mutex))
+      pthread_mutex_destroy(cache->mutex);
+   cache->mutex = NULL;
+#endif // HAVE_PTHREAD_H
+
+   talloc_free(cache);
+
+   return;
+}
+
+
+void
+totp_cache_lock(
+         void *                        instance,
+         int                           site )
+{
+   uint64_t                start;
+   uint64_t                nsec;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_lock_stats_t *     stats;
+
+   rad_assert(instance != NULL);
+   rad_assert( (site >= 0) && (site < RLM_TOTP_LOCK_SITES) );
+
+   inst  = instance;
+   cache = inst->cache;
+
+   if (!(inst->lock_stats))
+   {  pthread_mutex_lock(cache->mutex);
+      return;
+   };
+
+   stats = &cache->locks[site];
+
+#ifdef HAVE_PTHREAD_H
+   // uncontended locks are not timed while waiting
+   if (pthread_mutex_trylock(cache->mutex) != 0)
+   {  start = totp_stats_nsec();
+      pthread_mutex_lock(cache->mutex);
+      nsec  = totp_stats_nsec();
+      cache->locked_nsec = nsec;
+      nsec -= start;
+      __atomic_fetch_add(&stats->contended, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&stats->wait_nsec, nsec, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&stats->wait_hist[totp_stats_bucket(nsec)], 1, __ATOMIC_RELAXED);
+   } else
+   {  cache->locked_nsec = totp_stats_nsec();
+   };
+#else
+   pthread_mutex_lock(cache->mutex);
+   cache->locked_nsec = totp_stats_nsec();
+#endif // HAVE_PTHREAD_H
+
+   __atomic_fetch_add(&stats->acquired, 1, __ATOMIC_RELAXED);
+
+   return;
+}
+
+
+int
+totp_cache_query(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_cache_entry_t *          res )
+{
+   int                     rc;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_cache_entry_t      cache_key;
+   totp_cache_entry_t *    entry;
+
+   rad_assert(instance        != NULL);
+   rad_assert(request         != NULL);
+   rad_assert(res             != NULL);
+
+   inst  = instance;
+   cache = inst->cache;
+   memset(res, 0, sizeof(totp_cache_entry_t));
+
+   if (!(cache))
+      return(-1);
+
+   // configure cache key
+   rc = totp_cache_entry_key(instance, request, params, &cache_key);
+   if (rc == -1)
+      return(-1);
+
+   // definite misses do not require the lock
+   if (totp_cache_filter_test(cache, &cache_key) == 0)
+   {  totp_stats_add(cache, filtered, 1);
+      return(-1);
+   };
+
+   totp_cache_lock(instance, RLM_TOTP_LOCK_QUERY);
+
+   // clean up stale entries from cache
+   if ((params))
+      totp_cache_cleanup(instance, params);
+
+   // lookup cache entry
+   entry = totp_cache_entry_find(cache, &cache_key);
+   if (entry != NULL)
+   {  memcpy(res, entry, sizeof(totp_cache_entry_t));
+      res->next = NULL;
+      res->prev = NULL;
+      if ((params))
+         totp_cache_entry_rebucket(res, params);
+   };
+
+   totp_cache_unlock(instance, RLM_TOTP_LOCK_QUERY);
+
+   return( (entry == NULL) ? -1 : 0 );
+}
+
+
+uint32_t
+totp_cache_sketch_add(
+         totp_cache_t *                cache,
+         totp_params_t *               params,
+         totp_cache_entry_t *          cache_key )
+{
+   unsigned                row;
+   uint32_t                count;
+   uint32_t                hash;
+   uint64_t                step;
+   uint16_t *              counter;
+
+   rad_assert(cache     != NULL);
+   rad_assert(params    != NULL);
+   rad_assert(cache_key != NULL);
+
+   if (!(cache->sketch))
+      return(0);
+
+   // rotate sketch at time step boundaries
+   step = (params->totp_time + params->totp_time_offset) / cache->sketch_x;
+   if (step != cache->sketch_step)
+   {  memset(cache->sketch, 0, (sizeof(uint16_t) * cache->sketch_width * cache->sketch_depth));
+      cache->sketch_step = step;
+   };
+
+   // increment one counter per row and return smallest count, each row
+   // hashes the key with its own seed so collisions are not shared by rows
+   count  = UINT16_MAX;
+   for(row = 0; (row < cache->sketch_depth); row++)
+   {  hash    = fr_hash_update(cache_key->key, cache_key->keylen, fr_hash(&row, sizeof(row)));
+      counter = &cache->sketch[(row * cache->sketch_width) + (hash % cache->sketch_width)];
+      if (*counter < UINT16_MAX)
+         (*counter)++;
+      if (*counter < count)
+         count = *counter;
+   };
+
+   return(count);
+}
+
+
+// sketch only overestimates, so a new entry starts at no more than the
+// threshold and is only locked out by failures recorded against the entry
+uint32_t
+totp_cache_sketch_seed(
+         void *                        instance,
+         uint32_t                      sketch_count )
+{
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+
+   inst = instance;
+
+   if (sketch_count > inst->sketch_threshold)
+      sketch_count = inst->sketch_threshold;
+   if ( ((inst->max_attempts)) && (sketch_count >= inst->max_attempts) )
+      sketch_count = inst->max_attempts - 1;
+
+   return(sketch_count);
+}
+
+
+void
+totp_cache_unlock(
+         void *                        instance,
+         int                           site )
+{
+   uint64_t                nsec;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_lock_stats_t *     stats;
+
+   rad_assert(instance != NULL);
+   rad_assert( (site >= 0) && (site < RLM_TOTP_LOCK_SITES) );
+
+   inst  = instance;
+   cache = inst->cache;
+
+   if (!(inst->lock_stats))
+   {  pthread_mutex_unlock(cache->mutex);
+      return;
+   };
+
+   stats = &cache->locks[site];
+   nsec  = totp_stats_nsec() - cache->locked_nsec;
+
+   pthread_mutex_unlock(cache->mutex);
+
+   __atomic_fetch_add(&stats->hold_nsec, nsec, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&stats->hold_hist[totp_stats_bucket(nsec)], 1, __ATOMIC_RELAXED);
+
+   return;
+}
+
+
+int
+totp_cache_update(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         int                           action )
+{
+   int                     rc;
+   uint32_t                sketch_count;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_cache_entry_t      cache_key;
+   totp_cache_entry_t *    result;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(params   != NULL);
+
+   inst  = instance;
+   cache = inst->cache;
+
+   if (!(cache))
+      return(-1);
+
+   // exit if nothing will be cached
+   switch(action)
+   {  case RLM_TOTP_CACHE_EXPIRED:
+         if ((inst->allow_reuse))
+            return(0);
+         break;
+
+      case RLM_TOTP_CACHE_FAILED:
+         if (!(inst->max_attempts))
+            return(0);
+         break;
+
+      default:
+         return(0);
+   };
+
+   // configure cache key
+   rc = totp_cache_entry_key(instance, request, params, &cache_key);
+   if (rc == -1)
+      return(-1);
+
+   totp_cache_lock(instance, RLM_TOTP_LOCK_UPDATE);
+
+   // clean up stale entries from cache
+   totp_cache_cleanup(instance, params);
+
+   // retrieve existing entry
+   result = totp_cache_entry_find(cache, &cache_key);
+
+   // count failures of uncached identities in sketch until threshold is reached
+   sketch_count = 0;
+   if ( (result == NULL) && (action == RLM_TOTP_CACHE_FAILED) && ((cache->sketch)) )
+   {  if ((sketch_count = totp_cache_sketch_add(cache, params, &cache_key)) < inst->sketch_threshold)
+      {  totp_cache_unlock(instance, RLM_TOTP_LOCK_UPDATE);
+         return(0);
+      };
+   };
+
+   // add new entry to cache if does not already exist
+   if ((result = totp_cache_entry_touch(instance, result, &cache_key)) == NULL)
+   {  REDEBUG2("unable to allocate memory for totp_cache_entry_t");
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_UPDATE);
+      return(-1);
+   };
+
+   // update entry
+   totp_cache_entry_record(instance, result, params, action, totp_algo_counter(params));
+   if ((sketch_count = totp_cache_sketch_seed(instance, sketch_count)) > result->failed_count)
+      result->failed_count = sketch_count;
+
+   totp_cache_unlock(instance, RLM_TOTP_LOCK_UPDATE);
+
+   return(0);
+}
+
+
+//----------------//
+// chap functions //
+//----------------//
+// MARK: chap functions
+
+// returns 0 for CHAP requests, 1 if not CHAP, and -1 if invalid
+int
+totp_chap_init(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_chap_t *                 chap )
+{
+   rlm_totp_code_t *       inst;
+   VALUE_PAIR *            chap_vp;
+   VALUE_PAIR *            chal_vp;
+   VALUE_PAIR *            pass_vp;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(params   != NULL);
+   rad_assert(chap     != NULL);
+
+   inst = instance;
+
+   if (!(inst->allow_chap))
+      return(1);
+
+   if ((chap_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_CHAP_PASSWORD]) == NULL)
+      return(1);
+   if (chap_vp->length != 17)
+   {  REDEBUG("CHAP-Password has invalid length");
+      return(-1);
+   };
+
+   // static password entered before TOTP code
+   if ((pass_vp = params->vps[TOTP_SCOPE_CONTROL][RLM_TOTP_VP_CLEARTEXT]) == NULL)
+   {  RDEBUG2("Cleartext-Password is not set, skipping CHAP TOTP auth");
+      return(1);
+   };
+
+   // request authenticator is the challenge if CHAP-Challenge is not set
+   if ((chal_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_CHAP_CHALLENGE]) != NULL)
+   {  chap->challenge      = chal_vp->data.octets;
+      chap->challenge_len  = chal_vp->length;
+   } else
+   {  chap->challenge      = request->packet->vector;
+      chap->challenge_len  = sizeof(request->packet->vector);
+   };
+   chap->response = &chap_vp->data.octets[1];
+
+   // identifier and static password are hashed once, each candidate code continues from this state
+   fr_md5_init(&chap->prefix);
+   fr_md5_update(&chap->prefix, chap_vp->data.octets, 1);
+   fr_md5_update(&chap->prefix, pass_vp->data.octets, pass_vp->length);
+
+   return(0);
+}
+
+
+// MD5(Identifier | Password | Code | Challenge) (RFC 1994 section 4.1)
+int
+totp_chap_verify(
+         totp_chap_t *                 chap,
+         const char *                  otp )
+{
+   int                     rc;
+   uint8_t                 digest[MD5_DIGEST_LENGTH];
+   FR_MD5_CTX              md5;
+
+   rad_assert(chap != NULL);
+   rad_assert(otp  != NULL);
+
+   md5 = chap->prefix;
+   fr_md5_update(&md5, (const uint8_t *)otp, strlen(otp));
+   fr_md5_update(&md5, chap->challenge, chap->challenge_len);
+   fr_md5_final(digest, &md5);
+
+   rc = (rad_digest_cmp(digest, chap->response, sizeof(digest)) == 0) ? 0 : -1;
+
+   totp_key_zeroize(&md5,   sizeof(md5));
+   totp_key_zeroize(digest, sizeof(digest));
+
+   return(rc);
+}
+
+
+//---------------------//
+// algorithm functions //
+//---------------------//
+// MARK: algorithm functions
+
+int
+totp_algo_algorithm_id(
+         const char *                  algo_name )
+{
+   int idx;
+   if (!(strncasecmp(algo_name, "HMAC", 4)))
+      algo_name = &algo_name[4];
+   for(idx = 0; ((totp_algorithm_map[idx].name)); idx++)
+      if (!(strcasecmp(algo_name, totp_algorithm_map[idx].name)))
+         return(totp_algorithm_map[idx].id);
+   return(-1);
+}
+
+
+const char *
+totp_algo_algorithm_name(
+         int                           algo_id )
+{
+   int idx;
+   for(idx = 0; ((totp_algorithm_map[idx].name)); idx++)
+      if (totp_algorithm_map[idx].id == algo_id)
+         return(totp_algorithm_map[idx].name);
+   return("unknown");
+}
+
+
+int
+totp_algo_calculate(
+         totp_params_t *               params )
+{
+   uint8_t        data[8];
+   uint8_t        digest[RLM_TOTP_DIGEST_LENGTH];
+   unsigned       digest_len;
+   unsigned       otp;
+
+   rad_assert(params != NULL);
+
+   if (params->totp_t0 > (params->totp_time + params->totp_time_offset))
+      return(-1);
+
+   // calculate interval count
+   params->totp_t     = totp_algo_counter(params);
+   if (params->totp_t < (params->invalid_until / params->totp_x))
+      return(RLM_TOTP_EEXPIRED);
+   if ((totp_cache_entry_used(params->used_step, params->used_map, params->totp_t)))
+      return(RLM_TOTP_EEXPIRED);
+
+   // copy interval count into data buffer
+   data[0]  = (params->totp_t >> 56) & 0xff;
+   data[1]  = (params->totp_t >> 48) & 0xff;
+   data[2]  = (params->totp_t >> 40) & 0xff;
+   data[3]  = (params->totp_t >> 32) & 0xff;
+   data[4]  = (params->totp_t >> 24) & 0xff;
+   data[5]  = (params->totp_t >> 16) & 0xff;
+   data[6]  = (params->totp_t >>  8) & 0xff;
+   data[7]  =  params->totp_t        & 0xff;
+
+   // calculate HMAC digest
+   totp_algo_hmac((int)params->totp_algo, digest, &digest_len, data, sizeof(data), params->key, params->key_len);
+   if (digest_len == 0)
+      return(-1);
+
+   otp = totp_algo_truncate(digest, digest_len, params->otp_length);
+
+   snprintf(params->otp, sizeof(params->otp), "%0*u", (int)params->otp_length, otp);
+
+   return(otp);
+}
+
+
+uint64_t
+totp_algo_counter(
+         totp_params_t *               params )
+{
+   uint64_t       totp_t;
+
+   rad_assert(params != NULL);
+
+   totp_t     = params->totp_time - params->totp_t0;
+   totp_t    += params->totp_time_offset;
+   totp_t    += params->totp_time_drift;
+   totp_t    /= params->totp_x;
+   totp_t    += params->totp_t_drift;
+
+   return(totp_t);
+}
+
+
+void
+totp_algo_debug(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params )
+{
+	rlm_totp_code_t *       inst;
+
+   rad_assert(instance != NULL);
+   rad_assert(params   != NULL);
+
+   inst = instance;
+
+   if (!(inst->devel_debug))
+      return;
+
+   RDEBUG("rlm_totp_code: totp_algo:            %s\n",  totp_algo_algorithm_name((int)params->totp_algo));
+   RDEBUG("rlm_totp_code: totp_time:            %u\n",  (unsigned)params->totp_time);
+   RDEBUG("rlm_totp_code: totp_time_offset:     %i\n",  (int)params->totp_time_offset);
+   RDEBUG("rlm_totp_code: totp_time_drift:      %i\n",  (int)params->totp_time_drift);
+   RDEBUG("rlm_totp_code: totp_time_adjusted:   %i\n",  ((int)params->totp_time +  (int)params->totp_time_offset + (int)params->totp_time_drift));
+   RDEBUG("rlm_totp_code: totp_t0:              %u\n",  (unsigned)params->totp_t0);
+   RDEBUG("rlm_totp_code: totp_x:               %u\n",  (unsigned)params->totp_x);
+   RDEBUG("rlm_totp_code: totp_t:               %u\n",  (unsigned)params->totp_t);
+   RDEBUG("rlm_totp_code: totp_t_drift:         %i\n",  (int)params->totp_t_drift);
+   RDEBUG("rlm_totp_code: totp_t_adjusted:      %i\n",  ((int)params->totp_t + (int)params->totp_t_drift));
+   RDEBUG("rlm_totp_code: key:                  <binary>\n");
+   RDEBUG("rlm_totp_code: key_len:              %u\n",  (unsigned)params->key_len);
+   RDEBUG("rlm_totp_code: result:               %s\n",  params->otp);
+   RDEBUG("rlm_totp_code: result_len:           %u\n",  (unsigned)params->otp_length);
+
+   return;
+}
+
+
+void
+totp_algo_hmac(
+         UNUSED int                    totp_algo,
+         uint8_t *                     digest,
+         unsigned *                    digest_lenp,
+         const uint8_t *               data,
+         size_t                        data_len,
+         const uint8_t *               key,
+         size_t                        key_len )
+{
+#ifdef HAVE_OPENSSL_EVP_H
+   unsigned char           md[RLM_TOTP_DIGEST_LENGTH];
+   unsigned                md_len;
+   const EVP_MD *          evp_md;
+   uint8_t  *              hmac_result;
+#endif // HAVE_OPENSSL_EVP_H
+
+   rad_assert(digest       != NULL);
+   rad_assert(data         != NULL);
+   rad_assert(data_len     >= 0);
+   rad_assert(key          != NULL);
+   rad_assert(key_len      >= 0);
+
+   memset(digest, 0, sizeof(RLM_TOTP_DIGEST_LENGTH));
+   *digest_lenp = 0;
+
+#ifndef HAVE_OPENSSL_EVP_H
+   if (totp_algo == RLM_TOTP_HMAC_SHA1)
+   {  fr_hmac_sha1(digest, data, data_len, key, key_len);
+      *digest_lenp = SHA1_DIGEST_LENGTH;
+   };
+#endif // !HAVE_OPENSSL_EVP_H
+
+#ifdef HAVE_OPENSSL_EVP_H
+   md_len      = RLM_TOTP_DIGEST_LENGTH;
+   switch(totp_algo)
+   {  case RLM_TOTP_HMAC_SHA1:   evp_md = EVP_sha1();    break;
+      case RLM_TOTP_HMAC_SHA224: evp_md = EVP_sha224();  break;
+      case RLM_TOTP_HMAC_SHA256: evp_md = EVP_sha256();  break;
+      case RLM_TOTP_HMAC_SHA384: evp_md = EVP_sha384();  break;
+      case RLM_TOTP_HMAC_SHA512: evp_md = EVP_sha512();  break;
+      default: return;
+   };
+   hmac_result = (uint8_t *)HMAC(evp_md, key, (int)key_len, (unsigned char *)data, data_len, md, &md_len);
+   memcpy(digest, hmac_result, md_len);
+   *digest_lenp = md_len;
+#endif // HAVE_OPENSSL_EVP_H
+
+   return;
+}
+
+
+// the key is hashed into the inner and outer digest states once, each
+// counter then only hashes its own 8 bytes
+void
+totp_algo_hmac_batch(
+         int                           totp_algo,
+         uint8_t                       (*digests)[RLM_TOTP_DIGEST_LENGTH],
+         unsigned *                    digest_lenp,
+         const uint64_t *              counters,
+         size_t                        counters_len,
+         const uint8_t *               key,
+         size_t                        key_len )
+{
+   size_t                  idx;
+   unsigned                byte;
+   uint8_t                 data[8];
+#ifdef HAVE_OPENSSL_EVP_H
+   unsigned                md_len;
+   const EVP_MD *          evp_md;
+   HMAC_CTX *              ctx;
+#endif // HAVE_OPENSSL_EVP_H
+
+   rad_assert(digests      != NULL);
+   rad_assert(digest_lenp  != NULL);
+   rad_assert(counters     != NULL);
+   rad_assert(key          != NULL);
+
+   *digest_lenp = 0;
+
+#ifndef HAVE_OPENSSL_EVP_H
+   if (totp_algo != RLM_TOTP_HMAC_SHA1)
+      return;
+   for(idx = 0; (idx < counters_len); idx++)
+   {  for(byte = 0; (byte < sizeof(data)); byte++)
+         data[byte] = (counters[idx] >> (56 - (byte * 8))) & 0xff;
+      fr_hmac_sha1(digests[idx], data, sizeof(data), key, key_len);
+   };
+   *digest_lenp = SHA1_DIGEST_LENGTH;
+#endif // !HAVE_OPENSSL_EVP_H
+
+#ifdef HAVE_OPENSSL_EVP_H
+   switch(totp_algo)
+   {  case RLM_TOTP_HMAC_SHA1:   evp_md = EVP_sha1();    break;
+      case RLM_TOTP_HMAC_SHA224: evp_md = EVP_sha224();  break;
+      case RLM_TOTP_HMAC_SHA256: evp_md = EVP_sha256();  break;
+      case RLM_TOTP_HMAC_SHA384: evp_md = EVP_sha384();  break;
+      case RLM_TOTP_HMAC_SHA512: evp_md = EVP_sha512();  break;
+      default: return;
+   };
+
+   if ((ctx = HMAC_CTX_new()) == NULL)
+      return;
+   if (!(HMAC_Init_ex(ctx, key, (int)key_len, evp_md, NULL)))
+   {  HMAC_CTX_free(ctx);
+      return;
+   };
+
+   md_len = 0;
+   for(idx = 0; (idx < counters_len); idx++)
+   {  for(byte = 0; (byte < sizeof(data)); byte++)
+         data[byte] = (counters[idx] >> (56 - (byte * 8))) & 0xff;
+
+      // a NULL key restores the digest states computed from the key
+      if ( ((idx)) && (!(HMAC_Init_ex(ctx, NULL, 0, evp_md, NULL))) )
+      {  HMAC_CTX_free(ctx);
+         return;
+      };
+      md_len = RLM_TOTP_DIGEST_LENGTH;
+      if ( (!(HMAC_Update(ctx, data, sizeof(data)))) || (!(HMAC_Final(ctx, digests[idx], &md_len))) )
+      {  HMAC_CTX_free(ctx);
+         return;
+      };
+   };
+
+   HMAC_CTX_free(ctx);
+
+   *digest_lenp = md_len;
+#endif // HAVE_OPENSSL_EVP_H
+
+   return;
+}
+
+
+int
+totp_algo_params(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         uint8_t *                     store_key )
+{
+   unsigned                      idx;
+   VALUE_PAIR *                  vp;
+   VALUE_PAIR **                 vps;
+   rlm_totp_code_t *             inst;
+   uint64_t                      totp_algo;
+   totp_store_t *                store;
+   const totp_store_record_t *   rec;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+   rad_assert(params    != NULL);
+
+   inst = instance;
+
+   // set initial values from module instance
+   memset(params, 0, sizeof(totp_params_t));
+   params->totp_t0            = inst->totp_t0;
+   params->totp_x             = inst->totp_x;
+   params->totp_time          = time(NULL);
+   params->totp_time_offset   = inst->totp_time_offset;
+   params->totp_algo          = inst->totp_algo;
+   params->otp_length         = inst->otp_length;
+
+   // collect attributes used by the module with one walk of each list
+   totp_request_vp_gather(instance, request, params);
+
+   // copy key and parameters of user in local secret store, the store may
+   // be unmapped after it is released, the key is not copied if store_key
+   // is NULL
+   if ((inst->store_file))
+   {  idx = totp_store_acquire(instance, &store);
+      if ((rec = totp_store_find(instance, request, params, store)) != NULL)
+      {  if ((rec->flags & TOTP_STORE_ALGORITHM))
+            params->totp_algo          = rec->algorithm;
+         if ((rec->flags & TOTP_STORE_OTP_LENGTH))
+            params->otp_length         = rec->otp_length;
+         if ((rec->flags & TOTP_STORE_TIME_STEP))
+            params->totp_x             = rec->time_step;
+         if ((rec->flags & TOTP_STORE_START_TIME))
+            params->totp_t0            = rec->start_time;
+         if ((rec->flags & TOTP_STORE_TIME_OFFSET))
+            params->totp_time_offset   = rec->time_offset;
+         if ((store_key))
+         {  memcpy(store_key, rec->key, rec->key_len);
+            params->key                = store_key;
+            params->key_len            = rec->key_len;
+         };
+      };
+      totp_store_release(instance, idx);
+   };
+
+   if (inst->allow_override == false)
+      return(0);
+
+   vps = params->vps[TOTP_SCOPE_CONTROL];
+   totp_algo_params_signed(instance, request,  vps[RLM_TOTP_VP_TIME_OFFSET], &params->totp_time_offset);
+   totp_algo_params_integer(instance, request, vps[RLM_TOTP_VP_START_TIME],  &params->totp_t0);
+   totp_algo_params_integer(instance, request, vps[RLM_TOTP_VP_TIME_STEP],   &params->totp_x);
+   totp_algo_params_integer(instance, request, vps[RLM_TOTP_VP_OTP_LENGTH],  &params->otp_length);
+
+   vp = vps[RLM_TOTP_VP_ALGORITHM];
+   if ( (vp != NULL) && (vp->da->type == PW_TYPE_STRING) )
+   {  totp_algo = totp_algo_algorithm_id(vp->data.strvalue);
+      if (totp_algo != 0)
+         params->totp_algo = totp_algo;
+   };
+
+   return(0);
+}
+
+
+int
+totp_algo_params_integer(
+         void *                        instance,
+         REQUEST *                     request,
+         VALUE_PAIR *                  vp,
+         uint64_t *                    uintp )
+{
+   unsigned long long   ulongval;
+   char *               endptr;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+   rad_assert(uintp     != NULL);
+
+   if (vp == NULL)
+      return(0);
+
+   switch(vp->da->type)
+   {  case PW_TYPE_INTEGER:
+         *uintp = (uint64_t)vp->data.integer;
+         break;
+
+      case PW_TYPE_INTEGER64:
+         *uintp = (uint64_t)vp->data.integer64;
+         break;
+
+      case PW_TYPE_SHORT:
+         *uintp = (uint64_t)vp->data.ushort;
+         break;
+
+      case PW_TYPE_SIGNED:
+         *uintp = (uint64_t)vp->data.sinteger;
+         break;
+
+      case PW_TYPE_STRING:
+         ulongval = strtoull(vp->data.strvalue, &endptr, 10);
+         if ( (vp->data.strvalue == endptr) || (endptr[0] != '\0') )
+            return(-1);
+         *uintp = (uint64_t)ulongval;
+         break;
+
+      default:
+         return(-1);
+   };
+
+   return(0);
+}
+
+
+int
+totp_algo_params_signed(
+         void *                        instance,
+         REQUEST *                     request,
+         VALUE_PAIR *                  vp,
+         int64_t *                     intp )
+{
+   unsigned long long   longval;
+   char *               endptr;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+   rad_assert(intp      != NULL);
+
+   if (vp == NULL)
+      return(0);
+
+   switch(vp->da->type)
+   {  case PW_TYPE_INTEGER:
+         *intp = (int64_t)vp->data.integer;
+         break;
+
+      case PW_TYPE_INTEGER64:
+         *intp = (int64_t)vp->data.integer64;
+         break;
+
+      case PW_TYPE_SHORT:
+         *intp = (int64_t)vp->data.ushort;
+         break;
+
+      case PW_TYPE_SIGNED:
+         *intp = (int64_t)vp->data.sinteger;
+         break;
+
+      case PW_TYPE_STRING:
+         longval = strtoll(vp->data.strvalue, &endptr, 10);
+         if ( (vp->data.strvalue == endptr) || (endptr[0] != '\0') )
+            return(-1);
+         *intp = (int64_t)longval;
+         break;
+
+      default:
+         return(-1);
+   };
+
+   return(0);
+}
+
+
+// dynamically truncates HMAC digest to a code of otp_length decimal digits
+unsigned
+totp_algo_truncate(
+         const uint8_t *               digest,
+         unsigned                      digest_len,
+         uint64_t                      otp_length )
+{
+   uint32_t       bin_code;
+   uint64_t       offset;
+   unsigned       denominator;
+   unsigned       digits;
+
+   rad_assert(digest       != NULL);
+   rad_assert(digest_len   >= 20);
+
+   // dynamically truncates hash
+   offset   = digest[digest_len-1] & 0x0f;
+   bin_code =  ((digest[offset+0] & 0x7f) << 24) |
+               ((digest[offset+1] & 0xff) << 16) |
+               ((digest[offset+2] & 0xff) <<  8) |
+                (digest[offset+3] & 0xff);
+
+   // truncates code to specific decimal digits
+   for(denominator = 1, digits = (unsigned)otp_length; (digits > 0); digits--)
+      denominator *= 10;
+
+   return(bin_code % denominator);
+}
+
+
+// Calculates every code allowed by try_previous, try_next, and time_drift.
+// Time steps reached by more than one drift are calculated once, and codes
+// which were used or are locked out are skipped.  Counters are returned in
+// ascending order with their codes, RLM_TOTP_CANDIDATES_MAX entries are
+// required.
+ssize_t
+totp_algo_window(
+         void *                        instance,
+         totp_params_t *               params,
+         uint64_t *                    counters,
+         uint32_t *                    otps )
+{
+   int                     drift;
+   int                     drift_max;
+   int64_t                 drifts[3];
+   int64_t                 step;
+   size_t                  count;
+   size_t                  pos;
+   unsigned                digest_len;
+   uint64_t                totp_t;
+   uint64_t                invalid_t;
+   uint8_t                 digests[RLM_TOTP_CANDIDATES_MAX][RLM_TOTP_DIGEST_LENGTH];
+   rlm_totp_code_t *       inst;
+
+   rad_assert(instance  != NULL);
+   rad_assert(params    != NULL);
+   rad_assert(counters  != NULL);
+   rad_assert(otps      != NULL);
+
+   inst = instance;
+
+   if (params->totp_t0 > (params->totp_time + params->totp_time_offset))
+      return(-1);
+
+   if ((inst->totp_time_drift))
+   {  drift_max          = 3;
+      drifts[0]          = 0 - (int64_t)inst->totp_time_drift;
+      drifts[1]          = 0;
+      drifts[2]          = (int64_t)inst->totp_time_drift;
+   } else
+   {  drift_max          = 1;
+      drifts[0]          = 0;
+   };
+
+   // collect unique time step counters in ascending order
+   count     = 0;
+   invalid_t = params->invalid_until / params->totp_x;
+   for(drift = 0; (drift < drift_max); drift++)
+   {  params->totp_time_drift = drifts[drift];
+      for(step = 0 - (int64_t)inst->try_prev; (step <= (int64_t)inst->try_next); step++)
+      {  params->totp_t_drift = (uint64_t)step;
+         totp_t               = totp_algo_counter(params);
+         if (totp_t < invalid_t)
+            continue;
+         if ((totp_cache_entry_used(params->used_step, params->used_map, totp_t)))
+            continue;
+         for(pos = count; ( (pos > 0) && (counters[pos-1] > totp_t) ); pos--);
+         if ( (pos > 0) && (counters[pos-1] == totp_t) )
+            continue;
+         memmove(&counters[pos+1], &counters[pos], ((count - pos) * sizeof(uint64_t)));
+         counters[pos] = totp_t;
+         count++;
+      };
+   };
+   params->totp_time_drift = 0;
+   params->totp_t_drift    = 0;
+
+   if (count == 0)
+      return(0);
+
+   totp_algo_hmac_batch((int)params->totp_algo, digests, &digest_len, counters, count, params->key, params->key_len);
+   if (digest_len == 0)
+      return(-1);
+
+   for(pos = 0; (pos < count); pos++)
+      otps[pos] = totp_algo_truncate(digests[pos], digest_len, params->otp_length);
+
+   return((ssize_t)count);
+}
+
+
+//----------------//
+// gate functions //
+//----------------//
+// MARK: gate functions
+
+int
+totp_gate_check(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params )
+{
+   size_t                  len;
+   size_t                  cmp_len;
+   unsigned                way;
+   uint32_t                hash;
+   uint64_t                now;
+   uint64_t                refill;
+   const uint8_t *         data;
+   rlm_totp_code_t *       inst;
+   VALUE_PAIR *            vp;
+   totp_gate_bucket_t *    set;
+   totp_gate_bucket_t *    bucket;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+
+   inst = instance;
+
+   if (!(inst->gate))
+      return(0);
+
+   if ((vp = totp_request_vp_by_idx(params, RLM_TOTP_VP_GATE_KEY)) == NULL)
+      return(0);
+
+   data     = totp_request_vp_data(vp, &len);
+   hash     = fr_hash(data, len);
+   cmp_len  = (len < RLM_TOTP_GATE_KEY_MAX) ? len : RLM_TOTP_GATE_KEY_MAX;
+   now      = ((uint64_t)request->timestamp.tv_sec * 1000) + ((uint64_t)request->timestamp.tv_usec / 1000);
+
+   pthread_mutex_lock(inst->gate_mutex);
+
+   // search set for bucket owned by value, otherwise select least recently used bucket
+   set    = &inst->gate[(hash & inst->gate_mask) * RLM_TOTP_GATE_WAYS];
+   bucket = NULL;
+   for(way = 0; (way < RLM_TOTP_GATE_WAYS); way++)
+   {  if ( (set[way].updated != 0) && (set[way].hash == hash) && (set[way].key_len == len) && (!(memcmp(set[way].key, data, cmp_len))) )
+      {  bucket = &set[way];
+         break;
+      };
+      if ( (!(bucket)) || (set[way].updated < bucket->updated) )
+         bucket = &set[way];
+   };
+
+   // unused buckets start full, buckets claimed from a different value keep their tokens
+   if (bucket->updated == 0)
+   {  bucket->tokens    = inst->gate_burst * 1000;
+      bucket->updated   = now;
+   };
+   if ( (bucket->hash != hash) || (bucket->key_len != len) || (memcmp(bucket->key, data, cmp_len)) )
+   {  bucket->hash      = hash;
+      bucket->key_len   = (uint32_t)len;
+      memcpy(bucket->key, data, cmp_len);
+   };
+
+   // refill bucket at gate_rate attempts per minute
+   if (now > bucket->updated)
+   {  refill            = ((now - bucket->updated) * inst->gate_rate) / 60;
+      refill           += bucket->tokens;
+      bucket->tokens    = (refill < (inst->gate_burst * 1000)) ? (uint32_t)refill : (inst->gate_burst * 1000);
+      bucket->updated   = now;
+   };
+
+   // consume one attempt
+   if (bucket->tokens < 1000)
+   {  pthread_mutex_unlock(inst->gate_mutex);
+      REDEBUG("too many TOTP attempts for %s, rejecting before verifying code", inst->gate_key_name);
+      return(-1);
+   };
+   bucket->tokens -= 1000;
+
+   pthread_mutex_unlock(inst->gate_mutex);
+
+   return(0);
+}
+
+
+//---------------//
+// key functions //
+//---------------//
+// MARK: key functions
+
+ssize_t
+totp_key_cache_query(
+         void *                        instance,
+         int                           encoding,
+         const void *                  secret,
+         size_t                        secret_len,
+         uint8_t *                     buff,
+         size_t                        buff_len )
+{
+   ssize_t                 len;
+   uint32_t                hash;
+   rlm_totp_code_t *       inst;
+   totp_key_t *            slot;
+
+   rad_assert(instance != NULL);
+   rad_assert(secret   != NULL);
+   rad_assert(buff     != NULL);
+
+   inst = instance;
+
+   if ( (!(inst->keys)) || (secret_len > RLM_TOTP_SECRET_MAX) )
+      return(-1);
+
+   hash = fr_hash(secret, secret_len);
+   slot = &inst->keys[hash & inst->keys_mask];
+   len  = -1;
+
+   // copy previously decoded key
+   pthread_mutex_lock(inst->keys_mutex);
+   if ( (slot->hash == hash) && (slot->encoding == (uint32_t)encoding) && (slot->secret_len == secret_len) &&
+        (slot->key_len <= buff_len) && (!(memcmp(slot->secret, secret, secret_len))) )
+   {  memcpy(buff, slot->key, slot->key_len);
+      len = slot->key_len;
+   };
+   pthread_mutex_unlock(inst->keys_mutex);
+
+   return(len);
+}
+
+
+void
+totp_key_cache_update(
+         void *                        instance,
+         int                           encoding,
+         const void *                  secret,
+         size_t                        secret_len,
+         const uint8_t *               key,
+         size_t                        key_len )
+{
+   uint32_t                hash;
+   rlm_totp_code_t *       inst;
+   totp_key_t *            slot;
+
+   rad_assert(instance != NULL);
+   rad_assert(secret   != NULL);
+   rad_assert(key      != NULL);
+
+   inst = instance;
+
+   if ( (!(inst->keys)) || (secret_len > RLM_TOTP_SECRET_MAX) || (key_len > RLM_TOTP_KEY_MAX) )
+      return;
+
+   hash = fr_hash(secret, secret_len);
+   slot = &inst->keys[hash & inst->keys_mask];
 
-rlm_rcode_t
-mod_authenticate(
+   // replace slot, zeroizing the evicted key
+   pthread_mutex_lock(inst->keys_mutex);
+   totp_key_zeroize(slot, sizeof(totp_key_t));
+   memcpy(slot->secret, secret, secret_len);
+   memcpy(slot->key,    key,    key_len);
+   slot->hash        = hash;
+   slot->encoding    = (uint32_t)encoding;
+   slot->secret_len  = (uint16_t)secret_len;
+   slot->key_len     = (uint16_t)key_len;
+   pthread_mutex_unlock(inst->keys_mutex);
+
+   return;
+}
+
+
+ssize_t
+totp_key_decode(
          void *                        instance,
-         REQUEST *                     request)
+         REQUEST *                     request,
+         const char *                  secret,
+         size_t                        secret_len,
+         uint8_t *                     buff,
+         size_t                        buff_len )
 {
-   int                     rc;
-   int                     code;
-   int                     step;
-   int                     steps_max;
-   int                     drift;
-   int                     drift_max;
-   int64_t                 drifts[3];
-   size_t                  key_len;
-   uint8_t *               key;
-   VALUE_PAIR *            pass_vp;
-   VALUE_PAIR *            vp;
-	rlm_totp_code_t *       inst;
-   totp_params_t           params;
+   int                     encoding;
+   ssize_t                 len;
+   rlm_totp_code_t *       inst;
 
    rad_assert(instance != NULL);
    rad_assert(request  != NULL);
+   rad_assert(secret   != NULL);
+   rad_assert(buff     != NULL);
 
    inst = instance;
 
-   key      = NULL;
-   key_len  = 0;
-
-   // determine TOTP parameters
-   if ((rc = totp_algo_params(instance, request, &params)) != 0)
-      return(RLM_MODULE_REJECT);
+   // copy previously decoded key
+   if ((len = totp_key_cache_query(instance, inst->secret_encoding, secret, secret_len, buff, buff_len)) >= 0)
+      return(len);
+
+   // decode secret directly into caller's buffer
+   encoding = inst->secret_encoding;
+   if (encoding == RLM_TOTP_ENCODING_AUTO)
+      encoding = totp_key_encoding(secret, secret_len);
+   switch(encoding)
+   {  case RLM_TOTP_ENCODING_HEX:
+         len = totp_hex_decode_buff(buff, buff_len, secret, secret_len);
+         break;
 
-   // retrieve TOTP password
-   pass_vp = totp_request_vp_by_dict(instance, request, inst->vsa_pass, TOTP_SCOPE_REQUEST);
-   if (!(pass_vp))
-   {  if ((inst->devel_debug))
-         RDEBUG2("TOTP password is not set, skipping TOTP auth");
-      return(RLM_MODULE_NOOP);
-   };
+      case RLM_TOTP_ENCODING_BASE64:
+         len = totp_base64_decode_buff(buff, buff_len, secret, secret_len);
+         break;
 
-   // attempt to obtain TOTP key from attributes
-   if (inst->vsa_secret != NULL)
-   {  vp = totp_request_vp_by_dict(instance, request, inst->vsa_secret, TOTP_SCOPE_CONTROL);
-      if (vp != NULL)
-         totp_base32_decode(request, &key, &key_len, vp->data.strvalue, vp->length);
-   };
-   if ( (inst->vsa_key != NULL) && (key == NULL) )
-   {  vp = totp_request_vp_by_dict(instance, request, inst->vsa_key, TOTP_SCOPE_CONTROL);
-      if (vp != NULL)
-      {  key      = (unsigned char *)vp->data.octets;
-         key_len  = vp->length;
-      };
+      default:
+         len = totp_base32_decode_buff(buff, buff_len, secret, secret_len);
+         break;
    };
-   if (!(key))
-   {  RDEBUG2("TOTP secret is not set");
-      return(RLM_MODULE_REJECT);
+   if (len < 0)
+   {  totp_key_zeroize(buff, buff_len);
+      if (len == RLM_TOTP_CODE_EBUFSIZ)
+         REDEBUG("decoded TOTP secret exceeds %zu bytes", buff_len);
+      return(len);
    };
 
-   params.key     = key;
-   params.key_len = key_len;
+   totp_key_cache_update(instance, inst->secret_encoding, secret, secret_len, buff, (size_t)len);
 
-   steps_max             = 1;
-   steps_max            += inst->try_next;
-   steps_max            += inst->try_prev;
-   params.totp_t_drift   = 0 - (signed)inst->try_prev;
+   return(len);
+}
 
-   if ((inst->totp_time_drift))
-   {  drift_max          = 3;
-      drifts[0]          = 0 - (int64_t)inst->totp_time_drift;
-      drifts[1]          = 0;
-      drifts[2]          = (int64_t)inst->totp_time_drift;
-   } else
-   {  drift_max          = 1;
-      drifts[0]          = 0;
-   };
 
-   for(step = 0; (step < steps_max); step++)
-   {  for(drift = 0; (drift < drift_max); drift++)
-      {  params.totp_time_drift = drifts[drift];
-
-         // calculate TOTP code
-         code = totp_algo_calculate(&params);
-         totp_algo_debug(instance, request, &params);
-         if (code < 0)
-         {  switch (code)
-            {
-               case RLM_TOTP_EEXPIRED:
-                  if ( ((step + 1) < steps_max) && (!(inst->devel_debug)) )
-                     continue;
-                  if ( ((drift + 1) < drift_max) && (!(inst->devel_debug)) )
-                     continue;
-                  RDEBUG2("TOTP is locked out due to reuse or too many attempts");
-                  break;
-
-               default:
-                  RDEBUG2("error generating TOTP code");
-                  break;
-            }
-            continue;
-         };
+// data is the IV, followed by the encrypted key, followed by the GCM tag
+ssize_t
+totp_key_decrypt(
+         void *                        instance,
+         REQUEST *                     request,
+         const uint8_t *               data,
+         size_t                        data_len,
+         uint8_t *                     buff,
+         size_t                        buff_len )
+{
+   ssize_t                 len;
+#ifdef HAVE_OPENSSL_EVP_H
+   int                     rc;
+   int                     out_len;
+   size_t                  key_len;
+   rlm_totp_code_t *       inst;
+   EVP_CIPHER_CTX *        ctx;
+#endif // HAVE_OPENSSL_EVP_H
 
-         // compare codes
-         if (params.otp_length == pass_vp->length)
-         {  if (!(memcmp(params.otp, pass_vp->data.octets, pass_vp->length)))
-            {  totp_cache_update(instance, request, &params, RLM_TOTP_CACHE_EXPIRED);
-               return(RLM_MODULE_OK);
-            };
-         };
-         if ((inst->devel_debug))
-            RDEBUG2("TOTP code does not match expected code");
-      };
-      params.totp_t_drift++;
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(data     != NULL);
+   rad_assert(buff     != NULL);
+
+   // copy previously decrypted key
+   if ((len = totp_key_cache_query(instance, RLM_TOTP_ENCODING_ENCRYPTED, data, data_len, buff, buff_len)) >= 0)
+      return(len);
+
+#ifndef HAVE_OPENSSL_EVP_H
+   return(RLM_TOTP_CODE_EDECRYPT);
+#else
+   inst = instance;
+
+   if (data_len <= (RLM_TOTP_AES_IV_LEN + RLM_TOTP_AES_TAG_LEN))
+   {  REDEBUG("encrypted TOTP key is too short");
+      return(RLM_TOTP_CODE_EDECRYPT);
+   };
+   key_len = data_len - (RLM_TOTP_AES_IV_LEN + RLM_TOTP_AES_TAG_LEN);
+   if (key_len > buff_len)
+   {  REDEBUG("decrypted TOTP key exceeds %zu bytes", buff_len);
+      return(RLM_TOTP_CODE_EBUFSIZ);
    };
 
-   totp_cache_update(instance, request, &params, RLM_TOTP_CACHE_FAILED);
-   RDEBUG2("failed TOTP authentication");
+   // OpenSSL uses AES-NI and carry-less multiplication when supported by CPU
+   if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+      return(RLM_TOTP_CODE_EDECRYPT);
+   rc = ( (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) == 1) &&
+          (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, RLM_TOTP_AES_IV_LEN, NULL) == 1) &&
+          (EVP_DecryptInit_ex(ctx, NULL, NULL, inst->encryption->key, data) == 1) &&
+          (EVP_DecryptUpdate(ctx, buff, &out_len, &data[RLM_TOTP_AES_IV_LEN], (int)key_len) == 1) &&
+          (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, RLM_TOTP_AES_TAG_LEN, (void *)&data[data_len - RLM_TOTP_AES_TAG_LEN]) == 1) &&
+          (EVP_DecryptFinal_ex(ctx, &buff[out_len], &out_len) == 1) );
+   EVP_CIPHER_CTX_free(ctx);
+   if (!(rc))
+   {  totp_key_zeroize(buff, buff_len);
+      REDEBUG("unable to decrypt TOTP key");
+      return(RLM_TOTP_CODE_EDECRYPT);
+   };
 
-   return(RLM_MODULE_REJECT);
-}
+   totp_key_cache_update(instance, RLM_TOTP_ENCODING_ENCRYPTED, data, data_len, buff, key_len);
 
+   return((ssize_t)key_len);
+#endif // HAVE_OPENSSL_EVP_H
+}
 
 
 int
-mod_bootstrap(
-         CONF_SECTION *                conf,
-         void *                        instance )
+totp_key_encoding(
+         const char *                  secret,
+         size_t                        secret_len )
 {
-   int                     rc;
-	rlm_totp_code_t *       inst;
+   size_t                  pos;
+   uint8_t                 c;
+   bool                    hex;
+   bool                    base32;
+   bool                    lower;
+   bool                    upper;
+
+   rad_assert( (secret != NULL) || (secret_len == 0) );
+
+   // note which alphabets can encode the secret
+   hex      = ( (secret_len > 0) && ((secret_len % 2) == 0) );
+   base32   = true;
+   lower    = false;
+   upper    = false;
+   for(pos = 0; (pos < secret_len); pos++)
+   {  c      = (uint8_t)secret[pos];
+      hex    = ( (hex)    && (hex_map[c] != -1) );
+      base32 = ( (base32) && ( (base32_map[c] != -1) || (c == '=') ) );
+      lower  = ( (lower)  || ( (c >= 'a') && (c <= 'z') ) );
+      upper  = ( (upper)  || ( (c >= 'A') && (c <= 'Z') ) );
+   };
 
-   inst = instance;
+   if ((hex))
+      return(RLM_TOTP_ENCODING_HEX);
 
-   if ((inst->name = cf_section_name2(conf)) == NULL)
-      inst->name = cf_section_name1(conf);
+   // base32 is case insensitive and is not written in mixed case
+   if ( ((base32)) && ( (!(lower)) || (!(upper)) ) )
+      return(RLM_TOTP_ENCODING_BASE32);
+   return(RLM_TOTP_ENCODING_BASE64);
+}
 
-   // register xlat:totp_code
-   rc = xlat_register(inst->name, totp_xlat_code, NULL, inst);
-   if (rc != 0)
-   {  ERROR("totp_code: failed to register xlat:%s", inst->name);
-      return(-1);
-   };
 
-   return(0);
+int
+totp_key_encoding_id(
+         const char *                  encoding_name )
+{
+   if (!(strcasecmp(encoding_name, "auto")))
+      return(RLM_TOTP_ENCODING_AUTO);
+   if (!(strcasecmp(encoding_name, "base32")))
+      return(RLM_TOTP_ENCODING_BASE32);
+   if (!(strcasecmp(encoding_name, "base64")))
+      return(RLM_TOTP_ENCODING_BASE64);
+   if (!(strcasecmp(encoding_name, "hex")))
+      return(RLM_TOTP_ENCODING_HEX);
+   return(-1);
 }
 
 
 int
-mod_detach(
+totp_key_load(
          void *                        instance )
 {
    rlm_totp_code_t *       inst;
+#ifdef HAVE_OPENSSL_EVP_H
+   int                     fd;
+   ssize_t                 len;
+   char                    text[(RLM_TOTP_AES_KEY_LEN * 2) + 3];
+#endif // HAVE_OPENSSL_EVP_H
 
    rad_assert(instance != NULL);
 
-   inst = instance;
+   inst                    = instance;
+   inst->vsa_encrypted_key = NULL;
+   inst->encryption        = NULL;
 
-   // destroy and free mutex lock
-#ifdef HAVE_PTHREAD_H
-   if ((inst->mutex))
-   {  pthread_mutex_destroy(inst->mutex);
-      talloc_free_children(inst->mutex);
-      inst->mutex = NULL;
+   if (!(inst->encrypted_key_file))
+      return(0);
+
+#ifndef HAVE_OPENSSL_EVP_H
+   ERROR("totp_code: encrypted_key_file requires OpenSSL");
+   return(-1);
+#else
+   // lookup and verify VSA specified by config option vsa_encrypted_key
+   if (!(inst->vsa_encrypted_key_name))
+   {  ERROR("totp_code: encrypted_key_file requires vsa_encrypted_key");
+      return(-1);
+   };
+   if ((inst->vsa_encrypted_key = dict_attrbyname(inst->vsa_encrypted_key_name)) == NULL)
+   {  ERROR("'%s' not found in dictionary", inst->vsa_encrypted_key_name);
+      return(-1);
+   };
+   if (inst->vsa_encrypted_key->type != PW_TYPE_OCTETS)
+   {  ERROR("'%s' is not an octets attribute", inst->vsa_encrypted_key_name);
+      return(-1);
    };
-#endif // HAVE_PTHREAD_H
 
-   if (inst->cache_tree != NULL)
-      rbtree_free(inst->cache_tree);
-   inst->cache_tree = NULL;
+   // key file contains the AES-256 key as hexadecimal digits
+   if ((inst->encryption = totp_arena_alloc(instance, NULL)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for encryption key");
+      return(-1);
+   };
+   if ((fd = open(inst->encrypted_key_file, O_RDONLY)) == -1)
+   {  ERROR("totp_code: %s: %s", inst->encrypted_key_file, fr_syserror(errno));
+      return(-1);
+   };
+   len = read(fd, text, sizeof(text));
+   close(fd);
+   while ( (len > 0) && ((isspace((uint8_t)text[len-1]))) )
+      len--;
+   if (len > 0)
+      len = totp_hex_decode_buff(inst->encryption->key, RLM_TOTP_AES_KEY_LEN, text, (size_t)len);
+   totp_key_zeroize(text, sizeof(text));
+   if (len != RLM_TOTP_AES_KEY_LEN)
+   {  totp_arena_free(instance, inst->encryption);
+      inst->encryption = NULL;
+      ERROR("totp_code: %s: key must be %i hexadecimal digits", inst->encrypted_key_file, (RLM_TOTP_AES_KEY_LEN * 2));
+      return(-1);
+   };
 
    return(0);
+#endif // HAVE_OPENSSL_EVP_H
 }
 
 
-int
-mod_instantiate(
-         UNUSED CONF_SECTION *         conf,
-         void *                        instance )
+void
+totp_key_zeroize(
+         void *                        ptr,
+         size_t                        len )
 {
-   rlm_totp_code_t *       inst;
-   PW_TYPE                 type;
-   const char *            vsa_name;
-
-   rad_assert(instance != NULL);
+   volatile uint8_t *      p;
 
-   inst              = instance;
-   inst->mutex       = NULL;
-   inst->cache_tree  = NULL;
-   inst->cache_list  = NULL;
+   // volatile stores are not removed as dead stores by the compiler
+   for(p = ptr; (len > 0); len--)
+      *p++ = 0;
 
-   // initialize mutex lock
-   inst->mutex = NULL;
-#ifdef HAVE_PTHREAD_H
-   if ((inst->mutex = talloc_zero(instance, pthread_mutex_t)) == NULL)
-   {  ERROR("totp_code: failed to allocate memory for mutex lock");
-      return(-1);
-   };
-   pthread_mutex_init(inst->mutex, NULL);
-#endif // HAVE_PTHREAD_H
+   return;
+}
 
-   FR_INTEGER_BOUND_CHECK("time_step",    inst->totp_x,           >=, 1);
-   FR_INTEGER_BOUND_CHECK("otp_length",   inst->otp_length,       >=, 1);
-   FR_INTEGER_BOUND_CHECK("otp_length",   inst->otp_length,       <=, 9);
-   FR_INTEGER_BOUND_CHECK("time_drift",   inst->totp_time_drift,  <, inst->totp_x);
 
-   if ((inst->totp_algo = totp_algo_algorithm_id(inst->totp_algo_str)) == -1)
-   {  WARN("Ignoring \"algorithm = %s\", forcing to \"algorithm = SHA1\"", inst->totp_algo_str);
-      inst->totp_algo = RLM_TOTP_HMAC_SHA1;
-   };
+//------------------//
+// mschap functions //
+//------------------//
+// MARK: mschap functions
 
-   // lookup and verify VSA specified by config option vsa_cache_key
-   if ((vsa_name = inst->vsa_cache_id_name) != NULL)
-   {  if ((inst->vsa_cache_id = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
+// single DES encryption of one block with a 56 bit key (RFC 2759 DesEncrypt)
+void
+totp_mschap_des(
+         const uint8_t *               key,
+         const uint8_t *               data,
+         uint8_t *                     out )
+{
+   unsigned                idx;
+   unsigned                round;
+   uint64_t                key56;
+   uint64_t                key64;
+   uint64_t                block;
+   uint64_t                subkey;
+   uint64_t                expanded;
+   uint32_t                c;
+   uint32_t                d;
+   uint32_t                l;
+   uint32_t                r;
+   uint32_t                f;
+   uint32_t                six;
+
+   // spread 56 bit key into 64 bits, parity bits are discarded by PC-1
+   key56 = 0;
+   for(idx = 0; (idx < 7); idx++)
+      key56 = (key56 << 8) | key[idx];
+   key64 = 0;
+   for(idx = 0; (idx < 8); idx++)
+      key64 = (key64 << 8) | (((key56 >> (49 - (7 * idx))) & 0x7f) << 1);
+
+   block = 0;
+   for(idx = 0; (idx < 8); idx++)
+      block = (block << 8) | data[idx];
+
+   key64 = totp_mschap_des_permute(key64, 64, mschap_des_pc1, sizeof(mschap_des_pc1));
+   c     = (uint32_t)(key64 >> 28) & 0x0fffffff;
+   d     = (uint32_t)key64 & 0x0fffffff;
+
+   block = totp_mschap_des_permute(block, 64, mschap_des_ip, sizeof(mschap_des_ip));
+   l     = (uint32_t)(block >> 32);
+   r     = (uint32_t)block;
+
+   for(round = 0; (round < 16); round++)
+   {  c        = ((c << mschap_des_shifts[round]) | (c >> (28 - mschap_des_shifts[round]))) & 0x0fffffff;
+      d        = ((d << mschap_des_shifts[round]) | (d >> (28 - mschap_des_shifts[round]))) & 0x0fffffff;
+      subkey   = totp_mschap_des_permute((((uint64_t)c) << 28) | d, 56, mschap_des_pc2, sizeof(mschap_des_pc2));
+      expanded = totp_mschap_des_permute(r, 32, mschap_des_e, sizeof(mschap_des_e)) ^ subkey;
+
+      // outer bits of each six bit group select row, inner bits select column
+      f = 0;
+      for(idx = 0; (idx < 8); idx++)
+      {  six = (uint32_t)(expanded >> (42 - (6 * idx))) & 0x3f;
+         f   = (f << 4) | mschap_des_sbox[idx][(six & 0x20) | ((six & 0x01) << 4) | ((six >> 1) & 0x0f)];
       };
+      f  = (uint32_t)totp_mschap_des_permute(f, 32, mschap_des_p, sizeof(mschap_des_p));
+      f ^= l;
+      l  = r;
+      r  = f;
    };
 
-   // lookup and verify VSA specified by config option vsa_secret
-   if ((vsa_name = inst->vsa_secret_name) != NULL)
-   {  if ((inst->vsa_secret = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-   };
+   block = totp_mschap_des_permute((((uint64_t)r) << 32) | l, 64, mschap_des_fp, sizeof(mschap_des_fp));
+   for(idx = 0; (idx < 8); idx++)
+      out[idx] = (uint8_t)(block >> (56 - (8 * idx)));
 
-   // lookup and verify VSA specified by config option vsa_key
-   if ((vsa_name = inst->vsa_key_name) != NULL)
-   {  if ((inst->vsa_key = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-   };
+   return;
+}
 
-   // lookup and verify VSA specified by config option vsa_pass
-   if ((vsa_name = inst->vsa_pass_name) != NULL)
-   {  if ((inst->vsa_pass = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-   };
 
-   // lookup and verify VSA specified by config option vsa_time_offset
-   if ((vsa_name = inst->vsa_time_offset_name) != NULL)
-   {  if ((inst->vsa_time_offset = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-      type = inst->vsa_time_offset->type;
-      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
-      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
-         return(-1);
-      };
-   };
+uint64_t
+totp_mschap_des_permute(
+         uint64_t                      in,
+         unsigned                      in_bits,
+         const uint8_t *               table,
+         size_t                        table_len )
+{
+   size_t                  idx;
+   uint64_t                out;
 
-   // lookup and verify VSA specified by config option vsa_unix_time
-   if ((vsa_name = inst->vsa_start_time_name) != NULL)
-   {  if ((inst->vsa_unix_time = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-      type = inst->vsa_unix_time->type;
-      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
-      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
-         return(-1);
-      };
-   };
+   out = 0;
+   for(idx = 0; (idx < table_len); idx++)
+      out = (out << 1) | ((in >> (in_bits - table[idx])) & 1);
 
-   // lookup and verify VSA specified by config option vsa_time_step
-   if ((vsa_name = inst->vsa_time_step_name) != NULL)
-   {  if ((inst->vsa_time_step = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-      type = inst->vsa_time_step->type;
-      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
-      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
-         return(-1);
-      };
-   };
+   return(out);
+}
 
-   // lookup and verify VSA specified by config option vsa_otp_length
-   if ((vsa_name = inst->vsa_otp_length_name) != NULL)
-   {  if ((inst->vsa_otp_length = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-      type = inst->vsa_otp_length->type;
-      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
-      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
-         return(-1);
-      };
+
+void
+totp_mschap_error(
+         REQUEST *                     request,
+         totp_mschap_t *               mschap )
+{
+   uint8_t                 error[16];
+   VALUE_PAIR *            vp;
+
+   rad_assert(request != NULL);
+   rad_assert(mschap  != NULL);
+
+   // peer is not asked to retry, a new code is required
+   error[0] = mschap->ident;
+   memcpy(&error[1], "E=691 R=0 V=3", 13);
+
+   if ((vp = pair_make_reply("MS-CHAP-Error", NULL, T_OP_EQ)) != NULL)
+      fr_pair_value_memcpy(vp, error, 14);
+
+   return;
+}
+
+
+// returns 0 for MS-CHAPv2 requests, 1 if not MS-CHAPv2, and -1 if invalid
+int
+totp_mschap_init(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_mschap_t *               mschap )
+{
+   ssize_t                 len;
+   size_t                  user_len;
+   const char *            user;
+   const char *            domain;
+   uint8_t                 digest[SHA1_DIGEST_LENGTH];
+   uint8_t                 ucs2[RLM_TOTP_MSCHAP_PASS_MAX * 2];
+   rlm_totp_code_t *       inst;
+   VALUE_PAIR *            chal_vp;
+   VALUE_PAIR *            resp_vp;
+   VALUE_PAIR *            user_vp;
+   VALUE_PAIR *            pass_vp;
+   fr_sha1_ctx             sha1;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(params   != NULL);
+   rad_assert(mschap   != NULL);
+
+   inst = instance;
+
+   if (!(inst->allow_mschap))
+      return(1);
+
+   chal_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_MSCHAP_CHAL];
+   resp_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_MSCHAP2_RESP];
+   if ( (!(chal_vp)) || (!(resp_vp)) )
+      return(1);
+   if ( (chal_vp->length != 16) || (resp_vp->length != 50) )
+   {  REDEBUG("MS-CHAP-Challenge or MS-CHAP2-Response has invalid length");
+      return(-1);
    };
 
-   // lookup and verify VSA specified by config option vsa_algorithm
-   if ((vsa_name = inst->vsa_algorithm_name) != NULL)
-   {  if ((inst->vsa_algorithm = dict_attrbyname(vsa_name)) == NULL)
-      {  ERROR("'%s' not found in dictionary", vsa_name);
-         return(-1);
-      };
-      type = inst->vsa_algorithm->type;
-      if ( (type!= PW_TYPE_INTEGER) && (type!= PW_TYPE_INTEGER64) && (type != PW_TYPE_SIGNED) && (type != PW_TYPE_STRING) )
-      {  ERROR("'%s' is not an integer or signed attribute", vsa_name);
-         return(-1);
-      };
+   // static password entered before TOTP code
+   if ((pass_vp = params->vps[TOTP_SCOPE_CONTROL][RLM_TOTP_VP_CLEARTEXT]) == NULL)
+   {  RDEBUG2("Cleartext-Password is not set, skipping MS-CHAPv2 TOTP auth");
+      return(1);
    };
 
-   // initialize cache and list
-   inst->cache_tree = rbtree_create(instance, totp_cache_entry_cmp, totp_cache_entry_free, 0);
-   if (inst->cache_tree == NULL)
+   // user name is hashed without domain (RFC 2759 section 8.2)
+   if ((user_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_MSCHAP_USER]) == NULL)
+      user_vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_USER_NAME];
+   if (!(user_vp))
+   {  REDEBUG("User-Name is required for MS-CHAPv2 authentication");
       return(-1);
-   inst->cache_list = talloc_size(instance, sizeof(totp_cache_entry_t));
-   if (inst->cache_list == NULL)
-   { rbtree_free(inst->cache_tree);
+   };
+   user     = user_vp->data.strvalue;
+   user_len = user_vp->length;
+   if ((domain = memchr(user, '\\', user_len)) != NULL)
+   {  user_len -= (size_t)(domain - user) + 1;
+      user      = domain + 1;
+   };
+
+   // ChallengeHash() = SHA1(PeerChallenge | AuthenticatorChallenge | UserName)
+   fr_sha1_init(&sha1);
+   fr_sha1_update(&sha1, &resp_vp->data.octets[2], 16);
+   fr_sha1_update(&sha1, chal_vp->data.octets, 16);
+   fr_sha1_update(&sha1, (const uint8_t *)user, user_len);
+   fr_sha1_final(digest, &sha1);
+
+   mschap->ident        = resp_vp->data.octets[0];
+   mschap->nt_response  = &resp_vp->data.octets[26];
+   memcpy(mschap->challenge_hash, digest, sizeof(mschap->challenge_hash));
+
+   // static password is hashed once, each candidate code continues from this state
+   if ((len = totp_mschap_ucs2(ucs2, sizeof(ucs2), pass_vp->data.octets, pass_vp->length)) < 0)
+   {  REDEBUG("Cleartext-Password is not valid UTF-8 or is too long for MS-CHAPv2");
       return(-1);
    };
-   memset(inst->cache_list, 0, sizeof(totp_cache_entry_t));
+   fr_md4_init(&mschap->nt_prefix);
+   fr_md4_update(&mschap->nt_prefix, ucs2, (size_t)len);
+   totp_key_zeroize(ucs2, sizeof(ucs2));
 
    return(0);
 }
 
 
-rlm_rcode_t
-mod_post_auth(
-         void *                        instance,
-         REQUEST *                     request)
+// NtPasswordHash() of static password followed by otp
+void
+totp_mschap_nt_hash(
+         totp_mschap_t *               mschap,
+         const char *                  otp,
+         uint8_t *                     nt_hash )
 {
-   totp_params_t        params;
-   int                  action;
+   size_t                  len;
+   uint8_t                 ucs2[32];
+   FR_MD4_CTX              md4;
 
-   rad_assert(instance  != NULL);
-   rad_assert(request   != NULL);
+   for(len = 0; ( ((otp[len])) && (len < (sizeof(ucs2) / 2)) ); len++)
+   {  ucs2[(len * 2) + 0] = (uint8_t)otp[len];
+      ucs2[(len * 2) + 1] = 0;
+   };
 
-   // determine TOTP parameters
-   if ( totp_algo_params(instance, request, &params) != 0)
-      return(RLM_MODULE_NOOP);
+   md4 = mschap->nt_prefix;
+   fr_md4_update(&md4, ucs2, len * 2);
+   fr_md4_final(nt_hash, &md4);
+   totp_key_zeroize(&md4, sizeof(md4));
 
-   switch(request->reply->code)
-   {  case PW_CODE_ACCESS_ACCEPT: action = RLM_TOTP_CACHE_EXPIRED; break;
-      case PW_CODE_ACCESS_REJECT: action = RLM_TOTP_CACHE_FAILED; break;
-      default: return(RLM_MODULE_NOOP);
+   return;
+}
+
+
+void
+totp_mschap_reply(
+         REQUEST *                     request,
+         totp_mschap_t *               mschap,
+         const char *                  otp )
+{
+   size_t                  idx;
+   uint8_t                 nt_hash[MD4_DIGEST_LENGTH];
+   uint8_t                 nt_hash_hash[MD4_DIGEST_LENGTH];
+   uint8_t                 digest[SHA1_DIGEST_LENGTH];
+   uint8_t                 master_key[16];
+   uint8_t                 pad[40];
+   uint8_t                 success[3 + (SHA1_DIGEST_LENGTH * 2)];
+   VALUE_PAIR *            vp;
+   fr_sha1_ctx             sha1;
+   static const char *     hex = "0123456789ABCDEF";
+
+   rad_assert(request != NULL);
+   rad_assert(mschap  != NULL);
+   rad_assert(otp     != NULL);
+
+   totp_mschap_nt_hash(mschap, otp, nt_hash);
+   fr_md4_calc(nt_hash_hash, nt_hash, sizeof(nt_hash));
+
+   // GenerateAuthenticatorResponse() (RFC 2759 section 8.7)
+   fr_sha1_init(&sha1);
+   fr_sha1_update(&sha1, nt_hash_hash, sizeof(nt_hash_hash));
+   fr_sha1_update(&sha1, mschap->nt_response, 24);
+   fr_sha1_update(&sha1, (const uint8_t *)RLM_TOTP_MSCHAP_MAGIC1, sizeof(RLM_TOTP_MSCHAP_MAGIC1) - 1);
+   fr_sha1_final(digest, &sha1);
+   fr_sha1_init(&sha1);
+   fr_sha1_update(&sha1, digest, sizeof(digest));
+   fr_sha1_update(&sha1, mschap->challenge_hash, sizeof(mschap->challenge_hash));
+   fr_sha1_update(&sha1, (const uint8_t *)RLM_TOTP_MSCHAP_MAGIC2, sizeof(RLM_TOTP_MSCHAP_MAGIC2) - 1);
+   fr_sha1_final(digest, &sha1);
+
+   success[0] = mschap->ident;
+   success[1] = 'S';
+   success[2] = '=';
+   for(idx = 0; (idx < sizeof(digest)); idx++)
+   {  success[3 + (idx * 2) + 0] = (uint8_t)hex[digest[idx] >> 4];
+      success[3 + (idx * 2) + 1] = (uint8_t)hex[digest[idx] & 0x0f];
    };
+   if ((vp = pair_make_reply("MS-CHAP2-Success", NULL, T_OP_EQ)) != NULL)
+      fr_pair_value_memcpy(vp, success, sizeof(success));
+
+   // GetMasterKey() (RFC 3079 section 3.4)
+   fr_sha1_init(&sha1);
+   fr_sha1_update(&sha1, nt_hash_hash, sizeof(nt_hash_hash));
+   fr_sha1_update(&sha1, mschap->nt_response, 24);
+   fr_sha1_update(&sha1, (const uint8_t *)RLM_TOTP_MPPE_MASTER, sizeof(RLM_TOTP_MPPE_MASTER) - 1);
+   fr_sha1_final(digest, &sha1);
+   memcpy(master_key, digest, sizeof(master_key));
+
+   // GetAsymmetricStartKey() of server, keys are encrypted when reply is encoded
+   for(idx = 0; (idx < 2); idx++)
+   {  fr_sha1_init(&sha1);
+      fr_sha1_update(&sha1, master_key, sizeof(master_key));
+      memset(pad, 0x00, sizeof(pad));
+      fr_sha1_update(&sha1, pad, sizeof(pad));
+      if (idx == 0)
+         fr_sha1_update(&sha1, (const uint8_t *)RLM_TOTP_MPPE_SEND, sizeof(RLM_TOTP_MPPE_SEND) - 1);
+      else
+         fr_sha1_update(&sha1, (const uint8_t *)RLM_TOTP_MPPE_RECV, sizeof(RLM_TOTP_MPPE_RECV) - 1);
+      memset(pad, 0xf2, sizeof(pad));
+      fr_sha1_update(&sha1, pad, sizeof(pad));
+      fr_sha1_final(digest, &sha1);
+      if ((vp = pair_make_reply(((idx == 0) ? "MS-MPPE-Send-Key" : "MS-MPPE-Recv-Key"), NULL, T_OP_EQ)) != NULL)
+         fr_pair_value_memcpy(vp, digest, 16);
+   };
+   pair_make_reply("MS-MPPE-Encryption-Policy", "1", T_OP_EQ);
+   pair_make_reply("MS-MPPE-Encryption-Types",  "6", T_OP_EQ);
 
-   // update cache
-   totp_cache_update(instance, request, &params, action);
+   totp_key_zeroize(nt_hash,       sizeof(nt_hash));
+   totp_key_zeroize(nt_hash_hash,  sizeof(nt_hash_hash));
+   totp_key_zeroize(master_key,    sizeof(master_key));
+   totp_key_zeroize(digest,        sizeof(digest));
 
-   return(RLM_MODULE_NOOP);
+   return;
 }
 
 
-//------------------//
-// base32 functions //
-//------------------//
-// MARK: base32 functions
-
+// converts UTF-8 to UTF-16LE, characters outside of the BMP, overlong
+// sequences, and surrogates are rejected
 ssize_t
-totp_base32_decode(
-         const void *                  ctx,
-         uint8_t **                    dstp,
-         size_t *                      dstlenp,
-         const char *                  src,
-         size_t                        srclen )
+totp_mschap_ucs2(
+         uint8_t *                     dst,
+         size_t                        dst_size,
+         const uint8_t *               src,
+         size_t                        src_len )
 {
-   uint8_t *   dst;
-   size_t      dstlen;
-   size_t      datlen;
-   size_t      pos;
-   ssize_t     rc;
+   size_t                  pos;
+   size_t                  len;
+   uint32_t                c;
+
+   for(pos = 0, len = 0; (pos < src_len); len += 2)
+   {  if (src[pos] < 0x80)
+      {  c    = src[pos];
+         pos += 1;
+      }
+      else if ( ((src[pos] & 0xe0) == 0xc0) && ((pos + 1) < src_len) && ((src[pos+1] & 0xc0) == 0x80) )
+      {  c    = ((src[pos] & 0x1fU) << 6) | (src[pos+1] & 0x3fU);
+         pos += 2;
+         if (c < 0x80)
+            return(-1);
+      }
+      else if ( ((src[pos] & 0xf0) == 0xe0) && ((pos + 2) < src_len) && ((src[pos+1] & 0xc0) == 0x80) && ((src[pos+2] & 0xc0) == 0x80) )
+      {  c    = ((src[pos] & 0x0fU) << 12) | ((src[pos+1] & 0x3fU) << 6) | (src[pos+2] & 0x3fU);
+         pos += 3;
+         if ( (c < 0x800) || ((c >= 0xd800) && (c <= 0xdfff)) )
+            return(-1);
+      }
+      else
+      {  return(-1);
+      };
+      if ((len + 2) > dst_size)
+         return(-1);
+      dst[len + 0] = (uint8_t)(c & 0xff);
+      dst[len + 1] = (uint8_t)(c >> 8);
+   };
 
-   rad_assert(ctx != NULL);
-   rad_assert(dstp != NULL);
-   rad_assert(dstlenp != NULL);
+   return((ssize_t)len);
+}
 
-   *dstp    = NULL;
-   *dstlenp = 0;
 
-   datlen   = 0;
+// ChallengeResponse() is three DES blocks compared in constant time
+int
+totp_mschap_verify(
+         totp_mschap_t *               mschap,
+         const char *                  otp )
+{
+   int                     rc;
+   unsigned                idx;
+   uint8_t                 nt_hash[21];
+   uint8_t                 response[24];
 
-   // verifies encoded data
-   if ((rc = totp_base32_verify(src, srclen)) < 0)
-      return(rc);
-   dstlen = (size_t)(rc+1);
+   rad_assert(mschap != NULL);
+   rad_assert(otp    != NULL);
 
-   // allocate memory and decode secret
-   if ((dst = talloc_size(ctx, dstlen)) == NULL)
-   {  ERROR("totp_code: unable to allocate memory");
-      return(-1);
-   };
-   memset(dst, '\0', dstlen);
-   *dstp = dst;
-
-   // decodes base32 encoded data
-   datlen = 0;
-   for(pos = 0; (pos < srclen); pos++)
-   {  // MSB is Most Significant Bits  (0x80 == 10000000 ~= MSB)
-      // MB is middle bits             (0x7E == 01111110 ~= MB)
-      // LSB is Least Significant Bits (0x01 == 00000001 ~= LSB)
-      switch(pos%8)
-      {  // byte 0
-         case 1:
-            dst[datlen]  = (base32_map[(uint8_t)src[pos-1]] << 3) & 0xF8; // 5 MSB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-0]] >> 2) & 0x07; // 3 LSB
-            datlen++;
-            break;
+   totp_mschap_nt_hash(mschap, otp, nt_hash);
+   memset(&nt_hash[MD4_DIGEST_LENGTH], 0, sizeof(nt_hash) - MD4_DIGEST_LENGTH);
 
-         // byte 2
-         case 2:
-            if (src[pos] == '=')
-               return((ssize_t)(*dstlenp = datlen));
-            break;
+   for(idx = 0; (idx < 3); idx++)
+      totp_mschap_des(&nt_hash[idx * 7], mschap->challenge_hash, &response[idx * 8]);
+   rc = ((rad_digest_cmp(response, mschap->nt_response, sizeof(response)))) ? -1 : 0;
 
-         // byte 3
-         case 3:
-            dst[datlen]  = (base32_map[(uint8_t)src[pos-2]] << 6) & 0xC0; // 2 MSB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-1]] << 1) & 0x3E; // 5  MB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-0]] >> 4) & 0x01; // 1 LSB
-            datlen++;
-            break;
+   totp_key_zeroize(nt_hash,  sizeof(nt_hash));
+   totp_key_zeroize(response, sizeof(response));
 
-         // byte 4
-         case 4:
-            if (src[pos] == '=')
-               return((ssize_t)(*dstlenp = datlen));
-            dst[datlen]  = (base32_map[(uint8_t)src[pos-1]] << 4) & 0xF0; // 4 MSB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-0]] >> 1) & 0x0F; // 4 LSB
-            datlen++;
-            break;
+   return(rc);
+}
 
-         // byte 5;
-         case 5:
-            if (src[pos] == '=')
-               return((ssize_t)(*dstlenp = datlen));
-            break;
 
-         // byte 6
-         case 6:
-            dst[datlen]  = (base32_map[(uint8_t)src[pos-2]] << 7) & 0x80; // 1 MSB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-1]] << 2) & 0x7C; // 5  MB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-0]] >> 3) & 0x03; // 2 LSB
-            datlen++;
-            break;
+//-----------------//
+// store functions //
+//-----------------//
+// MARK: store functions
 
-         // byte 7
-         case 7:
-            if (src[pos] == '=')
-               return((ssize_t)(*dstlenp = datlen));
-            dst[datlen]  = (base32_map[(uint8_t)src[pos-1]] << 5) & 0xE0; // 3 MSB
-            dst[datlen] |= (base32_map[(uint8_t)src[pos-0]] >> 0) & 0x1F; // 5 LSB
-            datlen++;
-            break;
+// readers never wait, the count only delays unmapping a replaced store
+unsigned
+totp_store_acquire(
+         void *                        instance,
+         totp_store_t **               storep )
+{
+   unsigned                idx;
+   rlm_totp_code_t *       inst;
 
-         default:
-            if (src[pos] == '=')
-               return((ssize_t)(*dstlenp = datlen));
-            break;
-      };
-   };
+   rad_assert(instance != NULL);
+   rad_assert(storep   != NULL);
+
+   inst = instance;
+
+   idx = __atomic_load_n(&inst->store_epoch, __ATOMIC_SEQ_CST) & 1;
+   __atomic_fetch_add(&inst->store_readers[idx], 1, __ATOMIC_SEQ_CST);
+   *storep = __atomic_load_n(&inst->store, __ATOMIC_SEQ_CST);
 
-   return((ssize_t)(*dstlenp = datlen));
+   return(idx);
 }
 
 
-ssize_t
-totp_base32_verify(
-         const char *                  src,
-         size_t                        srclen )
+const totp_store_record_t *
+totp_store_find(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params,
+         totp_store_t *                store )
 {
-   size_t      datlen;
-   size_t      pos;
+   size_t                        id_len;
+   uint32_t                      bucket;
+   uint32_t                      slot;
+   const uint8_t *               id;
+   VALUE_PAIR *                  vp;
+   rlm_totp_code_t *             inst;
+   const totp_store_record_t *   rec;
 
-   rad_assert(src != NULL);
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(params   != NULL);
 
-   datlen = 0;
+   inst = instance;
 
-   // verifies encoded data
-   for(pos = 0; (pos < srclen); pos++)
-   {  // verify that data is valid character
-      if (base32_map[(int8_t)src[pos]] == -1)
-         return(RLM_TOTP_CODE_EBASE32);
+   if ( (store == NULL) || (store->header->count == 0) || (inst->vsa_cache_id == NULL) )
+      return(NULL);
 
-      // verify correct use of padding
-      if (src[pos] != '=')
-         continue;
-      datlen = pos;
-      if ((pos % 8) < 2)
-         return(RLM_TOTP_CODE_EBASE32);
-      if ((pos + (8-(pos%8))) != srclen)
-         return(RLM_TOTP_CODE_EBASE32);
-      for(; (pos < srclen); pos++)
-         if (src[pos] != '=')
-            return(RLM_TOTP_CODE_EBASE32);
+   // users are identified by the same value-pair as the cache key
+   if ((vp = totp_request_vp_by_idx(params, RLM_TOTP_VP_CACHE_ID)) == NULL)
+      return(NULL);
+   id = totp_request_vp_data(vp, &id_len);
+
+   // perfect hash selects the only record which may hold the identity
+   bucket   = totp_store_bucket(store->header, id, id_len);
+   slot     = totp_store_slot(store->header, store->seeds[bucket], id, id_len);
+   rec      = &store->records[slot];
+   if ( (rec->id_len != id_len) || ((memcmp(&store->ids[rec->id_offset], id, id_len))) )
+      return(NULL);
+
+   return(rec);
+}
+
+
+void
+totp_store_free(
+         totp_store_t *                store )
+{
+   if (!(store))
+      return;
+   if ((store->map))
+      munmap(store->map, store->map_len);
+   talloc_free(store);
+   return;
+}
+
+
+totp_store_t *
+totp_store_map(
+         const char *                  filename )
+{
+   int                     fd;
+   struct stat             sb;
+   const char *            errmsg;
+   totp_store_t *          store;
+
+   rad_assert(filename != NULL);
+
+   // stores are not allocated from instance, they may be replaced by the store thread
+   if ((store = talloc_zero(NULL, totp_store_t)) == NULL)
+   {  ERROR("totp_code: failed to allocate memory for secret store");
+      return(NULL);
    };
-   if (!(datlen))
-      datlen = pos;
 
-   // verify length of data without padding
-   switch(datlen % 8)
-   {  case 0:
-      case 2:
-      case 4:
-      case 5:
-      case 7:
-         break;
+   // map store read-only, mapping remains valid after descriptor is closed
+   // and private pages are not changed by later writes to the file
+   if ((fd = open(filename, O_RDONLY)) == -1)
+   {  ERROR("totp_code: %s: %s", filename, fr_syserror(errno));
+      talloc_free(store);
+      return(NULL);
+   };
+   if (fstat(fd, &sb) == -1)
+   {  ERROR("totp_code: %s: %s", filename, fr_syserror(errno));
+      close(fd);
+      talloc_free(store);
+      return(NULL);
+   };
+   if (sb.st_size < (off_t)sizeof(totp_store_header_t))
+   {  ERROR("totp_code: %s: secret store is truncated", filename);
+      close(fd);
+      talloc_free(store);
+      return(NULL);
+   };
+   store->dev     = sb.st_dev;
+   store->ino     = sb.st_ino;
+   store->mtime   = sb.st_mtime;
+   store->map_len = (size_t)sb.st_size;
+   if ((store->map = mmap(NULL, store->map_len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {  ERROR("totp_code: %s: %s", filename, fr_syserror(errno));
+      store->map = NULL;
+      close(fd);
+      talloc_free(store);
+      return(NULL);
+   };
 
-      case 1:
-      case 3:
-      case 6:
-      default:
-         return(RLM_TOTP_CODE_EBASE32);
+   // reject file which was truncated or rewritten while being mapped
+   if ( (fstat(fd, &sb) == -1) || (sb.st_size != (off_t)store->map_len) || (sb.st_mtime != store->mtime) )
+   {  ERROR("totp_code: %s: secret store was modified while loading, replace store by rename", filename);
+      close(fd);
+      totp_store_free(store);
+      return(NULL);
    };
+   close(fd);
 
-   return((datlen * 5) / 8);
-}
+   if ((errmsg = totp_store_verify(store)) != NULL)
+   {  ERROR("totp_code: %s: %s", filename, errmsg);
+      totp_store_free(store);
+      return(NULL);
+   };
 
+   return(store);
+}
 
-//-----------------//
-// cache functions //
-//-----------------//
-// MARK: cache functions
 
-void
-totp_cache_cleanup(
-         void *                        instance,
-         totp_params_t *               params )
+int
+totp_store_open(
+         void *                        instance )
 {
-   time_t                  time_cleanup;
    rlm_totp_code_t *       inst;
-   totp_cache_entry_t *    root;
+   totp_store_t *          store;
 
    rad_assert(instance != NULL);
 
-   inst           = instance;
-   root           = inst->cache_list;
+   inst = instance;
 
-   if (!(inst->cache_list))
-      return;
-   if (!(root->next))
-      return;
+   if (inst->store_file == NULL)
+      return(0);
 
-   time_cleanup   = (time_t)(params->totp_time + params->totp_time_offset);
-   time_cleanup  -= (time_t)inst->totp_time_drift;
-   time_cleanup  -= (time_t)(inst->try_prev * inst->totp_x);
+   if ((store = totp_store_map(inst->store_file)) == NULL)
+      return(-1);
+   inst->store             = store;
+   inst->store_generation  = store->header->generation;
+   inst->store_users       = store->header->count;
 
-   while( (root->next != NULL) && (root->next != root) )
-   {  if (root->invalid_until > time_cleanup)
-         return;
-      if (root->failed_expires > time_cleanup)
-         return;
-      rbtree_deletebydata(inst->cache_tree, root->next);
+#ifdef HAVE_PTHREAD_H
+   // watch for replacement of store
+   if (inst->store_watch == false)
+      return(0);
+   if (pipe(inst->store_pipe) == -1)
+   {  ERROR("totp_code: unable to create pipe: %s", fr_syserror(errno));
+      inst->store_pipe[0] = -1;
+      inst->store_pipe[1] = -1;
+      return(-1);
    };
+   if ((errno = pthread_create(&inst->store_thread, NULL, totp_store_watch, instance)) != 0)
+   {  ERROR("totp_code: unable to create thread: %s", fr_syserror(errno));
+      close(inst->store_pipe[0]);
+      close(inst->store_pipe[1]);
+      inst->store_pipe[0] = -1;
+      inst->store_pipe[1] = -1;
+      return(-1);
+   };
+#endif // HAVE_PTHREAD_H
 
-   if (inst->cache_list->prev == inst->cache_list)
-      inst->cache_list->prev = NULL;
-   if (inst->cache_list->next == inst->cache_list)
-      inst->cache_list->next = NULL;
-
-   return;
+   return(0);
 }
 
 
-totp_cache_entry_t *
-totp_cache_entry_alloc(
-         void *                        ctx,
-         const uint8_t *               key,
-         size_t                        key_len,
-         time_t                        expires )
+void
+totp_store_release(
+         void *                        instance,
+         unsigned                      idx )
 {
-   totp_cache_entry_t *    entry;
-
-   rad_assert(key != NULL);
-   rad_assert(key_len > 0);
+   rlm_totp_code_t *       inst;
 
-   if ((entry = talloc_size(ctx, sizeof(totp_cache_entry_t))) == NULL)
-      return(NULL);
-   memset(entry, 0, sizeof(totp_cache_entry_t));
+   rad_assert(instance != NULL);
 
-   if ((entry->key = talloc_size(entry, (key_len+1))) == NULL)
-   {  talloc_free(entry);
-      return(NULL);
-   };
-   memcpy(entry->key, key, key_len);
+   inst = instance;
 
-   entry->key[key_len]  = '\0';
-   entry->keylen        = key_len;
-   entry->invalid_until = expires;
+   __atomic_fetch_sub(&inst->store_readers[idx], 1, __ATOMIC_RELEASE);
 
-   return(entry);
+   return;
 }
 
 
 int
-totp_cache_entry_cmp(
-         const void *                  ptr_a,
-         const void *                  ptr_b )
+totp_store_reload(
+         void *                        instance )
 {
-   int                        rc;
-   size_t                     keylen;
-   const totp_cache_entry_t * entry_a;
-   const totp_cache_entry_t * entry_b;
+   struct stat             sb;
+   rlm_totp_code_t *       inst;
+   totp_store_t *          store;
+   totp_store_t *          prev;
 
-   entry_a  = (const totp_cache_entry_t *)ptr_a;
-   entry_b  = (const totp_cache_entry_t *)ptr_b;
-   keylen   = (entry_a->keylen < entry_b->keylen)
-            ?  entry_a->keylen
-            :  entry_b->keylen;
+   rad_assert(instance != NULL);
 
-   if ((rc = memcmp(entry_a->key, entry_b->key, keylen)) != 0)
-      return(rc);
-   if (entry_a->keylen == entry_b->keylen)
+   inst = instance;
+   prev = __atomic_load_n(&inst->store, __ATOMIC_ACQUIRE);
+
+   // keep current store if file was removed or has not been replaced
+   if (stat(inst->store_file, &sb) == -1)
       return(0);
-   return( (entry_a->keylen < entry_b->keylen) ? -1 : 1 );
+   if ( ((prev)) && (prev->dev == sb.st_dev) && (prev->ino == sb.st_ino) &&
+        (prev->mtime == sb.st_mtime) && (prev->map_len == (size_t)sb.st_size) )
+      return(0);
+
+   // reads of a mapping beyond the end of a truncated file raise SIGBUS
+   if ( ((prev)) && (prev->dev == sb.st_dev) && (prev->ino == sb.st_ino) )
+      WARN("totp_code: %s: secret store was modified in place, replace store by rename", inst->store_file);
+
+   if ((store = totp_store_map(inst->store_file)) == NULL)
+   {  __atomic_fetch_add(&inst->store_errors, 1, __ATOMIC_RELAXED);
+      return(-1);
+   };
+
+   // publish new store, then unmap previous store once its readers finish
+   prev = __atomic_exchange_n(&inst->store, store, __ATOMIC_SEQ_CST);
+   __atomic_store_n(&inst->store_generation, store->header->generation, __ATOMIC_RELAXED);
+   __atomic_store_n(&inst->store_users,      store->header->count,      __ATOMIC_RELAXED);
+   __atomic_fetch_add(&inst->store_reloads,  1,                         __ATOMIC_RELAXED);
+   INFO("totp_code: %s: loaded generation %" PRIu64 " with %" PRIu32 " users",
+        inst->store_file, store->header->generation, store->header->count);
+
+   totp_store_synchronize(instance);
+   totp_store_free(prev);
+
+   return(0);
 }
 
 
+// waits for readers of both epochs, readers which start during the wait
+// count against the other epoch and see the new store
 void
-totp_cache_entry_free(
-         void *                        ptr )
+totp_store_synchronize(
+         void *                        instance )
 {
-   totp_cache_entry_t *        entry;
+   int                     pass;
+   unsigned                idx;
+   rlm_totp_code_t *       inst;
 
-   if (!(ptr))
-      return;
-   entry = ptr;
+   rad_assert(instance != NULL);
 
-   // removes from linked list
-   totp_cache_entry_unlink(entry);
+   inst = instance;
 
-   if ((entry->key))
-      free(entry->key);
-   free(entry);
+   for(pass = 0; (pass < 2); pass++)
+   {  idx = __atomic_fetch_add(&inst->store_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+      while (__atomic_load_n(&inst->store_readers[idx], __ATOMIC_SEQ_CST) != 0)
+         usleep(RLM_TOTP_STORE_WAIT_USEC);
+   };
 
    return;
 }
 
 
-int
-totp_cache_entry_key(
-         void *                        instance,
-         REQUEST *                     request,
-         totp_cache_entry_t *          cache_key,
-         void *                        key_buff,
-         size_t                        key_buff_len )
+// checks every offset once so lookups do not need bounds checks
+const char *
+totp_store_verify(
+         totp_store_t *                store )
+{
+   size_t                        pos;
+   size_t                        idx;
+   uint64_t                      file_len;
+   const totp_store_header_t *   header;
+   const totp_store_record_t *   rec;
+
+   rad_assert(store != NULL);
+
+   header   = (const totp_store_header_t *)store->map;
+   file_len = store->map_len;
+
+   if ((memcmp(header->magic, TOTP_STORE_MAGIC, sizeof(header->magic))))
+      return("file is not a TOTP secret store");
+   if (header->byte_order != TOTP_STORE_BYTE_ORDER)
+      return("secret store was built with a different byte order");
+   if (header->version != TOTP_STORE_VERSION)
+      return("unsupported version of secret store");
+   if (header->file_len != file_len)
+      return("secret store is truncated");
+   if (header->buckets == 0)
+      return("secret store does not contain any buckets");
+
+   // verify sections are aligned and within file
+   if ( ((header->seeds_offset % 8)) || ((header->records_offset % 8)) )
+      return("secret store is corrupt");
+   if ( (header->seeds_offset < sizeof(totp_store_header_t)) || (header->seeds_offset > file_len) ||
+        ((file_len - header->seeds_offset) < ((uint64_t)header->buckets * sizeof(uint32_t))) )
+      return("secret store is corrupt");
+   if ( (header->records_offset > file_len) ||
+        ((file_len - header->records_offset) < ((uint64_t)header->count * sizeof(totp_store_record_t))) )
+      return("secret store is corrupt");
+   if ( (header->ids_offset > file_len) || ((file_len - header->ids_offset) < header->ids_len) )
+      return("secret store is corrupt");
+
+   store->header  = header;
+   store->seeds   = (const uint32_t *)&store->map[header->seeds_offset];
+   store->records = (const totp_store_record_t *)&store->map[header->records_offset];
+   store->ids     = &store->map[header->ids_offset];
+
+   // verify records
+   for(pos = 0; (pos < header->count); pos++)
+   {  rec = &store->records[pos];
+      if ( (rec->id_offset > header->ids_len) || ((header->ids_len - rec->id_offset) < rec->id_len) )
+         return("secret store is corrupt");
+      if ( (rec->key_len < 1) || (rec->key_len > TOTP_STORE_KEY_MAX) )
+         return("secret store contains an invalid key");
+      if ( ((rec->flags & TOTP_STORE_OTP_LENGTH)) && ((rec->otp_length < 1) || (rec->otp_length > 9)) )
+         return("secret store contains an invalid otp_length");
+      if ( ((rec->flags & TOTP_STORE_TIME_STEP)) && (rec->time_step < 1) )
+         return("secret store contains an invalid time_step");
+      if ((rec->flags & TOTP_STORE_ALGORITHM))
+      {  for(idx = 0; ((totp_algorithm_map[idx].name)); idx++)
+            if (totp_algorithm_map[idx].id == (int)rec->algorithm)
+               break;
+         if (!(totp_algorithm_map[idx].name))
+            return("secret store contains an unsupported algorithm");
+      };
+   };
+
+   return(NULL);
+}
+
+
+#ifdef HAVE_PTHREAD_H
+// store is normally replaced by renaming a new file over it, so the directory
+// is watched instead of the file
+void *
+totp_store_watch(
+         void *                        instance )
 {
+   int                     ifd;
+   int                     nfds;
+   int                     timeout;
+   bool                    changed;
+   ssize_t                 len;
+   size_t                  pos;
+   const char *            base;
+   char                    dir[PATH_MAX];
+   struct pollfd           fds[2];
    rlm_totp_code_t *       inst;
-   VALUE_PAIR *            vp;
+#ifdef __linux__
+   const struct inotify_event * event;
+   char                    buff[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+#endif // __linux__
 
    rad_assert(instance != NULL);
 
    inst = instance;
 
-   vp = totp_request_vp_by_dict(instance, request, inst->vsa_cache_id, TOTP_SCOPE_REQUEST);
-   if (vp == NULL)
-      vp = totp_request_vp_by_dict(instance, request, inst->vsa_cache_id, TOTP_SCOPE_CONTROL);
-   if (vp == NULL)
-      vp = totp_request_vp_by_dict(instance, request, inst->vsa_cache_id, TOTP_SCOPE_REPLY);
-   if (vp == NULL)
-   {  REDEBUG("%s is not set, unable to determine TOTP cache key", inst->vsa_cache_id_name);
-      return(-1);
+   // split store file into directory and file name
+   if ((base = strrchr(inst->store_file, '/')) != NULL)
+   {  pos = (size_t)(base - inst->store_file);
+      pos = ((pos)) ? pos : 1;
+      pos = (pos < sizeof(dir)) ? pos : (sizeof(dir) - 1);
+      memcpy(dir, inst->store_file, pos);
+      dir[pos] = '\0';
+      base++;
+   } else
+   {  dir[0] = '.';
+      dir[1] = '\0';
+      base   = inst->store_file;
    };
 
-   // check value-pair used as cache key
-   if (vp->length >= key_buff_len)
-   {  REDEBUG("value of %s exceeds allowed length, unable to determine TOTP cache key", inst->vsa_cache_id_name);
-      return(-1);
+   ifd = -1;
+#ifdef __linux__
+   if ((ifd = inotify_init()) != -1)
+   {  fcntl(ifd, F_SETFL, (fcntl(ifd, F_GETFL) | O_NONBLOCK));
+      if (inotify_add_watch(ifd, dir, (IN_CLOSE_WRITE | IN_MOVED_TO)) == -1)
+      {  close(ifd);
+         ifd = -1;
+      };
    };
+#endif // __linux__
+   if (ifd == -1)
+      WARN("totp_code: %s: unable to watch for changes, checking every %i milliseconds", inst->store_file, RLM_TOTP_STORE_POLL_MSEC);
+
+   fds[0].fd      = inst->store_pipe[0];
+   fds[0].events  = POLLIN;
+   fds[1].fd      = ifd;
+   fds[1].events  = POLLIN;
+   nfds           = (ifd == -1) ? 1 : 2;
+   timeout        = (ifd == -1) ? RLM_TOTP_STORE_POLL_MSEC : -1;
+
+   while(1)
+   {  fds[0].revents = 0;
+      fds[1].revents = 0;
+      if (poll(fds, nfds, timeout) == -1)
+      {  if (errno == EINTR)
+            continue;
+         ERROR("totp_code: %s: %s", inst->store_file, fr_syserror(errno));
+         break;
+      };
 
-   // configure cache key
-   memset(cache_key, 0,       sizeof(totp_cache_entry_t));
-   memset(key_buff, 0,        key_buff_len);
-   memcpy(key_buff, vp->data.octets, vp->length);
-   cache_key->key    = key_buff;
-   cache_key->keylen = vp->length;
-
-   return(0);
-}
+      // instance is being detached
+      if ((fds[0].revents))
+         break;
 
+      // without inotify, the file is checked after each timeout
+      changed = (ifd == -1) ? true : false;
+#ifdef __linux__
+      while ( (ifd != -1) && ((len = read(ifd, buff, sizeof(buff))) > 0) )
+      {  for(pos = 0; (pos < (size_t)len); pos += sizeof(struct inotify_event) + event->len)
+         {  event = (const struct inotify_event *)&buff[pos];
+            if ( ((event->len)) && (!(strcmp(event->name, base))) )
+               changed = true;
+         };
+      };
+#endif // __linux__
 
-void
-totp_cache_entry_unlink(
-         totp_cache_entry_t *          entry )
-{
-   if (entry->prev != NULL)
-      entry->prev->next = entry->next;
-   entry->prev = NULL;
+      if ((changed))
+         totp_store_reload(instance);
+   };
 
-   if (entry->next != NULL)
-      entry->next->prev = entry->prev;
-   entry->next = NULL;
+   if (ifd != -1)
+      close(ifd);
 
-   return;
+   return(NULL);
 }
+#endif // HAVE_PTHREAD_H
 
 
-int
-totp_cache_query(
-         void *                        instance,
-         REQUEST *                     request,
-         totp_params_t *               params,
-         totp_cache_entry_t *          res )
-{
-   int                     rc;
-   uint8_t                 cache_key_buff[MAX_STRING_LEN];
-   rlm_totp_code_t *       inst;
-   totp_cache_entry_t      cache_key;
-   totp_cache_entry_t *    entry;
-
-   rad_assert(instance        != NULL);
-   rad_assert(request         != NULL);
-   rad_assert(res             != NULL);
+//-------------------------//
+// miscellaneous functions //
+//-------------------------//
+// MARK: miscellaneous functions
 
-   inst = instance;
-   memset(res, 0, sizeof(totp_cache_entry_t));
+// scopep holds the default list and is updated by a "list:" prefix
+const DICT_ATTR *
+totp_request_da_by_name(
+         const char *                  attr_str,
+         size_t                        attr_str_len,
+         int *                         scopep )
+{
+   char                    buffer[MAX_STRING_LEN];
+   char *                  attr_scope;
+   char *                  attr_name;
+   const DICT_ATTR *       da;
 
-   if (!(inst->cache_list))
-      return(-1);
+   rad_assert(attr_str        != NULL);
+   rad_assert(scopep          != NULL);
+   rad_assert(attr_str_len    < sizeof(buffer));
+   rad_assert(attr_str_len    > 0);
 
-   // configure cache key
-   rc = totp_cache_entry_key(instance, request, &cache_key, cache_key_buff, sizeof(cache_key_buff));
-   if (rc == -1)
-      return(-1);
+   // initialize variables
+   memcpy(buffer, attr_str, attr_str_len);
+   buffer[attr_str_len] = '\0';
+   attr_scope           = NULL;
+   attr_name            = NULL;
 
-   pthread_mutex_lock(inst->mutex);
+   // split attribute scope and attribute name
+   if ((attr_name = strchr(buffer, ':')) != NULL)
+   {  attr_name[0]   = '\0';
+      attr_name      = &attr_name[1];
+      attr_scope     = buffer;
+   };
+   if (attr_name == NULL)
+      attr_name = buffer;
 
-   // clean up stale entries from cache
-   if ((params))
-      totp_cache_cleanup(instance, params);
+   // retrieve dictionary entry
+   da = dict_attrbyname(attr_name);
+   if (da == NULL)
+      return(NULL);
 
-   // lookup cache entry
-   entry = rbtree_finddata(inst->cache_tree, &cache_key);
-   if (entry != NULL)
-   {  memcpy(res, entry, sizeof(totp_cache_entry_t));
-      res->next = NULL;
-      res->prev = NULL;
+   // set attribute scope
+   if (attr_scope != NULL)
+   {  if (!(strcasecmp(attr_scope, "control")))       *scopep = TOTP_SCOPE_CONTROL;
+      else if (!(strcasecmp(attr_scope, "reply")))    *scopep = TOTP_SCOPE_REPLY;
+      else if (!(strcasecmp(attr_scope, "request")))  *scopep = TOTP_SCOPE_REQUEST;
+      else return(NULL);
    };
 
-   pthread_mutex_unlock(inst->mutex);
-
-   return( (entry == NULL) ? -1 : 0 );
+   return(da);
 }
 
 
+// returns 0 if code was split from User-Password, 1 if not split, and -1 if invalid
 int
-totp_cache_update(
+totp_request_pass_split(
          void *                        instance,
          REQUEST *                     request,
-         totp_params_t *               params,
-         int                           action )
+         totp_params_t *               params )
 {
-   int                     rc;
-   uint8_t                 cache_key_buff[MAX_STRING_LEN];
+   size_t                  pos;
+   size_t                  prefix_len;
+   const char *            password;
+   char                    prefix[MAX_STRING_LEN];
    rlm_totp_code_t *       inst;
-   totp_cache_entry_t      cache_key;
-   totp_cache_entry_t *    result;
-   uint64_t                timestamp;
+   VALUE_PAIR *            vp;
 
    rad_assert(instance != NULL);
    rad_assert(request  != NULL);
@@ -1293,651 +6181,927 @@ totp_cache_update(
 
    inst = instance;
 
-   if (!(inst->cache_list))
+   if (!(inst->split_password))
+      return(1);
+   if ((vp = params->vps[TOTP_SCOPE_REQUEST][RLM_TOTP_VP_USER_PASSWORD]) == NULL)
+      return(1);
+
+   // length of code is taken from resolved parameters, which may be overridden
+   if ( (vp->length < params->otp_length) || (params->otp_length >= sizeof(params->pass_split)) )
+   {  RDEBUG2("User-Password is shorter than TOTP code");
+      return(-1);
+   };
+   if (vp->length >= sizeof(prefix))
+   {  RDEBUG2("User-Password is too long");
       return(-1);
+   };
+   prefix_len  = vp->length - params->otp_length;
+   password    = vp->data.strvalue;
+   for(pos = prefix_len; (pos < vp->length); pos++)
+   {  if ( (password[pos] < '0') || (password[pos] > '9') )
+      {  RDEBUG2("User-Password does not end with TOTP code");
+         return(-1);
+      };
+   };
 
-   // exit if nothing will be cached
-   switch(action)
-   {  case RLM_TOTP_CACHE_EXPIRED:
-         if ((inst->allow_reuse))
-            return(0);
-         break;
+   memcpy(params->pass_split, &password[prefix_len], params->otp_length);
+   params->pass_split[params->otp_length] = '\0';
+   params->pass      = (const uint8_t *)params->pass_split;
+   params->pass_len  = params->otp_length;
 
-      case RLM_TOTP_CACHE_FAILED:
-         if (!(inst->max_attempts))
-            return(0);
-         break;
+   // replace value so pap only sees the static password
+   memcpy(prefix, password, prefix_len);
+   fr_pair_value_bstrncpy(vp, prefix, prefix_len);
+   totp_key_zeroize(prefix, prefix_len);
 
-      default:
-         return(0);
-   };
+   return(0);
+}
 
-   // configure cache key
-   rc = totp_cache_entry_key(instance, request, &cache_key, cache_key_buff, sizeof(cache_key_buff));
-   if (rc == -1)
-      return(-1);
 
-   pthread_mutex_lock(inst->mutex);
+VALUE_PAIR *
+totp_request_vp_by_dict(
+         UNUSED void *                 instance,
+         REQUEST *                     request,
+         const DICT_ATTR *             da,
+         int                           scope )
+{
+   VALUE_PAIR *            vps;
 
-   // clean up stale entries from cache
-   totp_cache_cleanup(instance, params);
+   rad_assert(instance        != NULL);
+   rad_assert(request         != NULL);
 
-   // attempt to retrieve existing entry
-   result = rbtree_finddata(inst->cache_tree, &cache_key);
-   if (result != NULL)
-      totp_cache_entry_unlink(result);
+   if (da == NULL)
+      return(NULL);
 
-   // add new entry to cache if does not already exist
-   if (result == NULL)
-   {  result = totp_cache_entry_alloc(instance, cache_key.key, cache_key.keylen, 0);
-      if (result == NULL)
-      {  REDEBUG2("unable to allocate memory for totp_cache_entry_t");
-         pthread_mutex_unlock(inst->mutex);
-         return(-1);
-      };
-      rbtree_insert(inst->cache_tree, result);
+   switch(scope)
+   {  case TOTP_SCOPE_CONTROL:   vps = request->config;      break;
+      case TOTP_SCOPE_REPLY:     vps = request->reply->vps;  break;
+      case TOTP_SCOPE_REQUEST:   vps = request->packet->vps; break;
+      default:                   vps = request->config;      break;
    };
 
-   // add entry to linked list
-   if (inst->cache_list->prev != NULL)
-   {  inst->cache_list->prev->next  = result;
-      result->prev                  = inst->cache_list->prev;
-   };
-   result->next                     = inst->cache_list;
-   inst->cache_list->prev           = result;
+   return(fr_pair_find_by_num(vps, da->attr, da->vendor, TAG_ANY));
+}
 
-   // update entry
-   switch(action)
-   {  case RLM_TOTP_CACHE_EXPIRED:
-         timestamp                = params->totp_time;
-         timestamp               -= params->totp_t0;
-         timestamp               += params->totp_time_offset;
-         timestamp               += params->totp_time_drift;
-         timestamp               += params->totp_t_drift * params->totp_x;
-         result->invalid_until    = timestamp;
-         result->invalid_until   += params->totp_x;
-         result->invalid_until   -= timestamp % params->totp_x;
-         result->invalid_until   += params->totp_t0;
-         break;
 
-      case RLM_TOTP_CACHE_FAILED:
-         if (result->failed_expires < (params->totp_time + params->totp_time_offset))
-            result->failed_count = 0;
-         timestamp                = params->totp_time;
-         timestamp               -= params->totp_t0;
-         timestamp               += params->totp_time_offset;
-         timestamp               += inst->totp_time_drift;
-         timestamp               += inst->try_next * params->totp_x;
-         result->failed_expires   = timestamp;
-         result->failed_expires  += params->totp_x;
-         result->failed_expires  -= timestamp % params->totp_x;
-         result->failed_expires  += params->totp_t0;
-         result->failed_count++;
-         if (result->failed_count >= inst->max_attempts)
-            result->invalid_until = result->failed_expires;
-         break;
+// returns the first value-pair collected from the request, control, or
+// reply lists, lists which are not matched for an attribute are never set
+VALUE_PAIR *
+totp_request_vp_by_idx(
+         totp_params_t *               params,
+         unsigned                      idx )
+{
+   rad_assert(params != NULL);
+   rad_assert(idx    <  RLM_TOTP_VP_MAX);
+
+   if ((params->vps[TOTP_SCOPE_REQUEST][idx]))
+      return(params->vps[TOTP_SCOPE_REQUEST][idx]);
+   if ((params->vps[TOTP_SCOPE_CONTROL][idx]))
+      return(params->vps[TOTP_SCOPE_CONTROL][idx]);
+   return(params->vps[TOTP_SCOPE_REPLY][idx]);
+}
+
+
+const uint8_t *
+totp_request_vp_data(
+         VALUE_PAIR *                  vp,
+         size_t *                      lenp )
+{
+   rad_assert(vp     != NULL);
+   rad_assert(lenp   != NULL);
+
+   *lenp = vp->length;
+
+   switch(vp->da->type)
+   {  case PW_TYPE_STRING:
+      case PW_TYPE_OCTETS:
+         return(vp->data.octets);
 
       default:
          break;
    };
 
-   pthread_mutex_unlock(inst->mutex);
-
-   return(0);
+   // fixed length types are stored within the value-pair
+   return((const uint8_t *)&vp->data);
 }
 
 
-//---------------------//
-// algorithm functions //
-//---------------------//
-// MARK: algorithm functions
-
-int
-totp_algo_algorithm_id(
-         const char *                  algo_name )
+// collects the first value-pair of each attribute in inst->matches with a
+// single walk of each list, the same value-pairs fr_pair_find_by_num() would
+// return with TAG_ANY
+void
+totp_request_vp_gather(
+         void *                        instance,
+         REQUEST *                     request,
+         totp_params_t *               params )
 {
-   int idx;
-   if (!(strncasecmp(algo_name, "HMAC", 4)))
-      algo_name = &algo_name[4];
-   for(idx = 0; ((totp_algorithm_map[idx].name)); idx++)
-      if (!(strcasecmp(algo_name, totp_algorithm_map[idx].name)))
-         return(totp_algorithm_map[idx].id);
-   return(-1);
+   int                     scope;
+   uint32_t                pos;
+   uint32_t                remaining;
+   VALUE_PAIR *            vp;
+   VALUE_PAIR **           vps;
+   rlm_totp_code_t *       inst;
+   const totp_match_t *    match;
+
+   rad_assert(instance  != NULL);
+   rad_assert(request   != NULL);
+   rad_assert(params    != NULL);
+
+   inst = instance;
+
+   memset(params->vps, 0, sizeof(params->vps));
+
+   for(scope = 0; (scope < TOTP_SCOPES); scope++)
+   {  if ((remaining = inst->matches_len[scope]) == 0)
+         continue;
+
+      switch(scope)
+      {  case TOTP_SCOPE_CONTROL:   vp = request->config;      break;
+         case TOTP_SCOPE_REPLY:     vp = request->reply->vps;  break;
+         default:                   vp = request->packet->vps; break;
+      };
+
+      // stop walking list once every attribute has been found
+      vps = params->vps[scope];
+      for(; ( ((vp)) && ((remaining)) ); vp = vp->next)
+      {  for(pos = 0; (pos < inst->matches_len[scope]); pos++)
+         {  match = &inst->matches[scope][pos];
+            if ( (match->attr != vp->da->attr) || (match->vendor != vp->da->vendor) )
+               continue;
+            if (vps[match->idx] != NULL)
+               continue;
+            vps[match->idx] = vp;
+            remaining--;
+         };
+      };
+   };
+
+   return;
 }
 
 
-const char *
-totp_algo_algorithm_name(
-         int                           algo_id )
+void
+totp_request_vp_match(
+         void *                        instance,
+         const DICT_ATTR *             da,
+         unsigned                      idx,
+         int                           scope )
 {
-   int idx;
-   for(idx = 0; ((totp_algorithm_map[idx].name)); idx++)
-      if (totp_algorithm_map[idx].id == algo_id)
-         return(totp_algorithm_map[idx].name);
-   return("unknown");
+   rlm_totp_code_t *       inst;
+   totp_match_t *          match;
+
+   rad_assert(instance  != NULL);
+   rad_assert(idx       <  RLM_TOTP_VP_MAX);
+   rad_assert(scope     <  TOTP_SCOPES);
+
+   inst = instance;
+
+   if (da == NULL)
+      return;
+
+   rad_assert(inst->matches_len[scope] < RLM_TOTP_VP_MAX);
+
+   match          = &inst->matches[scope][inst->matches_len[scope]++];
+   match->attr    = da->attr;
+   match->vendor  = da->vendor;
+   match->idx     = idx;
+
+   return;
 }
 
 
-int
-totp_algo_calculate(
-         totp_params_t *               params )
+unsigned
+totp_stats_bucket(
+         uint64_t                      nsec )
 {
-   uint8_t        data[8];
-   uint8_t        digest[RLM_TOTP_DIGEST_LENGTH];
-   uint32_t       bin_code;
-   uint64_t       offset;
-   unsigned       digest_len;
-   unsigned       denominator;
-   unsigned       digits;
-   unsigned       otp;
+   unsigned                bucket;
 
-   rad_assert(params != NULL);
+   // floor(log2(nsec)), saturating at the last histogram bucket
+   bucket = ((nsec)) ? (unsigned)(63 - __builtin_clzll(nsec)) : 0;
 
-   if (params->totp_t0 > (params->totp_time + params->totp_time_offset))
-      return(-1);
+   return( (bucket < RLM_TOTP_LOCK_BUCKETS) ? bucket : (RLM_TOTP_LOCK_BUCKETS - 1) );
+}
 
-   // calculate interval count
-   params->totp_t     = params->totp_time - params->totp_t0;
-   params->totp_t    += params->totp_time_offset;
-   params->totp_t    += params->totp_time_drift;
-   params->totp_t    /= params->totp_x;
-   params->totp_t    += params->totp_t_drift;
-   if (params->totp_t < (params->invalid_until / params->totp_x))
-      return(RLM_TOTP_EEXPIRED);
 
-   // copy interval count into data buffer
-   data[0]  = (params->totp_t >> 56) & 0xff;
-   data[1]  = (params->totp_t >> 48) & 0xff;
-   data[2]  = (params->totp_t >> 40) & 0xff;
-   data[3]  = (params->totp_t >> 32) & 0xff;
-   data[4]  = (params->totp_t >> 24) & 0xff;
-   data[5]  = (params->totp_t >> 16) & 0xff;
-   data[6]  = (params->totp_t >>  8) & 0xff;
-   data[7]  =  params->totp_t        & 0xff;
+uint64_t
+totp_stats_nsec( void )
+{
+   struct timespec         ts;
 
-   // calculate HMAC digest
-   totp_algo_hmac((int)params->totp_algo, digest, &digest_len, data, sizeof(data), params->key, params->key_len);
-   if (digest_len == 0)
-      return(-1);
+   if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+      return(0);
 
-   // dynamically truncates hash
-   offset   = digest[digest_len-1] & 0x0f;
-   bin_code =  ((digest[offset+0] & 0x7f) << 24) |
-               ((digest[offset+1] & 0xff) << 16) |
-               ((digest[offset+2] & 0xff) <<  8) |
-                (digest[offset+3] & 0xff);
+   return( ((uint64_t)ts.tv_sec * 1000000000) + (uint64_t)ts.tv_nsec );
+}
 
-   // truncates code to specific decimal digits
-   for(denominator = 1, digits = (unsigned)params->otp_length; (digits > 0); digits--)
-      denominator *= 10;
 
-   otp = bin_code % denominator;
+void
+totp_stats_update_max(
+         uint64_t *                    valp,
+         uint64_t                      val )
+{
+   uint64_t                cur;
 
-   snprintf(params->otp, sizeof(params->otp), "%0*u", (int)params->otp_length, otp);
+   cur = __atomic_load_n(valp, __ATOMIC_RELAXED);
+   while (val > cur)
+      if ((__atomic_compare_exchange_n(valp, &cur, val, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+         break;
 
-   return(otp);
+   return;
 }
 
 
-void
-totp_algo_debug(
+//----------------//
+// xlat functions //
+//----------------//
+// MARK: xlat functions
+
+// returns the parsed attribute reference of fmt, or NULL if fmt has not
+// been parsed or does not reference an attribute
+const totp_xlat_attr_t *
+totp_xlat_attr_query(
          void *                        instance,
-         REQUEST *                     request,
-         totp_params_t *               params )
+         const char *                  fmt )
 {
-	rlm_totp_code_t *       inst;
+   size_t                  len;
+   uint32_t                hash;
+   uint32_t                probe;
+   uint32_t                state;
+   rlm_totp_code_t *       inst;
+   totp_xlat_attr_t *      xattr;
 
    rad_assert(instance != NULL);
-   rad_assert(params   != NULL);
+   rad_assert(fmt      != NULL);
 
    inst = instance;
 
-   if (!(inst->devel_debug))
-      return;
-
-   RDEBUG("rlm_totp_code: totp_algo:            %s\n",  totp_algo_algorithm_name((int)params->totp_algo));
-   RDEBUG("rlm_totp_code: totp_time:            %u\n",  (unsigned)params->totp_time);
-   RDEBUG("rlm_totp_code: totp_time_offset:     %i\n",  (int)params->totp_time_offset);
-   RDEBUG("rlm_totp_code: totp_time_drift:      %i\n",  (int)params->totp_time_drift);
-   RDEBUG("rlm_totp_code: totp_time_adjusted:   %i\n",  ((int)params->totp_time +  (int)params->totp_time_offset + (int)params->totp_time_drift));
-   RDEBUG("rlm_totp_code: totp_t0:              %u\n",  (unsigned)params->totp_t0);
-   RDEBUG("rlm_totp_code: totp_x:               %u\n",  (unsigned)params->totp_x);
-   RDEBUG("rlm_totp_code: totp_t:               %u\n",  (unsigned)params->totp_t);
-   RDEBUG("rlm_totp_code: totp_t_drift:         %i\n",  (int)params->totp_t_drift);
-   RDEBUG("rlm_totp_code: totp_t_adjusted:      %i\n",  ((int)params->totp_t + (int)params->totp_t_drift));
-   RDEBUG("rlm_totp_code: key:                  <binary>\n");
-   RDEBUG("rlm_totp_code: key_len:              %u\n",  (unsigned)params->key_len);
-   RDEBUG("rlm_totp_code: result:               %s\n",  params->otp);
-   RDEBUG("rlm_totp_code: result_len:           %u\n",  (unsigned)params->otp_length);
+   if ((len = strlen(fmt)) >= RLM_TOTP_XLAT_FMT_MAX)
+      return(NULL);
+   hash = fr_hash(fmt, len);
+
+   for(probe = 0; (probe < RLM_TOTP_XLAT_ATTRS); probe++)
+   {  xattr = &inst->xlat_attrs[(hash + probe) & (RLM_TOTP_XLAT_ATTRS - 1)];
+      state = __atomic_load_n(&xattr->state, __ATOMIC_ACQUIRE);
+      if (state == RLM_TOTP_XLAT_EMPTY)
+         return(NULL);
+      if (state != RLM_TOTP_XLAT_READY)
+         continue;
+      if ( (xattr->hash == hash) && (xattr->fmt_len == len) && (!(memcmp(xattr->fmt, fmt, len))) )
+         return(xattr);
+   };
 
-   return;
+   return(NULL);
 }
 
 
+// entries are claimed with a compare-and-swap and published once filled,
+// fmt is not cached if the table is full
 void
-totp_algo_hmac(
-         UNUSED int                    totp_algo,
-         uint8_t *                     digest,
-         unsigned *                    digest_lenp,
-         const uint8_t *               data,
-         size_t                        data_len,
-         const uint8_t *               key,
-         size_t                        key_len )
+totp_xlat_attr_update(
+         void *                        instance,
+         const char *                  fmt,
+         const DICT_ATTR *             da,
+         int                           scope )
 {
-#ifdef HAVE_OPENSSL_EVP_H
-   unsigned char           md[RLM_TOTP_DIGEST_LENGTH];
-   unsigned                md_len;
-   const EVP_MD *          evp_md;
-   uint8_t  *              hmac_result;
-#endif // HAVE_OPENSSL_EVP_H
+   size_t                  len;
+   uint32_t                hash;
+   uint32_t                probe;
+   uint32_t                state;
+   rlm_totp_code_t *       inst;
+   totp_xlat_attr_t *      xattr;
 
-   rad_assert(digest       != NULL);
-   rad_assert(data         != NULL);
-   rad_assert(data_len     >= 0);
-   rad_assert(key          != NULL);
-   rad_assert(key_len      >= 0);
+   rad_assert(instance != NULL);
+   rad_assert(fmt      != NULL);
+   rad_assert(da       != NULL);
 
-   memset(digest, 0, sizeof(RLM_TOTP_DIGEST_LENGTH));
-   *digest_lenp = 0;
+   inst = instance;
 
-#ifndef HAVE_OPENSSL_EVP_H
-   if (totp_algo == RLM_TOTP_HMAC_SHA1)
-   {  fr_hmac_sha1(digest, data, data_len, key, key_len);
-      *digest_lenp = SHA1_DIGEST_LENGTH;
-   };
-#endif // !HAVE_OPENSSL_EVP_H
+   if ((len = strlen(fmt)) >= RLM_TOTP_XLAT_FMT_MAX)
+      return;
+   hash = fr_hash(fmt, len);
+
+   for(probe = 0; (probe < RLM_TOTP_XLAT_ATTRS); probe++)
+   {  xattr = &inst->xlat_attrs[(hash + probe) & (RLM_TOTP_XLAT_ATTRS - 1)];
+      state = RLM_TOTP_XLAT_EMPTY;
+      if ((__atomic_compare_exchange_n(&xattr->state, &state, RLM_TOTP_XLAT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)))
+      {  xattr->hash    = hash;
+         xattr->fmt_len = (uint32_t)len;
+         xattr->scope   = scope;
+         xattr->da      = da;
+         memcpy(xattr->fmt, fmt, len);
+         xattr->fmt[len] = '\0';
+         __atomic_store_n(&xattr->state, RLM_TOTP_XLAT_READY, __ATOMIC_RELEASE);
+         return;
+      };
 
-#ifdef HAVE_OPENSSL_EVP_H
-   md_len      = RLM_TOTP_DIGEST_LENGTH;
-   switch(totp_algo)
-   {  case RLM_TOTP_HMAC_SHA1:   evp_md = EVP_sha1();    break;
-      case RLM_TOTP_HMAC_SHA224: evp_md = EVP_sha224();  break;
-      case RLM_TOTP_HMAC_SHA256: evp_md = EVP_sha256();  break;
-      case RLM_TOTP_HMAC_SHA384: evp_md = EVP_sha384();  break;
-      case RLM_TOTP_HMAC_SHA512: evp_md = EVP_sha512();  break;
-      default: return;
+      // another thread cached fmt first
+      if ( (state == RLM_TOTP_XLAT_READY) && (xattr->hash == hash) && (xattr->fmt_len == len) && (!(memcmp(xattr->fmt, fmt, len))) )
+         return;
    };
-   hmac_result = (uint8_t *)HMAC(evp_md, key, (int)key_len, (unsigned char *)data, data_len, md, &md_len);
-   memcpy(digest, hmac_result, md_len);
-   *digest_lenp = md_len;
-#endif // HAVE_OPENSSL_EVP_H
 
    return;
 }
 
 
-int
-totp_algo_params(
+ssize_t
+totp_xlat_cache(
          void *                        instance,
          REQUEST *                     request,
-         totp_params_t *               params )
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen )
 {
-   VALUE_PAIR *            vp;
+   size_t                  pos;
+   size_t                  len;
+   uint32_t                count;
    rlm_totp_code_t *       inst;
-   uint64_t                totp_algo;
-   totp_cache_entry_t      cache_entry;
+   totp_cache_t *          cache;
+   totp_cache_entry_t      cache_key;
+   totp_cache_entry_t *    entry;
+   totp_params_t           params;
 
-   rad_assert(instance  != NULL);
-   rad_assert(request   != NULL);
-   rad_assert(params    != NULL);
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
 
-   inst = instance;
+   inst  = instance;
+   cache = inst->cache;
+   *out  = '\0';
 
-   // set initial values from module instance
-   memset(params, 0, sizeof(totp_params_t));
-   params->totp_t0            = inst->totp_t0;
-   params->totp_x             = inst->totp_x;
-   params->totp_time          = time(NULL);
-   params->totp_time_offset   = inst->totp_time_offset;
-   params->totp_algo          = inst->totp_algo;
-   params->otp_length         = inst->otp_length;
+   if (!(cache))
+      return(-1);
 
-   if (inst->allow_override == false)
-      return(0);
+   // skip leading white space
+   while (isspace((uint8_t) *fmt))
+      fmt++;
 
-   totp_algo_params_signed(instance, request, inst->vsa_time_offset, &params->totp_time_offset);
-   totp_algo_params_integer(instance, request, inst->vsa_unix_time,  &params->totp_t0);
-   totp_algo_params_integer(instance, request, inst->vsa_time_step,  &params->totp_x);
-   totp_algo_params_integer(instance, request, inst->vsa_otp_length, &params->otp_length);
+   // split command from identity, identity is the remainder of the string
+   for(pos = 0; ( (!(isspace((uint8_t)fmt[pos]))) && (fmt[pos] != '\0') ); pos++);
+   len = pos;
+   while (isspace((uint8_t)fmt[pos]))
+      pos++;
+   memset(&cache_key, 0, sizeof(cache_key));
+   cache_key.key     = (uint8_t *)&fmt[pos];
+   cache_key.keylen  = strlen(&fmt[pos]);
+   while ( ((cache_key.keylen)) && ((isspace(cache_key.key[cache_key.keylen-1]))) )
+      cache_key.keylen--;
+   cache_key.hash    = fr_hash(cache_key.key, cache_key.keylen);
+
+   // commands which apply to the entire cache
+   if ( (len == 4) && (!(strncasecmp(fmt, "size", len))) )
+   {  totp_cache_lock(instance, RLM_TOTP_LOCK_ADMIN);
+      count = rbtree_num_elements(cache->tree);
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      len = snprintf(out, outlen, "name=%s entries=%u filter=%u sketch=%ux%u retain=%ld refs=%u",
+         cache->name, count, cache->filter_size, cache->sketch_width, cache->sketch_depth,
+         (long)cache->retain, cache->refs);
+      if (len >= outlen)
+      {  REDEBUG("Insufficient space to write TOTP cache size");
+         *out = '\0';
+         return(-1);
+      };
+      return(len);
+   };
+   if ( (len == 4) && (!(strncasecmp(fmt, "trim", len))) )
+   {  memset(&params, 0, sizeof(params));
+      params.totp_time        = (uint64_t)time(NULL);
+      params.totp_time_offset = inst->totp_time_offset;
+      totp_cache_lock(instance, RLM_TOTP_LOCK_ADMIN);
+      count  = rbtree_num_elements(cache->tree);
+      totp_cache_cleanup(instance, &params);
+      count -= rbtree_num_elements(cache->tree);
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      RDEBUG2("removed %u expired entries from TOTP cache '%s'", count, cache->name);
+      return(snprintf(out, outlen, "%u", count));
+   };
+
+   // remaining commands apply to a single identity
+   if (!(cache_key.keylen))
+   {  REDEBUG("Invalid arguments passed to %s_cache xlat", inst->name);
+      return(-1);
+   };
 
-   if (inst->vsa_algorithm != NULL)
-   {  vp = totp_request_vp_by_dict(instance, request, inst->vsa_algorithm, TOTP_SCOPE_CONTROL);
-      if ( (vp != NULL) && (vp->da->type == PW_TYPE_STRING) )
-      {  totp_algo = totp_algo_algorithm_id(vp->data.strvalue);
-         if (totp_algo != 0)
-            params->totp_algo = totp_algo;
+   totp_cache_lock(instance, RLM_TOTP_LOCK_ADMIN);
+   entry = rbtree_finddata(cache->tree, &cache_key);
+
+   if ( (len == 4) && (!(strncasecmp(fmt, "show", len))) )
+   {  if (entry == NULL)
+      {  totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+         return(0);
+      };
+      len = snprintf(out, outlen, "failed_count=%zu failed_expires=%ld invalid_until=%ld used_expires=%ld used_step=%" PRIu64 " used_map=0x%016" PRIx64,
+         entry->failed_count, (long)entry->failed_expires, (long)entry->invalid_until,
+         (long)entry->used_expires, entry->used_step, entry->used_map);
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      if (len >= outlen)
+      {  REDEBUG("Insufficient space to write TOTP cache entry");
+         *out = '\0';
+         return(-1);
       };
+      return(len);
    };
 
-   totp_cache_query(instance, request, params, &cache_entry);
-   params->invalid_until = (uint64_t)cache_entry.invalid_until;
+   if ( (len == 6) && (!(strncasecmp(fmt, "unlock", len))) )
+   {  if (entry != NULL)
+      {  entry->failed_count     = 0;
+         entry->failed_expires   = 0;
+         entry->invalid_until    = 0;
+         RDEBUG2("unlocked '%.*s' in TOTP cache '%s'", (int)cache_key.keylen, cache_key.key, cache->name);
+      };
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      return(snprintf(out, outlen, "%u", ((entry)) ? 1 : 0));
+   };
 
-   return(0);
+   if ( (len == 6) && (!(strncasecmp(fmt, "expire", len))) )
+   {  if (entry != NULL)
+      {  totp_cache_filter_del(cache, entry);
+         rbtree_deletebydata(cache->tree, entry);
+         totp_stats_add(cache, evictions, 1);
+         RDEBUG2("expired '%.*s' from TOTP cache '%s'", (int)cache_key.keylen, cache_key.key, cache->name);
+      };
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      return(snprintf(out, outlen, "%u", ((entry)) ? 1 : 0));
+   };
+
+   totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+
+   REDEBUG("Unknown command passed to %s_cache xlat", inst->name);
+
+   return(-1);
 }
 
 
-int
-totp_algo_params_integer(
+ssize_t
+totp_xlat_code(
          void *                        instance,
          REQUEST *                     request,
-         const DICT_ATTR *             da,
-         uint64_t *                    uintp )
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen )
 {
-   VALUE_PAIR *         vp;
-   unsigned long long   ulongval;
-   char *               endptr;
+   ssize_t                 rc;
+   totp_secure_t *         secure;
+   totp_secure_t           secure_buff;
 
-   rad_assert(instance  != NULL);
-   rad_assert(request   != NULL);
-   rad_assert(uintp     != NULL);
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
 
-   if (da == NULL)
-      return(0);
+   // key material is kept in the arena, or on the stack if it is exhausted
+   secure = totp_arena_alloc(instance, &secure_buff);
+   rc     = totp_xlat_code_generate(instance, request, fmt, out, outlen, secure);
+   totp_arena_free(instance, secure);
 
-   vp = totp_request_vp_by_dict(instance, request, da, TOTP_SCOPE_CONTROL);
-   if (vp == NULL)
-      return(0);
+   return(rc);
+}
 
-   switch(vp->da->type)
-   {  case PW_TYPE_INTEGER:
-         *uintp = (uint64_t)vp->data.integer;
-         break;
 
-      case PW_TYPE_INTEGER64:
-         *uintp = (uint64_t)vp->data.integer64;
-         break;
+ssize_t
+totp_xlat_code_generate(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen,
+         totp_secure_t *               secure )
+{
+   int                     code;
+   totp_params_t           params;
 
-      case PW_TYPE_SHORT:
-         *uintp = (uint64_t)vp->data.ushort;
-         break;
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
+   rad_assert(secure   != NULL);
 
-      case PW_TYPE_SIGNED:
-         *uintp = (uint64_t)vp->data.sinteger;
-         break;
+   if (totp_xlat_params(instance, request, fmt, &params, secure) != 0)
+   {  *out = '\0';
+      return(-1);
+   };
 
-      case PW_TYPE_STRING:
-         ulongval = strtoull(vp->data.strvalue, &endptr, 10);
-         if ( (vp->data.strvalue == endptr) || (endptr[0] != '\0') )
-            return(-1);
-         *uintp = (uint64_t)ulongval;
-         break;
+   code = totp_algo_calculate(&params);
+   totp_algo_debug(instance, request, &params);
+   if (code < 0)
+   {  if (code == RLM_TOTP_EEXPIRED)
+         RDEBUG2("TOTP is locked out due to reuse or too many attempts");
+      *out = '\0';
+      return(-1);
+   };
 
-      default:
-         return(-1);
+   if ((size_t)snprintf(out, outlen, "%s" , params.otp) >= outlen)
+   {  REDEBUG("Insufficient space to write TOTP code");
+      *out = '\0';
+      return(-1);
    };
 
    return(0);
 }
 
 
+// determines TOTP parameters and key from xlat arguments, previously used
+// codes and failed attempts are retrieved from the cache
 int
-totp_algo_params_signed(
+totp_xlat_params(
          void *                        instance,
          REQUEST *                     request,
-         const DICT_ATTR *             da,
-         int64_t *                     intp )
+         char const *                  fmt,
+         totp_params_t *               params,
+         totp_secure_t *               secure )
 {
-   VALUE_PAIR *         vp;
-   unsigned long long   longval;
-   char *               endptr;
-
-   rad_assert(instance  != NULL);
-   rad_assert(request   != NULL);
-   rad_assert(intp      != NULL);
-
-   if (da == NULL)
-      return(0);
+   int                     rc;
+   int                     scope;
+   bool                    attr_ref;
+   size_t                  pos;
+   ssize_t                 secret_len;
+   ssize_t                 len;
+   size_t                  key_len;
+   const uint8_t *         key;
+   const char *            args;
+   const char *            secret;
+   char                    attr_str[MAX_STRING_LEN];
+   VALUE_PAIR *            vp;
+   const DICT_ATTR *       da;
+   rlm_totp_code_t *       inst;
+   totp_cache_entry_t      cache_entry;
+   const totp_xlat_attr_t * xattr;
 
-   vp = totp_request_vp_by_dict(instance, request, da, TOTP_SCOPE_CONTROL);
-   if (vp == NULL)
-      return(0);
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
+   rad_assert(params   != NULL);
+   rad_assert(secure   != NULL);
+
+   inst        = instance;
+   key         = NULL;
+   key_len     = 0;
+   secret      = NULL;
+   secret_len  = 0;
+   da          = NULL;
+   scope       = TOTP_SCOPE_CONTROL;
+   attr_ref    = false;
+   attr_str[0] = '\0';
 
-   switch(vp->da->type)
-   {  case PW_TYPE_INTEGER:
-         *intp = (int64_t)vp->data.integer;
-         break;
+   // determine TOTP parameters
+   if ((rc = totp_algo_params(instance, request, params, secure->store_key)) != 0)
+      return(-1);
 
-      case PW_TYPE_INTEGER64:
-         *intp = (int64_t)vp->data.integer64;
-         break;
+   // attribute references are parsed once for each distinct fmt
+   if ((xattr = totp_xlat_attr_query(instance, fmt)) != NULL)
+   {  da       = xattr->da;
+      scope    = xattr->scope;
+      attr_ref = true;
+   } else
+   {  // skip leading white space
+      args = fmt;
+      while (isspace((uint8_t) *args))
+         args++;
+
+      // scanning for end of encoded secret or attribute name
+      for(pos = 0; ( (!(isspace(args[pos]))) && (args[pos] != '\0') ); pos++);
+      secret     = args;
+      secret_len = pos;
+
+      // scanning for end of line
+      args = ((args[pos])) ? &args[pos+1] : &args[pos];
+      for(pos = 0; ( (!(isspace(args[pos]))) && (args[pos] != '\0') ); pos++);
+      if (args[pos] != '\0')
+      {  REDEBUG("Invalid arguments passed to totp_code xlat");
+         return(-1);
+      };
 
-      case PW_TYPE_SHORT:
-         *intp = (int64_t)vp->data.ushort;
-         break;
+      // check for attribute reference instead of string
+      if (secret[0] == '&')
+      {  if (secret_len > (MAX_STRING_LEN-1))
+         {  REDEBUG("Unable to parse attribute in totp_code xlat");
+            return(-1);
+         };
+         memcpy(attr_str, &secret[1], secret_len-1);
+         attr_str[secret_len-1] = '\0';
+         attr_ref               = true;
+         if ((da = totp_request_da_by_name(attr_str, (secret_len-1), &scope)) != NULL)
+            totp_xlat_attr_update(instance, fmt, da, scope);
+      };
+   };
 
-      case PW_TYPE_SIGNED:
-         *intp = (int64_t)vp->data.sinteger;
-         break;
+   if ((attr_ref))
+   {  // retrieve specified value pair
+      vp = totp_request_vp_by_dict(instance, request, da, scope);
+      if ( (!(vp)) && (!(params->key)) )
+      {  REDEBUG("referenced attribute '%s' is not set", ((da)) ? da->name : attr_str);
+         return(-1);
+      };
 
-      case PW_TYPE_STRING:
-         longval = strtoll(vp->data.strvalue, &endptr, 10);
-         if ( (vp->data.strvalue == endptr) || (endptr[0] != '\0') )
+      // users in local secret store do not require the attribute
+      if (!(vp))
+      {  key      = params->key;
+         key_len  = params->key_len;
+      } else if (vp->da == inst->vsa_encrypted_key)
+      {  if ((len = totp_key_decrypt(instance, request, vp->data.octets, vp->length, secure->key, sizeof(secure->key))) < 0)
             return(-1);
-         *intp = (int64_t)longval;
-         break;
+         key      = secure->key;
+         key_len  = (size_t)len;
+      } else
+      {  switch(vp->da->type)
+         {  case PW_TYPE_STRING:
+               secret     = vp->data.strvalue;
+               secret_len = vp->length;
+               break;
+
+            case PW_TYPE_OCTETS:
+               key      = vp->data.octets;
+               key_len  = vp->length;
+               break;
+
+            default:
+               REDEBUG("%s is not a string or octets", vp->da->name);
+               return(-1);
+         };
+      };
+   };
 
-      default:
+   // decode encoded secret
+   if (!(key))
+   {  if ((len = totp_key_decode(instance, request, secret, secret_len, secure->key, sizeof(secure->key))) < 0)
          return(-1);
+      key      = secure->key;
+      key_len  = (size_t)len;
    };
 
+   params->key     = key;
+   params->key_len = key_len;
+
+   // retrieve previously used codes and failed attempts from cache
+   totp_cache_query(instance, request, params, &cache_entry);
+   params->invalid_until = (uint64_t)cache_entry.invalid_until;
+   params->used_step     = cache_entry.used_step;
+   params->used_map      = cache_entry.used_map;
+
    return(0);
 }
 
 
-//-------------------------//
-// miscellaneous functions //
-//-------------------------//
-// MARK: miscellaneous functions
-
-VALUE_PAIR *
-totp_request_vp_by_dict(
-         UNUSED void *                 instance,
-         REQUEST *                     request,
-         const DICT_ATTR *             da,
-         int                           scope )
+int
+totp_xlat_register(
+         void *                        instance,
+         CONF_SECTION *                conf )
 {
-   VALUE_PAIR *            vps;
-
-   rad_assert(instance        != NULL);
-   rad_assert(request         != NULL);
-
-   if (da == NULL)
-      return(NULL);
-
-   switch(scope)
-   {  case TOTP_SCOPE_CONTROL:   vps = request->config;      break;
-      case TOTP_SCOPE_REPLY:     vps = request->reply->vps;  break;
-      case TOTP_SCOPE_REQUEST:   vps = request->packet->vps; break;
-      default:                   vps = request->config;      break;
-   };
-
-   return(fr_pair_find_by_num(vps, da->attr, da->vendor, TAG_ANY));
-}
+   char                    name[MAX_STRING_LEN];
+   rlm_totp_code_t *       inst;
 
+   rad_assert(instance != NULL);
+   rad_assert(conf     != NULL);
 
-VALUE_PAIR *
-totp_request_vp_by_name(
-         UNUSED void *                 instance,
-         REQUEST *                     request,
-         const char *                  attr_str,
-         size_t                        attr_str_len,
-         int                           default_scope )
-{
-   char                    buffer[MAX_STRING_LEN];
-   char *                  attr_scope;
-   char *                  attr_name;
-   const DICT_ATTR *       da;
+   inst = instance;
 
-   rad_assert(instance        != NULL);
-   rad_assert(request         != NULL);
-   rad_assert(attr_str        != NULL);
-   rad_assert(attr_str_len    < sizeof(buffer));
-   rad_assert(attr_str_len    > 0);
+   if ((inst->name = cf_section_name2(conf)) == NULL)
+      inst->name = cf_section_name1(conf);
 
-   // initialize variables
-   memcpy(buffer, attr_str, attr_str_len);
-   buffer[attr_str_len] = '\0';
-   attr_scope           = NULL;
-   attr_name            = NULL;
+   // register xlat:totp_code
+   if (xlat_register(inst->name, totp_xlat_code, NULL, inst) != 0)
+   {  ERROR("totp_code: failed to register xlat:%s", inst->name);
+      return(-1);
+   };
 
-   // split attribute scope and attribute name
-   if ((attr_name = strchr(buffer, ':')) != NULL)
-   {  attr_name[0]   = '\0';
-      attr_name      = &attr_name[1];
-      attr_scope     = buffer;
+   // register xlat for cache maintenance
+   snprintf(name, sizeof(name), "%s_cache", inst->name);
+   if (xlat_register(name, totp_xlat_cache, NULL, inst) != 0)
+   {  ERROR("totp_code: failed to register xlat:%s", name);
+      return(-1);
    };
-   if (attr_name == NULL)
-      attr_name = buffer;
 
-   // retrieve dictionary entry
-   da = dict_attrbyname(attr_name);
-   if (da == NULL)
-      return(NULL);
+   // register xlat for cache statistics
+   snprintf(name, sizeof(name), "%s_stats", inst->name);
+   if (xlat_register(name, totp_xlat_stats, NULL, inst) != 0)
+   {  ERROR("totp_code: failed to register xlat:%s", name);
+      return(-1);
+   };
 
-   // set attribute scope
-   if (attr_scope != NULL)
-   {  if (!(strcasecmp(attr_scope, "control")))       default_scope = TOTP_SCOPE_CONTROL;
-      else if (!(strcasecmp(attr_scope, "reply")))    default_scope = TOTP_SCOPE_REPLY;
-      else if (!(strcasecmp(attr_scope, "request")))  default_scope = TOTP_SCOPE_REQUEST;
-      else return(NULL);
+   // register xlat for candidate codes of challenge based protocols
+   snprintf(name, sizeof(name), "%s_window", inst->name);
+   if (xlat_register(name, totp_xlat_window, NULL, inst) != 0)
+   {  ERROR("totp_code: failed to register xlat:%s", name);
+      return(-1);
    };
 
-   return(totp_request_vp_by_dict(instance, request, da, default_scope));
+   return(0);
 }
 
 
-//----------------//
-// xlat functions //
-//----------------//
-// MARK: xlat functions
-
 ssize_t
-totp_xlat_code(
-         UNUSED void *                 instance,
+totp_xlat_stats(
+         void *                        instance,
          REQUEST *                     request,
          char const *                  fmt,
          char *                        out,
          size_t                        outlen )
 {
-   int                     rc;
-   int                     code;
+   int                     site;
+   size_t                  idx;
+   size_t                  len;
    size_t                  pos;
-   ssize_t                 base32_len;
-   size_t                  key_len;
-   uint8_t *               key;
-   const char *            base32;
-   char                    attr_str[MAX_STRING_LEN];
-   VALUE_PAIR *            vp;
-   totp_params_t           params;
+   uint64_t                val;
+   uint64_t *              hist;
+   rlm_totp_code_t *       inst;
+   totp_cache_t *          cache;
+   totp_lock_stats_t *     locks;
 
    rad_assert(instance != NULL);
    rad_assert(request  != NULL);
    rad_assert(fmt      != NULL);
 
-   key      = NULL;
-   key_len  = 0;
+   inst  = instance;
+   cache = inst->cache;
+   *out  = '\0';
 
-   // determine TOTP parameters
-   if ((rc = totp_algo_params(instance, request, &params)) != 0)
-   {  *out = '\0';
+   if (!(cache))
       return(-1);
-   };
 
    // skip leading white space
    while (isspace((uint8_t) *fmt))
       fmt++;
-
-   // scanning for end of base32 encoded secret or attribute name
-   for(pos = 0; ( (!(isspace(fmt[pos]))) && (fmt[pos] != '\0') ); pos++);
-   base32     = fmt;
-   base32_len = pos;
-
-   // scanning for end of line
-   fmt = &fmt[pos+1];
-   for(pos = 0; ( (!(isspace(fmt[pos]))) && (fmt[pos] != '\0') ); pos++);
-   if (fmt[pos] != '\0')
-   {  REDEBUG("Invalid arguments passed to totp_code xlat");
-      *out = '\0';
-      return(-1);
+   for(len = 0; ( (!(isspace((uint8_t)fmt[len]))) && (fmt[len] != '\0') ); len++);
+
+   // number of entries requires the lock
+   if ( (len == 7) && (!(strncasecmp(fmt, "entries", len))) )
+   {  totp_cache_lock(instance, RLM_TOTP_LOCK_ADMIN);
+      val = rbtree_num_elements(cache->tree);
+      totp_cache_unlock(instance, RLM_TOTP_LOCK_ADMIN);
+      return(snprintf(out, outlen, "%" PRIu64, val));
    };
 
-   // check for attribute reference instead of string
-   if (base32[0] == '&')
-   {  if (base32_len > (MAX_STRING_LEN-1))
-      {  REDEBUG("Unable to parse attribute in totp_code xlat");
+   // all counters as space separated name=value pairs
+   if ( (len == 3) && (!(strncasecmp(fmt, "all", len))) )
+   {  for(idx = 0, pos = 0; ( ((totp_stats_map[idx].name)) && (pos < outlen) ); idx++)
+      {  val  = __atomic_load_n((uint64_t *)((uint8_t *)&cache->stats + totp_stats_map[idx].offset), __ATOMIC_RELAXED);
+         pos += snprintf(&out[pos], (outlen - pos), "%s%s=%" PRIu64, ((pos)) ? " " : "", totp_stats_map[idx].name, val);
+      };
+      if (pos >= outlen)
+      {  REDEBUG("Insufficient space to write TOTP cache statistics");
          *out = '\0';
          return(-1);
       };
-      memcpy(attr_str, &base32[1], base32_len-1);
-      attr_str[base32_len-1] = '\0';
+      return(pos);
+   };
 
-      // retrieve specified value pair
-      vp = totp_request_vp_by_name(instance, request, attr_str, (base32_len-1), TOTP_SCOPE_CONTROL);
-      if (!(vp))
-      {  REDEBUG("referenced attribute '%s' is not set", attr_str);
-         *out = '\0';
+   // lock statistics are requested as lock.<site>.<counter>
+   if ( (len > 5) && (!(strncasecmp(fmt, "lock.", 5))) )
+   {  for(site = 0; (site < RLM_TOTP_LOCK_SITES); site++)
+      {  pos = strlen(totp_lock_sites[site]);
+         if ( ((pos + 6) < len) && (!(strncasecmp(&fmt[5], totp_lock_sites[site], pos))) && (fmt[pos+5] == '.') )
+            break;
+      };
+      if (site == RLM_TOTP_LOCK_SITES)
+      {  REDEBUG("Unknown lock site in '%.*s' passed to %s_stats xlat", (int)len, fmt, inst->name);
+         return(-1);
+      };
+      locks  = &cache->locks[site];
+      fmt   += pos + 6;
+      len   -= pos + 6;
+      hist   = NULL;
+      if      ( (len ==  8) && (!(strncasecmp(fmt, "acquired",   len))) ) val  = __atomic_load_n(&locks->acquired,  __ATOMIC_RELAXED);
+      else if ( (len ==  9) && (!(strncasecmp(fmt, "contended",  len))) ) val  = __atomic_load_n(&locks->contended, __ATOMIC_RELAXED);
+      else if ( (len ==  9) && (!(strncasecmp(fmt, "wait_nsec",  len))) ) val  = __atomic_load_n(&locks->wait_nsec, __ATOMIC_RELAXED);
+      else if ( (len ==  9) && (!(strncasecmp(fmt, "hold_nsec",  len))) ) val  = __atomic_load_n(&locks->hold_nsec, __ATOMIC_RELAXED);
+      else if ( (len ==  9) && (!(strncasecmp(fmt, "wait_hist",  len))) ) hist = locks->wait_hist;
+      else if ( (len ==  9) && (!(strncasecmp(fmt, "hold_hist",  len))) ) hist = locks->hold_hist;
+      else
+      {  REDEBUG("Unknown lock statistic '%.*s' passed to %s_stats xlat", (int)len, fmt, inst->name);
          return(-1);
       };
+      if (hist == NULL)
+         return(snprintf(out, outlen, "%" PRIu64, val));
 
-      // check data type
-      if ( (vp->da->type != PW_TYPE_STRING) && (vp->da->type != PW_TYPE_OCTETS) )
-      {  REDEBUG("%s is not a string or octets", attr_str);
+      // histograms are comma separated counts starting with bucket zero
+      for(idx = 0, pos = 0; ( (idx < RLM_TOTP_LOCK_BUCKETS) && (pos < outlen) ); idx++)
+      {  val  = __atomic_load_n(&hist[idx], __ATOMIC_RELAXED);
+         pos += snprintf(&out[pos], (outlen - pos), "%s%" PRIu64, ((idx)) ? "," : "", val);
+      };
+      if (pos >= outlen)
+      {  REDEBUG("Insufficient space to write TOTP lock histogram");
          *out = '\0';
          return(-1);
       };
+      return(pos);
+   };
 
-      switch(vp->da->type)
-      {  case PW_TYPE_STRING:
-            base32     = vp->data.strvalue;
-            base32_len = vp->length;
-            break;
-
-         case PW_TYPE_OCTETS:
-            key_len  = vp->length;
-            if ((key = talloc_size(request, key_len+1)) == NULL)
-            {  ERROR("totp_code: unable to allocate memory");
-               *out = '\0';
-               return(-1);
-            };
-            memcpy(key, vp->data.octets, key_len);
-            key[key_len] = '\0';
-            break;
-
-         default:
-            REDEBUG("referenced attribute is not string or octets");
-            *out = '\0';
-            return(-1);
+   // local secret store statistics are requested as store.<counter>
+   if ( (len > 6) && (!(strncasecmp(fmt, "store.", 6))) )
+   {  fmt += 6;
+      len -= 6;
+      if      ( (len == 10) && (!(strncasecmp(fmt, "generation", len))) ) val = __atomic_load_n(&inst->store_generation, __ATOMIC_RELAXED);
+      else if ( (len ==  5) && (!(strncasecmp(fmt, "users",      len))) ) val = __atomic_load_n(&inst->store_users,      __ATOMIC_RELAXED);
+      else if ( (len ==  7) && (!(strncasecmp(fmt, "reloads",    len))) ) val = __atomic_load_n(&inst->store_reloads,    __ATOMIC_RELAXED);
+      else if ( (len ==  6) && (!(strncasecmp(fmt, "errors",     len))) ) val = __atomic_load_n(&inst->store_errors,     __ATOMIC_RELAXED);
+      else
+      {  REDEBUG("Unknown store statistic '%.*s' passed to %s_stats xlat", (int)len, fmt, inst->name);
+         return(-1);
       };
+      return(snprintf(out, outlen, "%" PRIu64, val));
    };
 
-   // decode base32 encoded string
-   if (!(key))
-   {  if (totp_base32_decode(request, &key, &key_len, base32, base32_len) < 0)
-      {  *out = '\0';
+   // key arena statistics are requested as arena.<counter>
+   if ( (len > 6) && (!(strncasecmp(fmt, "arena.", 6))) )
+   {  fmt += 6;
+      len -= 6;
+      if      ( (len == 5) && (!(strncasecmp(fmt, "slots",     len))) ) val = inst->arena_size;
+      else if ( (len == 4) && (!(strncasecmp(fmt, "used",      len))) ) val = __atomic_load_n(&inst->arena_used,      __ATOMIC_RELAXED);
+      else if ( (len == 9) && (!(strncasecmp(fmt, "exhausted", len))) ) val = __atomic_load_n(&inst->arena_exhausted, __ATOMIC_RELAXED);
+      else if ( (len == 6) && (!(strncasecmp(fmt, "locked",    len))) ) val = (inst->arena_locked) ? 1 : 0;
+      else
+      {  REDEBUG("Unknown arena statistic '%.*s' passed to %s_stats xlat", (int)len, fmt, inst->name);
          return(-1);
       };
-      key[key_len] = '\0';
+      return(snprintf(out, outlen, "%" PRIu64, val));
    };
 
-   params.key     = key;
-   params.key_len = key_len;
+   for(idx = 0; ((totp_stats_map[idx].name)); idx++)
+   {  if ( (strlen(totp_stats_map[idx].name) != len) || ((strncasecmp(fmt, totp_stats_map[idx].name, len))) )
+         continue;
+      val = __atomic_load_n((uint64_t *)((uint8_t *)&cache->stats + totp_stats_map[idx].offset), __ATOMIC_RELAXED);
+      return(snprintf(out, outlen, "%" PRIu64, val));
+   };
 
-   code = totp_algo_calculate(&params);
-   totp_algo_debug(instance, request, &params);
-   if (code < 0)
-   {  if (code == RLM_TOTP_EEXPIRED)
-         RDEBUG2("TOTP is locked out due to reuse or too many attempts");
-      *out = '\0';
+   REDEBUG("Unknown statistic '%.*s' passed to %s_stats xlat", (int)len, fmt, inst->name);
+
+   return(-1);
+}
+
+
+ssize_t
+totp_xlat_window(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen )
+{
+   ssize_t                 rc;
+   totp_secure_t *         secure;
+   totp_secure_t           secure_buff;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
+
+   // key material is kept in the arena, or on the stack if it is exhausted
+   secure = totp_arena_alloc(instance, &secure_buff);
+   rc     = totp_xlat_window_generate(instance, request, fmt, out, outlen, secure);
+   totp_arena_free(instance, secure);
+
+   return(rc);
+}
+
+
+// writes every code allowed by try_previous, try_next, and time_drift,
+// separated by commas, codes which were used or are locked out are omitted
+ssize_t
+totp_xlat_window_generate(
+         void *                        instance,
+         REQUEST *                     request,
+         char const *                  fmt,
+         char *                        out,
+         size_t                        outlen,
+         totp_secure_t *               secure )
+{
+   ssize_t                 count;
+   ssize_t                 idx;
+   size_t                  pos;
+   size_t                  len;
+   uint64_t                counters[RLM_TOTP_CANDIDATES_MAX];
+   uint32_t                otps[RLM_TOTP_CANDIDATES_MAX];
+   totp_params_t           params;
+
+   rad_assert(instance != NULL);
+   rad_assert(request  != NULL);
+   rad_assert(fmt      != NULL);
+   rad_assert(secure   != NULL);
+
+   if (totp_xlat_params(instance, request, fmt, &params, secure) != 0)
+   {  *out = '\0';
       return(-1);
    };
 
-   if ((size_t)snprintf(out, outlen, "%s" , params.otp) >= outlen)
-   {  REDEBUG("Insufficient space to write TOTP code");
+   if ((count = totp_algo_window(instance, &params, counters, otps)) < 0)
+   {  RDEBUG2("error generating TOTP codes");
+      *out = '\0';
+      return(-1);
+   };
+   if (count == 0)
+   {  RDEBUG2("TOTP is locked out due to reuse or too many attempts");
       *out = '\0';
       return(-1);
    };
 
-   return(0);
+   for(idx = 0, pos = 0; (idx < count); idx++)
+   {  len = (size_t)snprintf(&out[pos], (outlen - pos), "%s%0*u", ((idx)) ? "," : "", (int)params.otp_length, (unsigned)otps[idx]);
+      if (len >= (outlen - pos))
+      {  REDEBUG("Insufficient space to write TOTP codes");
+         *out = '\0';
+         return(-1);
+      };
+      pos += len;
+   };
+
+   return((ssize_t)pos);
 }
 
 
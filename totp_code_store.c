@@ -0,0 +1,900 @@
+/*
+ *  TOTP Code Module for FreeRADIUS
+ *  Copyright (C) 2026 David M. Syzdek <david@syzdek.net>.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ *  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ *  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ *  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file totp_code_store.c
+ * @brief Builds a local TOTP secret store for rlm_totp_code from CSV
+ *
+ * Each line of the CSV file contains the following fields, of which all but
+ * the first two may be empty or omitted:
+ *
+ *    identity,secret,algorithm,otp_length,time_step,start_time,time_offset
+ *
+ * The identity is the value of the attribute named by the module's
+ * "vsa_cache_id" option and the secret is the base32 encoded TOTP key.
+ * Blank lines and lines starting with '#' are ignored.
+ *
+ * @author David M. Syzdek <david@syzdek.net>
+ *
+ * @copyright 2026 David M. Syzdek <david@syzdek.net>
+ */
+
+///////////////
+//           //
+//  Headers  //
+//           //
+///////////////
+// MARK: - Headers
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "totp_code_store.h"
+
+
+///////////////////
+//               //
+//  Definitions  //
+//               //
+///////////////////
+// MARK: - Definitions
+
+#define PROGRAM_NAME                "totp_code_store"
+
+#define STORE_LINE_MAX              4096
+#define STORE_FIELDS_MAX            7
+#define STORE_SEED_TRIES            16
+#define STORE_DISPLACEMENT_MAX      (1 << 24)
+
+#define STORE_ALIGN(_n)             (((_n) + 7) & ~((uint64_t)7))
+
+
+//////////////////
+//              //
+//  Data Types  //
+//              //
+//////////////////
+// MARK: - Data Types
+
+typedef struct _store_entry         store_entry_t;
+typedef struct _store_algorithm     store_algo_t;
+typedef struct _store_group         store_group_t;
+
+
+struct _store_entry
+{  char *                  id;               //!< identity of user
+   size_t                  id_len;           //!< length of identity
+   size_t                  line;             //!< line of CSV file which defined entry
+   uint64_t                hash;             //!< unseeded hash of identity
+   uint32_t                bucket;           //!< bucket selected by seeded hash of identity
+   totp_store_record_t     rec;              //!< record written to store
+};
+
+
+struct _store_algorithm
+{  const char *            name;
+   uint32_t                id;
+};
+
+
+struct _store_group
+{  size_t                  first;            //!< first entry of bucket
+   size_t                  last;             //!< entry after last entry of bucket
+};
+
+
+//////////////////
+//              //
+//  Prototypes  //
+//              //
+//////////////////
+// MARK: - Prototypes
+
+int
+main(
+         int                           argc,
+         char *                        argv[] );
+
+
+static ssize_t
+store_base32_decode(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src );
+
+
+static int
+store_build(
+         totp_store_header_t *         header,
+         store_entry_t *               entries,
+         uint32_t *                    seeds,
+         uint32_t *                    slots );
+
+
+static int
+store_cmp_bucket(
+         const void *                  a,
+         const void *                  b );
+
+
+static int
+store_cmp_group(
+         const void *                  a,
+         const void *                  b );
+
+
+static int
+store_cmp_hash(
+         const void *                  a,
+         const void *                  b );
+
+
+static int
+store_parse(
+         const char *                  filename,
+         store_entry_t **              entriesp,
+         size_t *                      countp );
+
+
+static int
+store_parse_line(
+         const char *                  filename,
+         size_t                        line,
+         char *                        buff,
+         store_entry_t *               entry );
+
+
+static int
+store_parse_number(
+         const char *                  str,
+         int64_t                       min,
+         int64_t                       max,
+         int64_t *                     valp );
+
+
+static void
+store_usage( void );
+
+
+static int
+store_write(
+         const char *                  filename,
+         totp_store_header_t *         header,
+         store_entry_t *               entries,
+         uint32_t *                    seeds,
+         uint32_t *                    slots );
+
+
+static void
+store_zeroize(
+         void *                        ptr,
+         size_t                        len );
+
+
+/////////////////
+//             //
+//  Variables  //
+//             //
+/////////////////
+// MARK: - Variables
+
+static const store_algo_t store_algorithm_map[] =
+{  {  .name = "sha1",   .id = 1 },
+   {  .name = "sha224", .id = 224 },
+   {  .name = "sha256", .id = 256 },
+   {  .name = "sha384", .id = 384 },
+   {  .name = "sha512", .id = 512 },
+   {  .name = NULL,     .id = 0 }
+};
+
+
+static const int8_t store_base32_map[256] =
+{
+//    Same as base32_map in rlm_totp_code.c, which cheats and interprets:
+//       - the numeral zero as the letter "O" as in oscar
+//       - the numeral one as the letter "L" as in lima
+//       - the numeral eight as the letter "B" as in bravo
+// 00  01  02  03  04  05  06  07  08  09  0A  0B  0C  0D  0E  0F
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x00
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x10
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x20
+   14, 11, 26, 27, 28, 29, 30, 31,  1, -1, -1, -1, -1,  0, -1, -1, // 0x30
+   -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 0x40
+   15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1, // 0x50
+   -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, // 0x60
+   15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, -1, -1, -1, -1, // 0x70
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x80
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0x90
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xA0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xB0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xC0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xD0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xE0
+   -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, // 0xF0
+};
+
+
+/////////////////
+//             //
+//  Functions  //
+//             //
+/////////////////
+// MARK: - Functions
+
+int
+main(
+         int                           argc,
+         char *                        argv[] )
+{
+   int                     c;
+   int                     rc;
+   size_t                  count;
+   size_t                  pos;
+   char *                  output;
+   char *                  end;
+   uint64_t                generation;
+   uint32_t *              seeds;
+   uint32_t *              slots;
+   store_entry_t *         entries;
+   totp_store_header_t     header;
+
+   output      = NULL;
+   generation  = (uint64_t)time(NULL);
+
+   while((c = getopt(argc, argv, "g:ho:")) != -1)
+   {  switch(c)
+      {  case 'g':
+            errno      = 0;
+            generation = strtoull(optarg, &end, 10);
+            if ( (errno != 0) || (end == optarg) || (*end != '\0') )
+            {  fprintf(stderr, "%s: invalid generation -- %s\n", PROGRAM_NAME, optarg);
+               return(1);
+            };
+            break;
+
+         case 'h':
+            store_usage();
+            return(0);
+
+         case 'o':
+            output = optarg;
+            break;
+
+         default:
+            fprintf(stderr, "Try `%s -h' for more information.\n", PROGRAM_NAME);
+            return(1);
+      };
+   };
+   if ( (output == NULL) || ((argc - optind) != 1) )
+   {  fprintf(stderr, "%s: missing required argument\n", PROGRAM_NAME);
+      fprintf(stderr, "Try `%s -h' for more information.\n", PROGRAM_NAME);
+      return(1);
+   };
+
+   // read users from CSV
+   if (store_parse(argv[optind], &entries, &count) != 0)
+      return(1);
+   if (count > UINT32_MAX)
+   {  fprintf(stderr, "%s: %s: too many users\n", PROGRAM_NAME, argv[optind]);
+      return(1);
+   };
+
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, TOTP_STORE_MAGIC, sizeof(header.magic));
+   header.version    = TOTP_STORE_VERSION;
+   header.byte_order = TOTP_STORE_BYTE_ORDER;
+   header.generation = generation;
+   header.count      = (uint32_t)count;
+   header.buckets    = (uint32_t)((count + TOTP_STORE_BUCKET_SIZE - 1) / TOTP_STORE_BUCKET_SIZE);
+   header.buckets    = (header.buckets > 0) ? header.buckets : 1;
+
+   seeds = calloc(header.buckets, sizeof(uint32_t));
+   slots = calloc((count > 0) ? count : 1, sizeof(uint32_t));
+   if ( (seeds == NULL) || (slots == NULL) )
+   {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+      return(1);
+   };
+
+   // place users with minimal perfect hash and write store
+   rc = 1;
+   if (store_build(&header, entries, seeds, slots) == 0)
+      if (store_write(output, &header, entries, seeds, slots) == 0)
+         rc = 0;
+
+   for(pos = 0; (pos < count); pos++)
+      free(entries[pos].id);
+   store_zeroize(entries, (sizeof(store_entry_t) * count));
+   free(entries);
+   free(seeds);
+   free(slots);
+
+   return(rc);
+}
+
+
+ssize_t
+store_base32_decode(
+         uint8_t *                     dst,
+         size_t                        dstlen,
+         const char *                  src )
+{
+   size_t                  pos;
+   size_t                  len;
+   size_t                  srclen;
+   uint32_t                bits;
+   uint32_t                nbits;
+   int8_t                  val;
+
+   len    = 0;
+   bits   = 0;
+   nbits  = 0;
+   srclen = strlen(src);
+
+   // decode using the same rules as totp_base32_decode_buff()
+   for(pos = 0; (pos < srclen); pos++)
+   {  if (src[pos] == '=')
+         break;
+      if ((val = store_base32_map[(uint8_t)src[pos]]) == -1)
+         return(-1);
+      bits   = (bits << 5) | (uint32_t)val;
+      nbits += 5;
+      if (nbits < 8)
+         continue;
+      nbits -= 8;
+      if (len >= dstlen)
+         return(-1);
+      dst[len++] = (uint8_t)(bits >> nbits);
+   };
+
+   // verify correct use of padding
+   if (pos < srclen)
+   {  if ((pos % 8) < 2)
+         return(-1);
+      if ((pos + (8 - (pos % 8))) != srclen)
+         return(-1);
+      for(nbits = (uint32_t)pos; (nbits < srclen); nbits++)
+         if (src[nbits] != '=')
+            return(-1);
+   };
+
+   // verify length of data without padding
+   switch(pos % 8)
+   {  case 0:
+      case 2:
+      case 4:
+      case 5:
+      case 7:
+         break;
+
+      default:
+         return(-1);
+   };
+
+   return((ssize_t)len);
+}
+
+
+int
+store_build(
+         totp_store_header_t *         header,
+         store_entry_t *               entries,
+         uint32_t *                    seeds,
+         uint32_t *                    slots )
+{
+   size_t                  count;
+   size_t                  pos;
+   size_t                  first;
+   size_t                  last;
+   size_t                  idx;
+   size_t                  placed;
+   size_t                  groups_len;
+   uint32_t                tries;
+   uint32_t                displacement;
+   uint32_t                slot;
+   uint8_t *               used;
+   store_group_t *         groups;
+
+   count = header->count;
+   if (count == 0)
+      return(0);
+
+   // identical identities always collide, so reject them before searching
+   qsort(entries, count, sizeof(store_entry_t), store_cmp_hash);
+   for(pos = 1; (pos < count); pos++)
+   {  if ( (entries[pos].id_len == entries[pos-1].id_len) &&
+           (!(memcmp(entries[pos].id, entries[pos-1].id, entries[pos].id_len))) )
+      {  fprintf(stderr, "%s: line %zu: duplicate identity \"%s\"\n", PROGRAM_NAME, entries[pos].line, entries[pos].id);
+         return(-1);
+      };
+   };
+
+   used   = calloc(count, sizeof(uint8_t));
+   groups = calloc(header->buckets, sizeof(store_group_t));
+   if ( (used == NULL) || (groups == NULL) )
+   {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+      free(used);
+      free(groups);
+      return(-1);
+   };
+
+   for(tries = 0; (tries < STORE_SEED_TRIES); tries++)
+   {  header->seed = totp_store_hash(&tries, sizeof(tries), header->generation);
+      memset(used,  0, (sizeof(uint8_t)  * count));
+      memset(seeds, 0, (sizeof(uint32_t) * header->buckets));
+
+      // group users by bucket, largest buckets are placed first
+      for(pos = 0; (pos < count); pos++)
+         entries[pos].bucket = totp_store_bucket(header, entries[pos].id, entries[pos].id_len);
+      qsort(entries, count, sizeof(store_entry_t), store_cmp_bucket);
+      groups_len = 0;
+      for(pos = 0; (pos < count); pos = last)
+      {  last = pos + 1;
+         while ( (last < count) && (entries[last].bucket == entries[pos].bucket) )
+            last++;
+         groups[groups_len].first  = pos;
+         groups[groups_len].last   = last;
+         groups_len++;
+      };
+      qsort(groups, groups_len, sizeof(store_group_t), store_cmp_group);
+
+      // find a displacement which places every user of a bucket in an empty slot
+      for(idx = 0, placed = 0; (idx < groups_len); idx++)
+      {  first = groups[idx].first;
+         last  = groups[idx].last;
+         for(displacement = 1; (displacement < STORE_DISPLACEMENT_MAX); displacement++)
+         {  for(pos = first; (pos < last); pos++)
+            {  slot = totp_store_slot(header, displacement, entries[pos].id, entries[pos].id_len);
+               if ((used[slot]))
+                  break;
+               used[slot]  = 1;
+               slots[pos]  = slot;
+            };
+            if (pos == last)
+               break;
+            while (pos > first)
+               used[slots[--pos]] = 0;
+         };
+         if (displacement >= STORE_DISPLACEMENT_MAX)
+            break;
+         seeds[entries[first].bucket] = displacement;
+         placed += last - first;
+      };
+      if (placed == count)
+         break;
+   };
+
+   free(used);
+   free(groups);
+
+   if (tries >= STORE_SEED_TRIES)
+   {  fprintf(stderr, "%s: unable to find a perfect hash for %zu users\n", PROGRAM_NAME, count);
+      return(-1);
+   };
+
+   return(0);
+}
+
+
+int
+store_cmp_bucket(
+         const void *                  a,
+         const void *                  b )
+{
+   const store_entry_t *   x;
+   const store_entry_t *   y;
+
+   x = a;
+   y = b;
+
+   if (x->bucket != y->bucket)
+      return((x->bucket < y->bucket) ? -1 : 1);
+   return((x->line < y->line) ? -1 : (x->line > y->line));
+}
+
+
+// orders buckets from most to fewest users
+int
+store_cmp_group(
+         const void *                  a,
+         const void *                  b )
+{
+   const store_group_t *   x;
+   const store_group_t *   y;
+
+   x = a;
+   y = b;
+
+   if ((x->last - x->first) != (y->last - y->first))
+      return(((x->last - x->first) > (y->last - y->first)) ? -1 : 1);
+   return((x->first < y->first) ? -1 : (x->first > y->first));
+}
+
+
+int
+store_cmp_hash(
+         const void *                  a,
+         const void *                  b )
+{
+   const store_entry_t *   x;
+   const store_entry_t *   y;
+
+   x = a;
+   y = b;
+
+   if (x->hash != y->hash)
+      return((x->hash < y->hash) ? -1 : 1);
+   if (x->id_len != y->id_len)
+      return((x->id_len < y->id_len) ? -1 : 1);
+   return(memcmp(x->id, y->id, x->id_len));
+}
+
+
+int
+store_parse(
+         const char *                  filename,
+         store_entry_t **              entriesp,
+         size_t *                      countp )
+{
+   FILE *                  fp;
+   int                     rc;
+   size_t                  line;
+   size_t                  len;
+   size_t                  count;
+   size_t                  size;
+   store_entry_t *         entries;
+   store_entry_t *         ptr;
+   char                    buff[STORE_LINE_MAX];
+
+   *entriesp = NULL;
+   *countp   = 0;
+
+   if (!(strcmp(filename, "-")))
+      fp = stdin;
+   else if ((fp = fopen(filename, "r")) == NULL)
+   {  fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, filename, strerror(errno));
+      return(-1);
+   };
+
+   entries  = NULL;
+   count    = 0;
+   size     = 0;
+   rc       = 0;
+
+   for(line = 1; ((fgets(buff, sizeof(buff), fp))); line++)
+   {  // strip line ending
+      len = strlen(buff);
+      if ( (len > 0) && (buff[len-1] != '\n') && (!(feof(fp))) )
+      {  fprintf(stderr, "%s: %s:%zu: line too long\n", PROGRAM_NAME, filename, line);
+         rc = -1;
+         break;
+      };
+      while ( (len > 0) && ((buff[len-1] == '\n') || (buff[len-1] == '\r')) )
+         buff[--len] = '\0';
+      if ( (len == 0) || (buff[0] == '#') )
+         continue;
+
+      if (count >= size)
+      {  size = (size > 0) ? (size * 2) : 1024;
+         if ((ptr = realloc(entries, (sizeof(store_entry_t) * size))) == NULL)
+         {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+            rc = -1;
+            break;
+         };
+         entries = ptr;
+      };
+
+      if ((rc = store_parse_line(filename, line, buff, &entries[count])) != 0)
+      {  free(entries[count].id);
+         break;
+      };
+      count++;
+   };
+   store_zeroize(buff, sizeof(buff));
+
+   if ( (rc == 0) && ((ferror(fp))) )
+   {  fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, filename, strerror(errno));
+      rc = -1;
+   };
+
+   if (rc != 0)
+   {  if (fp != stdin)
+         fclose(fp);
+      for(len = 0; (len < count); len++)
+         free(entries[len].id);
+      if ((entries))
+         store_zeroize(entries, (sizeof(store_entry_t) * count));
+      free(entries);
+      return(-1);
+   };
+   if (fp != stdin)
+      fclose(fp);
+
+   *entriesp = entries;
+   *countp   = count;
+
+   return(0);
+}
+
+
+int
+store_parse_line(
+         const char *                  filename,
+         size_t                        line,
+         char *                        buff,
+         store_entry_t *               entry )
+{
+   int                     idx;
+   int                     fields_len;
+   ssize_t                 len;
+   int64_t                 val;
+   char *                  fields[STORE_FIELDS_MAX];
+   char *                  next;
+
+   memset(entry, 0, sizeof(store_entry_t));
+   entry->line = line;
+
+   // split fields
+   fields_len = 0;
+   for(next = buff; ((next)); fields_len++)
+   {  if (fields_len >= STORE_FIELDS_MAX)
+      {  fprintf(stderr, "%s: %s:%zu: too many fields\n", PROGRAM_NAME, filename, line);
+         return(-1);
+      };
+      fields[fields_len] = next;
+      if ((next = strchr(next, ',')) != NULL)
+         *next++ = '\0';
+   };
+   for(idx = fields_len; (idx < STORE_FIELDS_MAX); idx++)
+      fields[idx] = "";
+
+   // identity
+   if (fields[0][0] == '\0')
+   {  fprintf(stderr, "%s: %s:%zu: missing identity\n", PROGRAM_NAME, filename, line);
+      return(-1);
+   };
+   entry->id_len = strlen(fields[0]);
+   if ((entry->id = strdup(fields[0])) == NULL)
+   {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+      return(-1);
+   };
+   entry->hash = totp_store_hash(entry->id, entry->id_len, 0);
+
+   // secret
+   len = store_base32_decode(entry->rec.key, sizeof(entry->rec.key), fields[1]);
+   store_zeroize(fields[1], strlen(fields[1]));
+   if (len < 1)
+   {  fprintf(stderr, "%s: %s:%zu: invalid or missing base32 secret\n", PROGRAM_NAME, filename, line);
+      return(-1);
+   };
+   entry->rec.key_len = (uint32_t)len;
+
+   // algorithm
+   if (fields[2][0] != '\0')
+   {  next = fields[2];
+      if (!(strncasecmp(next, "HMAC", 4)))
+         next = (next[4] == '-') ? &next[5] : &next[4];
+      for(idx = 0; ((store_algorithm_map[idx].name)); idx++)
+         if (!(strcasecmp(next, store_algorithm_map[idx].name)))
+            break;
+      if (store_algorithm_map[idx].name == NULL)
+      {  fprintf(stderr, "%s: %s:%zu: unknown algorithm \"%s\"\n", PROGRAM_NAME, filename, line, fields[2]);
+         return(-1);
+      };
+      entry->rec.algorithm  = store_algorithm_map[idx].id;
+      entry->rec.flags     |= TOTP_STORE_ALGORITHM;
+   };
+
+   // otp_length
+   if (fields[3][0] != '\0')
+   {  if (store_parse_number(fields[3], 1, 9, &val) != 0)
+      {  fprintf(stderr, "%s: %s:%zu: invalid otp_length\n", PROGRAM_NAME, filename, line);
+         return(-1);
+      };
+      entry->rec.otp_length = (uint32_t)val;
+      entry->rec.flags     |= TOTP_STORE_OTP_LENGTH;
+   };
+
+   // time_step
+   if (fields[4][0] != '\0')
+   {  if (store_parse_number(fields[4], 1, UINT32_MAX, &val) != 0)
+      {  fprintf(stderr, "%s: %s:%zu: invalid time_step\n", PROGRAM_NAME, filename, line);
+         return(-1);
+      };
+      entry->rec.time_step  = (uint32_t)val;
+      entry->rec.flags     |= TOTP_STORE_TIME_STEP;
+   };
+
+   // start_time
+   if (fields[5][0] != '\0')
+   {  if (store_parse_number(fields[5], 0, INT64_MAX, &val) != 0)
+      {  fprintf(stderr, "%s: %s:%zu: invalid start_time\n", PROGRAM_NAME, filename, line);
+         return(-1);
+      };
+      entry->rec.start_time = (uint64_t)val;
+      entry->rec.flags     |= TOTP_STORE_START_TIME;
+   };
+
+   // time_offset
+   if (fields[6][0] != '\0')
+   {  if (store_parse_number(fields[6], INT32_MIN, INT32_MAX, &val) != 0)
+      {  fprintf(stderr, "%s: %s:%zu: invalid time_offset\n", PROGRAM_NAME, filename, line);
+         return(-1);
+      };
+      entry->rec.time_offset  = val;
+      entry->rec.flags       |= TOTP_STORE_TIME_OFFSET;
+   };
+
+   return(0);
+}
+
+
+int
+store_parse_number(
+         const char *                  str,
+         int64_t                       min,
+         int64_t                       max,
+         int64_t *                     valp )
+{
+   long long               val;
+   char *                  end;
+
+   errno = 0;
+   val   = strtoll(str, &end, 10);
+   if ( (errno != 0) || (end == str) || (*end != '\0') )
+      return(-1);
+   if ( (val < min) || (val > max) )
+      return(-1);
+   *valp = (int64_t)val;
+   return(0);
+}
+
+
+void
+store_usage( void )
+{
+   printf("Usage: %s [OPTIONS] -o <store> <csv>\n", PROGRAM_NAME);
+   printf("OPTIONS:\n");
+   printf("  -g generation             generation of store (default: current time)\n");
+   printf("  -h                        display this message\n");
+   printf("  -o store                  store file to create or replace\n");
+   printf("CSV FIELDS:\n");
+   printf("  identity,secret[,algorithm,otp_length,time_step,start_time,time_offset]\n");
+   printf("\n");
+   return;
+}
+
+
+int
+store_write(
+         const char *                  filename,
+         totp_store_header_t *         header,
+         store_entry_t *               entries,
+         uint32_t *                    seeds,
+         uint32_t *                    slots )
+{
+   int                     fd;
+   size_t                  pos;
+   size_t                  off;
+   ssize_t                 len;
+   uint8_t *               buff;
+   char *                  tmpname;
+   totp_store_record_t *   records;
+
+   // calculate layout of file
+   header->seeds_offset    = STORE_ALIGN(sizeof(totp_store_header_t));
+   header->records_offset  = STORE_ALIGN(header->seeds_offset + (sizeof(uint32_t) * header->buckets));
+   header->ids_offset      = header->records_offset + (sizeof(totp_store_record_t) * header->count);
+   header->ids_len         = 0;
+   for(pos = 0; (pos < header->count); pos++)
+      header->ids_len += entries[pos].id_len;
+   header->file_len        = STORE_ALIGN(header->ids_offset + header->ids_len);
+
+   if ((buff = calloc(1, header->file_len)) == NULL)
+   {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+      return(-1);
+   };
+   if ((tmpname = malloc(strlen(filename) + 8)) == NULL)
+   {  fprintf(stderr, "%s: out of virtual memory\n", PROGRAM_NAME);
+      free(buff);
+      return(-1);
+   };
+
+   // copy records into the slots chosen by the perfect hash
+   memcpy(buff, header, sizeof(totp_store_header_t));
+   memcpy(&buff[header->seeds_offset], seeds, (sizeof(uint32_t) * header->buckets));
+   records = (totp_store_record_t *)&buff[header->records_offset];
+   for(pos = 0, off = 0; (pos < header->count); pos++)
+   {  entries[pos].rec.id_offset = off;
+      entries[pos].rec.id_len    = (uint32_t)entries[pos].id_len;
+      memcpy(&records[slots[pos]], &entries[pos].rec, sizeof(totp_store_record_t));
+      memcpy(&buff[header->ids_offset + off], entries[pos].id, entries[pos].id_len);
+      off += entries[pos].id_len;
+   };
+
+   // write to a temporary file which replaces the store once complete
+   snprintf(tmpname, (strlen(filename) + 8), "%s.XXXXXX", filename);
+   if ((fd = mkstemp(tmpname)) == -1)
+   {  fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, tmpname, strerror(errno));
+      store_zeroize(buff, header->file_len);
+      free(buff);
+      free(tmpname);
+      return(-1);
+   };
+   fchmod(fd, S_IRUSR | S_IWUSR);
+   for(off = 0; (off < header->file_len); off += (size_t)len)
+      if ((len = write(fd, &buff[off], (header->file_len - off))) < 1)
+         break;
+   store_zeroize(buff, header->file_len);
+   free(buff);
+
+   if ( (off < header->file_len) || (fsync(fd) == -1) )
+   {  fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, tmpname, strerror(errno));
+      close(fd);
+      unlink(tmpname);
+      free(tmpname);
+      return(-1);
+   };
+   if ( (close(fd) == -1) || (rename(tmpname, filename) == -1) )
+   {  fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, filename, strerror(errno));
+      unlink(tmpname);
+      free(tmpname);
+      return(-1);
+   };
+   free(tmpname);
+
+   return(0);
+}
+
+
+void
+store_zeroize(
+         void *                        ptr,
+         size_t                        len )
+{
+   volatile uint8_t *      p;
+
+   for(p = ptr; (len > 0); len--)
+      *p++ = 0;
+
+   return;
+}
+
+
+/* end of source */
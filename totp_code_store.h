@@ -0,0 +1,181 @@
+/*
+ *  TOTP Code Module for FreeRADIUS
+ *  Copyright (C) 2026 David M. Syzdek <david@syzdek.net>.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are
+ *  met:
+ *
+ *     1. Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *     2. Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in the
+ *        documentation and/or other materials provided with the distribution.
+ *
+ *     3. Neither the name of the copyright holder nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ *  IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ *  THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ *  PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ *  CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ *  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ *  PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ *  LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ *  NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ *  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file totp_code_store.h
+ * @brief On-disk format of the local TOTP secret store
+ *
+ * The store is written by totp_code_store and mapped read-only by
+ * rlm_totp_code.  Records are placed by a minimal perfect hash of the user's
+ * identity, so a lookup reads one displacement seed and one record.
+ *
+ * @author David M. Syzdek <david@syzdek.net>
+ *
+ * @copyright 2026 David M. Syzdek <david@syzdek.net>
+ */
+#ifndef _TOTP_CODE_STORE_H
+#define _TOTP_CODE_STORE_H 1
+
+///////////////
+//           //
+//  Headers  //
+//           //
+///////////////
+// MARK: - Headers
+
+#include <stddef.h>
+#include <inttypes.h>
+
+
+///////////////////
+//               //
+//  Definitions  //
+//               //
+///////////////////
+// MARK: - Definitions
+
+#define TOTP_STORE_MAGIC            "TOTPSTOR"
+#define TOTP_STORE_VERSION          1
+#define TOTP_STORE_BYTE_ORDER       0x01020304
+#define TOTP_STORE_KEY_MAX          128
+#define TOTP_STORE_BUCKET_SIZE      4
+
+// record fields which override the module's configuration
+#define TOTP_STORE_ALGORITHM        0x01
+#define TOTP_STORE_OTP_LENGTH       0x02
+#define TOTP_STORE_TIME_STEP        0x04
+#define TOTP_STORE_START_TIME       0x08
+#define TOTP_STORE_TIME_OFFSET      0x10
+
+
+//////////////////
+//              //
+//  Data Types  //
+//              //
+//////////////////
+// MARK: - Data Types
+
+typedef struct _totp_store_header   totp_store_header_t;
+typedef struct _totp_store_record   totp_store_record_t;
+
+
+// offsets are from the start of the file and are aligned to 8 bytes
+struct _totp_store_header
+{  char                    magic[8];         //!< TOTP_STORE_MAGIC without terminator
+   uint32_t                version;          //!< TOTP_STORE_VERSION
+   uint32_t                byte_order;       //!< TOTP_STORE_BYTE_ORDER in the writer's byte order
+   uint64_t                generation;       //!< version of the data, increases with each build
+   uint64_t                file_len;         //!< length of the file in bytes
+   uint64_t                seed;             //!< seed of hash which selects a bucket
+   uint32_t                count;            //!< number of records
+   uint32_t                buckets;          //!< number of displacement seeds
+   uint64_t                seeds_offset;     //!< uint32_t displacement seed for each bucket
+   uint64_t                records_offset;   //!< records indexed by perfect hash
+   uint64_t                ids_offset;       //!< identities referenced by records
+   uint64_t                ids_len;          //!< length of identities in bytes
+};
+
+
+struct _totp_store_record
+{  uint64_t                id_offset;        //!< offset of identity from ids_offset
+   uint32_t                id_len;           //!< length of identity
+   uint32_t                flags;            //!< fields which override the module's configuration
+   uint64_t                start_time;       //!< Unix time to start counting time steps [T0]
+   int64_t                 time_offset;      //!< seconds to adjust current time
+   uint32_t                time_step;        //!< time step in seconds [X]
+   uint32_t                otp_length;       //!< length of One-Time-Password [Digit]
+   uint32_t                algorithm;        //!< HMAC algorithm (1, 224, 256, 384, or 512)
+   uint32_t                key_len;          //!< length of decoded key
+   uint8_t                 key[TOTP_STORE_KEY_MAX]; //!< decoded key [K]
+};
+
+
+/////////////////
+//             //
+//  Functions  //
+//             //
+/////////////////
+// MARK: - Functions
+
+// 64-bit FNV-1a of the identity, finished with the MurmurHash3 mixer
+static inline uint64_t
+totp_store_hash(
+         const void *                  data,
+         size_t                        len,
+         uint64_t                      seed )
+{
+   const uint8_t *         p;
+   uint64_t                h;
+
+   h = 0xcbf29ce484222325ULL ^ seed;
+   for(p = data; (len > 0); len--, p++)
+   {  h ^= *p;
+      h *= 0x100000001b3ULL;
+   };
+
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+
+   return(h);
+}
+
+
+static inline uint32_t
+totp_store_bucket(
+         const totp_store_header_t *   header,
+         const void *                  id,
+         size_t                        id_len )
+{
+   return((uint32_t)(totp_store_hash(id, id_len, header->seed) % header->buckets));
+}
+
+
+static inline uint32_t
+totp_store_slot(
+         const totp_store_header_t *   header,
+         uint32_t                      displacement,
+         const void *                  id,
+         size_t                        id_len )
+{
+   uint64_t                seed;
+
+   seed = header->seed ^ ((uint64_t)displacement << 32) ^ displacement;
+
+   return((uint32_t)(totp_store_hash(id, id_len, seed) % header->count));
+}
+
+#endif // _TOTP_CODE_STORE_H
+/* end of header */